@@ -34,8 +34,11 @@
 #include "tftpsubs.h"
 
 /* Simple minded read-ahead/write-behind subroutines for tftp user and
-   server.  Written originally with multiple buffers in mind, but current
-   implementation has two buffer logic wired in.
+   server.  Written originally with multiple buffers in mind; each
+   transfer now has a ring of as many buffers as it wants.  The file
+   is read and written with pread() and pwrite() at the position kept
+   in the rw_state, so its descriptor's own offset doesn't matter;
+   except for a pipe or terminal, which is read and written in order.
 
    Todo:  add some sort of final error check so when the write-buffer
    is finally flushed, the caller can detect if the disk filled up
@@ -45,131 +48,448 @@
  */
 
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define PKTSIZE MAX_SEGSIZE+4   /* should be moved to tftp.h */
+#define NA_STAGE 16384          /* Text read at once for netascii */
 
 int segsize = SEGSIZE;          /* Default segsize */
 
-struct bf {
-    int counter;                /* size of data in buffer, or flag */
-    char buf[PKTSIZE];          /* room for data packet */
-} bfs[2];
-
                                 /* Values for bf.counter  */
 #define BF_ALLOC -3             /* alloc'd but not yet filled */
 #define BF_FREE  -2             /* free */
 /* [-1 .. segsize] = size of data in the data buffer */
 
-static int nextone;             /* index of next buffer to use */
-static int current;             /* index of buffer in use */
-
-                                /* control flags for crlf conversions */
-int newline = 0;                /* fillbuf: in middle of newline expansion */
-int prevchar = -1;              /* putbuf: previous char (cr check) */
+/* State used by the old single-transfer interface (the client) */
+static struct rw_state rw_global;
 
-static struct tftphdr *rw_init(int);
+static struct tftphdr *rw_init(struct rw_state *, int, int, int);
 
-struct tftphdr *w_init()
+struct tftphdr *rw_w_init(struct rw_state *rs, int size, int depth)
 {
-    return rw_init(0);
+    return rw_init(rs, size, depth, 0);
 }                               /* write-behind */
 
-struct tftphdr *r_init()
+struct tftphdr *rw_r_init(struct rw_state *rs, int size, int depth)
 {
-    return rw_init(1);
+    return rw_init(rs, size, depth, 1);
 }                               /* read-ahead */
 
+#define NEXT(rs, i)	((i) + 1 == (rs)->depth ? 0 : (i) + 1)
+
 /* init for either read-ahead or write-behind */
 /* x == zero for write-behind, one for read-head */
-static struct tftphdr *rw_init(int x)
+static struct tftphdr *rw_init(struct rw_state *rs, int size, int depth,
+                               int x)
+{
+    int i;
+
+    if (depth < 2)
+        depth = 2;
+
+    /* Buffers only need to hold one packet of the negotiated size */
+    if (rs->depth != depth || rs->bufsize < size + 4) {
+        rw_free(rs);
+        rs->bfs = xmalloc(depth * sizeof *rs->bfs);
+        for (i = 0; i < depth; i++)
+            rs->bfs[i].buf = xmalloc(size + 4);
+        rs->depth = depth;
+        rs->bufsize = size + 4;
+    }
+    rs->segsize = size;
+    rs->newline = 0;            /* init crlf flag */
+    rs->prevchar = -1;
+    rs->eof = 0;
+    rs->pos = 0;
+    rs->seq = rs->held = 0;
+    rs->src = NULL;
+    rs->stagepos = rs->stagelen = 0;
+    rs->busy = 0;
+    for (i = 1; i < depth; i++)
+        rs->bfs[i].counter = BF_FREE;
+    rs->bfs[0].counter = BF_ALLOC;      /* pass out the first buffer */
+    rs->current = 0;
+    rs->nextone = x;            /* ahead or behind? */
+    return (struct tftphdr *)rs->bfs[0].buf;
+}
+
+/* Read from memory rather than from a file; only for octet transfers */
+void rw_r_mem(struct rw_state *rs, const void *p, size_t len)
 {
-    newline = 0;                /* init crlf flag */
-    prevchar = -1;
-    bfs[0].counter = BF_ALLOC;  /* pass out the first buffer */
-    current = 0;
-    bfs[1].counter = BF_FREE;
-    nextone = x;                /* ahead or behind? */
-    return (struct tftphdr *)bfs[0].buf;
+    rs->src = p;
+    rs->srclen = len;
+    rs->srcpos = 0;
 }
 
-/* Have emptied current buffer by sending to net and getting ack.
-   Free it and return next buffer filled with data.
+/* Release the buffers of a transfer */
+void rw_free(struct rw_state *rs)
+{
+    int i;
+
+    for (i = 0; i < rs->depth; i++)
+        free(rs->bfs[i].buf);
+    free(rs->bfs);
+    rs->bfs = NULL;
+    rs->depth = 0;
+    rs->bufsize = 0;
+    free(rs->stage);
+    rs->stage = NULL;
+    rs->stagepos = rs->stagelen = 0;
+}
+
+/*
+ * Find the first a or b in p[0..n), or return n.  The vector versions
+ * look at 32 or 16 bytes at a time; which one is used is up to the
+ * compiler flags.
  */
-int readit(FILE * file, struct tftphdr **dpp, int convert)
+static size_t na_scan(const char *p, size_t n, char a, char b)
 {
-    struct bf *b;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    __m256i v;
+    unsigned int m;
+
+    for (; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(p + i));
+        m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                 _mm256_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#elif defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i v;
+    unsigned int m;
+
+    for (; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                           _mm_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == a || p[i] == b)
+            break;
+    }
+    return i;
+}
 
-    bfs[current].counter = BF_FREE;     /* free old one */
-    current = !current;         /* "incr" current */
+/*
+ * Convert text to netascii, LF -> CR,LF and CR -> CR,NUL, from src
+ * until either it or dst runs out.  Returns the number of bytes put
+ * in dst, and sets *srclen to the number used up.  *newline is set if
+ * the second byte of a pair didn't fit, and *prevchar to the last CR
+ * or LF converted, as in struct rw_state.
+ */
+size_t netascii_encode(char *dst, size_t dstlen, const char *src,
+                       size_t *srclen, int *newline, int *prevchar)
+{
+    size_t in = 0, out = 0, n, run;
 
-    b = &bfs[current];          /* look at new buffer */
-    if (b->counter == BF_FREE)  /* if it's empty */
-        read_ahead(file, convert);      /* fill it */
-    /*      assert(b->counter != BF_FREE);*//* check */
-    *dpp = (struct tftphdr *)b->buf;    /* set caller's ptr */
-    return b->counter;
+    for (;;) {
+        if (*newline) {
+            if (out == dstlen)
+                break;
+            dst[out++] = (*prevchar == '\n') ? '\n' : '\0';
+            *newline = 0;
+        }
+
+        /* Copy the text up to the next CR or LF as it is */
+        n = *srclen - in;
+        if (n > dstlen - out)
+            n = dstlen - out;
+        run = na_scan(src + in, n, '\r', '\n');
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+        if (run == n)
+            break;
+
+        *prevchar = src[in++];
+        dst[out++] = '\r';
+        *newline = 1;
+    }
+
+    *srclen = in;
+    return out;
+}
+
+/*
+ * Convert netascii to text in place, CR,LF -> LF and CR,NUL -> CR; a
+ * CR followed by anything else is left alone.  *prevchar is the last
+ * byte of the previous buffer, and is set to the last byte of this
+ * one.  Returns the length of the text; if the buffer started with the
+ * LF of a CR,LF, *backup is set, and the first byte of the text
+ * replaces the CR already written out at the end of the last one.
+ */
+size_t netascii_decode(char *buf, size_t len, int *prevchar, int *backup)
+{
+    size_t in = 0, out = 0, run;
+
+    *backup = 0;
+    if (!len)
+        return 0;
+
+    if (*prevchar == '\r') {
+        if (buf[0] == '\n') {
+            *backup = 1;
+            out = in = 1;
+        } else if (buf[0] == '\0') {
+            in = 1;
+        }
+    }
+    *prevchar = (unsigned char)buf[len - 1];
+
+    while (in < len) {
+        run = na_scan(buf + in, len - in, '\r', '\r');
+        if (out != in)
+            memmove(buf + out, buf + in, run);
+        in += run;
+        out += run;
+        if (in == len)
+            break;
+
+        buf[out++] = '\r';
+        if (++in == len)
+            break;
+        if (buf[in] == '\n') {
+            buf[out - 1] = '\n';
+            in++;
+        } else if (buf[in] == '\0') {
+            in++;
+        }
+    }
+
+    return out;
 }
 
 /*
- * fill the input buffer, doing ascii conversions if requested
+ * Read from the file at the current position.  A pipe is read until
+ * len bytes or the end of it, so that only the end of the file makes
+ * a short block.
+ */
+static ssize_t rw_in(struct rw_state *rs, int fd, char *buf, size_t len)
+{
+    ssize_t n, total = 0;
+
+    if (!rs->seq) {
+        n = pread(fd, buf, len, rs->pos);
+        if (n > 0)
+            rs->pos += n;
+        return n;
+    }
+
+    while ((size_t)total < len) {
+        n = read(fd, buf + total, len - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && !total)
+            return -1;
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    rs->pos += total;
+    return total;
+}
+
+/* Write to the file at the current position */
+static ssize_t rw_out(struct rw_state *rs, int fd, const char *buf,
+                      size_t len)
+{
+    ssize_t n;
+
+    if (rs->seq) {
+        while ((n = write(fd, buf, len)) < 0 && errno == EINTR)
+            ;
+    } else {
+        n = pwrite(fd, buf, len, rs->pos);
+    }
+    if (n > 0)
+        rs->pos += n;
+    return n;
+}
+
+/*
+ * fill the next input buffer, doing ascii conversions if requested
  * conversions are  lf -> cr,lf  and cr -> cr, nul
  */
-void read_ahead(FILE * file, int convert)
+static void rw_fill(struct rw_state *rs, int fd, int convert)
 {
-    int i;
-    char *p;
-    int c;
+    size_t len, n;
+    ssize_t rv;
     struct bf *b;
     struct tftphdr *dp;
 
-    b = &bfs[nextone];          /* look at "next" buffer */
+    b = &rs->bfs[rs->nextone];  /* look at "next" buffer */
     if (b->counter != BF_FREE)  /* nop if not free */
         return;
-    nextone = !nextone;         /* "incr" next buffer ptr */
+    rs->nextone = NEXT(rs, rs->nextone);        /* "incr" next buffer ptr */
 
     dp = (struct tftphdr *)b->buf;
 
-    if (convert == 0) {
-        b->counter = read(fileno(file), dp->th_data, segsize);
-        return;
-    }
-
-    p = dp->th_data;
-    for (i = 0; i < segsize; i++) {
-        if (newline) {
-            if (prevchar == '\n')
-                c = '\n';       /* lf to cr,lf */
-            else
-                c = '\0';       /* cr to cr,nul */
-            newline = 0;
-        } else {
-            c = getc(file);
-            if (c == EOF)
+    if (rs->src) {
+        size_t left = rs->srclen - rs->srcpos;
+
+        b->counter = left < (size_t)rs->segsize ? (int)left : rs->segsize;
+        memcpy(dp->th_data, rs->src + rs->srcpos, b->counter);
+        rs->srcpos += b->counter;
+    } else if (convert == 0) {
+        b->counter = rw_in(rs, fd, dp->th_data, rs->segsize);
+    } else {
+        /* Convert a staging buffer full of text at a time */
+        if (!rs->stage)
+            rs->stage = xmalloc(NA_STAGE);
+        len = 0;
+        for (;;) {
+            n = rs->stagelen - rs->stagepos;
+            len += netascii_encode(dp->th_data + len, rs->segsize - len,
+                                   rs->stage + rs->stagepos, &n,
+                                   &rs->newline, &rs->prevchar);
+            rs->stagepos += n;
+            if (len == (size_t)rs->segsize)
+                break;
+            rs->stagepos = rs->stagelen = 0;
+            rv = rw_in(rs, fd, rs->stage, NA_STAGE);
+            if (rv < 0 && !len) {
+                len = (size_t)-1;       /* Error, as for binary */
                 break;
-            if (c == '\n' || c == '\r') {
-                prevchar = c;
-                c = '\r';
-                newline = 1;
             }
+            if (rv <= 0 && !rs->newline)
+                break;
+            if (rv > 0)
+                rs->stagelen = rv;
         }
-        *p++ = c;
+        b->counter = (int)len;
+    }
+
+    if (b->counter < rs->segsize)
+        rs->eof = 1;
+}
+
+/* Have emptied current buffer by sending to net and getting ack.
+   Free it and return next buffer filled with data.
+ */
+int rw_readit(struct rw_state *rs, int fd, struct tftphdr **dpp,
+              int convert)
+{
+    struct bf *b;
+
+    rs->bfs[rs->current].counter = BF_FREE;     /* free old one */
+    rs->current = NEXT(rs, rs->current);        /* "incr" current */
+
+    b = &rs->bfs[rs->current];  /* look at new buffer */
+    if (b->counter == BF_FREE)  /* if it's empty */
+        rw_fill(rs, fd, convert);     /* fill it */
+    *dpp = (struct tftphdr *)b->buf;    /* set caller's ptr */
+    return b->counter;
+}
+
+/*
+ * Fill all the free buffers ahead of the current one, stopping at the
+ * end of the file.
+ */
+void rw_read_ahead(struct rw_state *rs, int fd, int convert)
+{
+    while (!rs->eof && rs->bfs[rs->nextone].counter == BF_FREE)
+        rw_fill(rs, fd, convert);
+}
+
+/*
+ * Return the n'th block after the current one (0 < n < depth), reading
+ * it and anything before it as needed.  The current block stays in
+ * use, so a window of blocks can be sent and resent from the ring.
+ */
+int rw_peek(struct rw_state *rs, int fd, int n, struct tftphdr **dpp,
+            int convert)
+{
+    struct bf *b = &rs->bfs[(rs->current + n) % rs->depth];
+
+    while (b->counter == BF_FREE)
+        rw_fill(rs, fd, convert);
+    *dpp = (struct tftphdr *)b->buf;
+    return b->counter;
+}
+
+/*
+ * Read block k (counting from 1) of a binary file into the slot'th
+ * buffer, straight from its offset in the file, whatever else has
+ * been read; so a block can be read again to resend it instead of
+ * being kept until it has been acknowledged.  The ring is left alone.
+ */
+int rw_pread(struct rw_state *rs, int fd, unsigned long long k, int slot,
+             struct tftphdr **dpp)
+{
+    struct tftphdr *dp = (struct tftphdr *)rs->bfs[slot % rs->depth].buf;
+
+    *dpp = dp;
+    return pread(fd, dp->th_data, rs->segsize, (off_t)(k - 1) * rs->segsize);
+}
+
+/*
+ * The n blocks starting at the current one have been acknowledged;
+ * free them.  The block after them becomes the current one.
+ */
+void rw_release(struct rw_state *rs, int n)
+{
+    while (n--) {
+        rs->bfs[rs->current].counter = BF_FREE;
+        rs->current = NEXT(rs, rs->current);
     }
-    b->counter = (int)(p - dp->th_data);
+}
+
+/* Mark the buffer in use as holding ct bytes to be written out, and
+   move on to the next one */
+void rw_w_put(struct rw_state *rs, int ct)
+{
+    rs->bfs[rs->current].counter = ct;  /* set size of data to write */
+    rs->current = NEXT(rs, rs->current);        /* switch to next buffer */
+}
+
+/* Hand out the buffer in use, or NULL if the data in it hasn't been
+   written out yet */
+struct tftphdr *rw_w_get(struct rw_state *rs)
+{
+    if (rs->bfs[rs->current].counter != BF_FREE)        /* if not free */
+        return NULL;
+    rs->bfs[rs->current].counter = BF_ALLOC;    /* mark as alloc'd */
+    return (struct tftphdr *)rs->bfs[rs->current].buf;
 }
 
 /* Update count associated with the buffer, get new buffer
-   from the queue.  Calls write_behind only if next buffer not
-   available.
+   from the queue.  Writes out the queue only once every buffer
+   in it is full.  Returns ct, or -1 if writing out failed.
  */
-int writeit(FILE * file, struct tftphdr **dpp, int ct, int convert)
+int rw_writeit(struct rw_state *rs, int fd, struct tftphdr **dpp,
+               int ct, int convert)
+{
+    rw_w_put(rs, ct);
+    if (!(*dpp = rw_w_get(rs))) {
+        if (rw_flush(rs, fd, convert) < 0)      /* flush them all */
+            return -1;
+        *dpp = rw_w_get(rs);
+    }
+    return ct;
+}
+
+/* Number of buffers waiting to be written out, not counting those
+   being written */
+int rw_pending(struct rw_state *rs)
 {
-    bfs[current].counter = ct;  /* set size of data to write */
-    current = !current;         /* switch to other buffer */
-    if (bfs[current].counter != BF_FREE)        /* if not free */
-        (void)write_behind(file, convert);      /* flush it */
-    bfs[current].counter = BF_ALLOC;    /* mark as alloc'd */
-    *dpp = (struct tftphdr *)bfs[current].buf;
-    return ct;                  /* this is a lie of course */
+    int i, n = 0;
+
+    for (i = rs->nextone; rs->bfs[i].counter >= -1 && n < rs->depth;
+         i = NEXT(rs, i))
+        n++;
+    return n - rs->busy;
 }
 
 /*
@@ -178,48 +498,203 @@ int writeit(FILE * file, struct tftphdr **dpp, int ct, int convert)
  * Note spec is undefined if we get CR as last byte of file or a
  * CR followed by anything else.  In this case we leave it alone.
  */
-int write_behind(FILE * file, int convert)
+int rw_write_behind(struct rw_state *rs, int fd, int convert)
 {
     char *buf;
     int count;
-    int ct;
-    char *p;
-    int c;                      /* current character */
+    size_t len;
+    ssize_t n;
+    int backup;
     struct bf *b;
     struct tftphdr *dp;
 
-    b = &bfs[nextone];
+    b = &rs->bfs[rs->nextone];
     if (b->counter < -1)        /* anything to flush? */
         return 0;               /* just nop if nothing to do */
 
     count = b->counter;         /* remember byte count */
     b->counter = BF_FREE;       /* reset flag */
     dp = (struct tftphdr *)b->buf;
-    nextone = !nextone;         /* incr for next time */
+    rs->nextone = NEXT(rs, rs->nextone);        /* incr for next time */
     buf = dp->th_data;
 
-    if (count <= 0)
+    if (count < 0)
         return -1;              /* nak logic? */
 
-    if (convert == 0)
-        return write(fileno(file), buf, count);
-
-    p = buf;
-    ct = count;
-    while (ct--) {              /* loop over the buffer */
-        c = *p++;               /* pick up a character */
-        if (prevchar == '\r') { /* if prev char was cr */
-            if (c == '\n')      /* if have cr,lf then just */
-                fseek(file, -1, 1);     /* smash lf on top of the cr */
-            else if (c == '\0') /* if have cr,nul then */
-                goto skipit;    /* just skip over the putc */
-            /* else just fall through and allow it */
+    if (convert == 0) {
+        n = rw_out(rs, fd, buf, count);
+        if (n >= 0 && n != count)
+            errno = ENOSPC;     /* A short write means the disk is full */
+        return n == count ? n : -1;
+    }
+
+    len = netascii_decode(buf, count, &rs->prevchar, &backup);
+    if (!rs->seq) {
+        if (backup)
+            rs->pos--;          /* smash lf on top of the cr */
+    } else {
+        /* We can't go back over a CR, so one which ends a full block
+           waits to see what comes next; the lf takes its place */
+        if (rs->held && !backup &&
+            (n = rw_out(rs, fd, "\r", 1)) != 1)
+            goto err;
+        rs->held = 0;
+        if (count == rs->segsize && rs->prevchar == '\r') {
+            len--;
+            rs->held = 1;
         }
-        putc(c, file);
-      skipit:
-        prevchar = c;
     }
+    if (len && (n = rw_out(rs, fd, buf, len)) != (ssize_t)len)
+        goto err;
     return count;
+
+  err:
+    if (n >= 0)
+        errno = ENOSPC;
+    return -1;
+}
+
+/*
+ * Write out every buffer waiting in the queue; binary data goes out
+ * with a single pwritev(), or writev() to a pipe.  Returns the number of bytes written, or
+ * -1 on error.
+ */
+int rw_flush(struct rw_state *rs, int fd, int convert)
+{
+    struct iovec iov[RW_IOV_MAX];
+    struct bf *b;
+    int n, total = 0, len;
+    ssize_t w;
+
+    for (;;) {
+        if (convert) {
+            if (rs->bfs[rs->nextone].counter < -1)
+                return total;
+            n = rw_write_behind(rs, fd, convert);
+            if (n < 0)
+                return -1;
+            total += n;
+            continue;
+        }
+
+        len = 0;
+        for (n = 0; n < RW_IOV_MAX; n++) {
+            b = &rs->bfs[rs->nextone];
+            if (b->counter < -1)
+                break;
+            iov[n].iov_base = ((struct tftphdr *)b->buf)->th_data;
+            iov[n].iov_len = b->counter > 0 ? b->counter : 0;
+            len += iov[n].iov_len;
+            b->counter = BF_FREE;
+            rs->nextone = NEXT(rs, rs->nextone);
+        }
+        if (!n)
+            return total;
+        w = 0;
+        if (len && rs->seq)
+            w = writev(fd, iov, n);
+        else if (len)
+#ifdef HAVE_PWRITEV
+            w = pwritev(fd, iov, n, rs->pos);
+#else
+            w = lseek(fd, rs->pos, SEEK_SET) == rs->pos ?
+                writev(fd, iov, n) : -1;
+#endif
+        if (w != len) {
+            if (w >= 0)
+                errno = ENOSPC;
+            return -1;
+        }
+        rs->pos += len;
+        total += len;
+    }
+}
+
+/*
+ * Start writing out the buffers waiting in the queue, with a write
+ * which completes later: fills in iov[] with up to max of them, and
+ * *lenp with their length, and returns how many there are.  They stay
+ * in use until rw_write_done() is called; only one such write may be
+ * in flight at a time.  Binary data only.
+ */
+int rw_write_start(struct rw_state *rs, struct iovec *iov, int max,
+                   int *lenp)
+{
+    struct bf *b;
+    int i = rs->nextone, n, len = 0;
+
+    for (n = 0; n < max && n < rs->depth; n++) {
+        b = &rs->bfs[i];
+        if (b->counter < -1)
+            break;
+        iov[n].iov_base = ((struct tftphdr *)b->buf)->th_data;
+        iov[n].iov_len = b->counter > 0 ? b->counter : 0;
+        len += iov[n].iov_len;
+        i = NEXT(rs, i);
+    }
+    rs->busy = n;
+    *lenp = len;
+    return n;
+}
+
+/* The write started by rw_write_start() has written len bytes */
+void rw_write_done(struct rw_state *rs, int len)
+{
+    for (; rs->busy; rs->busy--) {
+        rs->bfs[rs->nextone].counter = BF_FREE;
+        rs->nextone = NEXT(rs, rs->nextone);
+    }
+    rs->pos += len;
+}
+
+/*
+ * Single-transfer interface, using a static buffer state and the
+ * global segsize.  The client may be handed a pipe or a terminal, so
+ * the file is checked for that before its first block.
+ */
+struct tftphdr *w_init(void)
+{
+    struct tftphdr *dp = rw_w_init(&rw_global, segsize, 2);
+
+    rw_global.seq = -1;
+    return dp;
+}
+
+struct tftphdr *r_init(void)
+{
+    struct tftphdr *dp = rw_r_init(&rw_global, segsize, 2);
+
+    rw_global.seq = -1;
+    return dp;
+}
+
+static int global_fd(FILE * file)
+{
+    int fd = fileno(file);
+
+    if (rw_global.seq < 0)
+        rw_global.seq = lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE;
+    return fd;
+}
+
+int readit(FILE * file, struct tftphdr **dpp, int convert)
+{
+    return rw_readit(&rw_global, global_fd(file), dpp, convert);
+}
+
+void read_ahead(FILE * file, int convert)
+{
+    rw_read_ahead(&rw_global, global_fd(file), convert);
+}
+
+int writeit(FILE * file, struct tftphdr **dpp, int ct, int convert)
+{
+    return rw_writeit(&rw_global, global_fd(file), dpp, ct, convert);
+}
+
+int write_behind(FILE * file, int convert)
+{
+    return rw_write_behind(&rw_global, global_fd(file), convert);
 }
 
 /* When an error has occurred, it is possible that the two sides
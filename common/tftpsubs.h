@@ -101,7 +101,68 @@ static inline int sa_set_port(union sock_addr *s, u_short port)
 int set_sock_addr(char *, union sock_addr *, char **);
 
 struct tftphdr;
+struct iovec;
 
+#define RW_IOV_MAX 64           /* Buffers written out per writev() */
+
+/*
+ * Read-ahead/write-behind buffer state for one transfer: a ring of
+ * depth packet buffers.  When reading, the buffer in use is followed
+ * by the blocks read ahead of it; when writing, it is preceded by the
+ * blocks not yet written out.
+ */
+struct bf {
+    int counter;                /* size of data in buffer, or flag */
+    char *buf;                  /* room for data packet */
+};
+
+struct rw_state {
+    struct bf *bfs;             /* ring of depth buffers */
+    int depth;
+    int nextone;                /* index of next buffer to fill or flush */
+    int busy;                   /* buffers from nextone being written */
+    int current;                /* index of buffer in use */
+    int newline;                /* fillbuf: in middle of newline expansion */
+    int prevchar;               /* putbuf: previous char (cr check) */
+    int eof;                    /* fillbuf: short block read */
+    off_t pos;                  /* file offset of the next read or write */
+    int seq;                    /* file can't seek: read and write in order */
+    int held;                   /* putbuf: CR not written yet, if seq */
+    int segsize;                /* block size of this transfer */
+    int bufsize;                /* allocated size of each buffer */
+    const char *src;            /* fillbuf: read from memory, if set */
+    size_t srclen;
+    size_t srcpos;
+    char *stage;                /* fillbuf: text read, to be converted */
+    size_t stagelen;
+    size_t stagepos;
+};
+
+struct tftphdr *rw_r_init(struct rw_state *, int, int);
+void rw_r_mem(struct rw_state *, const void *, size_t);
+void rw_read_ahead(struct rw_state *, int, int);
+int rw_readit(struct rw_state *, int, struct tftphdr **, int);
+int rw_peek(struct rw_state *, int, int, struct tftphdr **, int);
+int rw_pread(struct rw_state *, int, unsigned long long, int,
+             struct tftphdr **);
+void rw_release(struct rw_state *, int);
+
+struct tftphdr *rw_w_init(struct rw_state *, int, int);
+void rw_w_put(struct rw_state *, int);
+struct tftphdr *rw_w_get(struct rw_state *);
+int rw_write_behind(struct rw_state *, int, int);
+int rw_writeit(struct rw_state *, int, struct tftphdr **, int, int);
+int rw_pending(struct rw_state *);
+int rw_flush(struct rw_state *, int, int);
+int rw_write_start(struct rw_state *, struct iovec *, int, int *);
+void rw_write_done(struct rw_state *, int);
+
+void rw_free(struct rw_state *);
+
+size_t netascii_encode(char *, size_t, const char *, size_t *, int *, int *);
+size_t netascii_decode(char *, size_t, int *, int *);
+
+/* The same, for a single transfer using the global segsize */
 struct tftphdr *r_init(void);
 void read_ahead(FILE *, int);
 int readit(FILE *, struct tftphdr **, int);
@@ -352,6 +352,45 @@ const char *gai_strerror(int);
 const char *inet_ntop(int, const void *, char *, socklen_t);
 #endif
 
+/* The worker pool runs one multiplexing engine per thread, with
+   the listening sockets shared through SO_REUSEPORT */
+
+#if defined(WITH_WORKERS) && \
+    !(defined(HAVE_SYS_EPOLL_H) && defined(SO_REUSEPORT))
+#undef WITH_WORKERS
+#endif
+
+/* The io_uring backend lives inside the multiplexing engine, and
+   needs a kernel header new enough to know about fast polling */
+
+#ifdef WITH_URING
+#ifdef HAVE_SYS_EPOLL_H
+#include <linux/io_uring.h>
+#endif
+#if !defined(HAVE_SYS_EPOLL_H) || !defined(IORING_FEAT_FAST_POLL)
+#undef WITH_URING
+#endif
+#endif
+
+/* The prefork pool passes requests to its workers over socketpairs */
+
+#if defined(SOCK_SEQPACKET) && defined(HAVE_RECVMSG)
+#define WITH_PREFORK 1
+#endif
+
+/* Several requests can be read off a listening socket at once */
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_RECVMSG) && \
+    defined(HAVE_MSGHDR_MSG_CONTROL)
+#define WITH_RECVMMSG 1
+#endif
+
+/* Octet files can be sent straight out of a mapping of the file */
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_SENDMSG)
+#define WITH_MMAP 1
+#endif
+
 /* tftp-hpa version and configuration strings */
 
 #include "version.h"
@@ -374,7 +413,32 @@ const char *inet_ntop(int, const void *, char *, socklen_t);
 #define HAVE_LIBWRAP_STR ", without tcpwrappers"
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#define HAVE_EPOLL_STR ", with multiplex"
+#else
+#define HAVE_EPOLL_STR ", without multiplex"
+#endif
+
+#ifdef WITH_URING
+#define WITH_URING_STR ", with io_uring"
+#else
+#define WITH_URING_STR ", without io_uring"
+#endif
+
+#ifdef WITH_WORKERS
+#define WITH_WORKERS_STR ", with workers"
+#else
+#define WITH_WORKERS_STR ", without workers"
+#endif
+
+#ifdef WITH_PREFORK
+#define WITH_PREFORK_STR ", with prefork"
+#else
+#define WITH_PREFORK_STR ", without prefork"
+#endif
+
 #define TFTP_CONFIG_STR VERSION WITH_READLINE_STR
-#define TFTPD_CONFIG_STR VERSION WITH_REGEX_STR HAVE_LIBWRAP_STR
+#define TFTPD_CONFIG_STR VERSION WITH_REGEX_STR HAVE_LIBWRAP_STR \
+	HAVE_EPOLL_STR WITH_URING_STR WITH_WORKERS_STR WITH_PREFORK_STR
 
 #endif
@@ -0,0 +1,116 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * arena.c
+ *
+ * Bump allocator.  A transfer's arena starts out in a buffer inside
+ * the transfer itself, which is enough for the filename, its rewrites
+ * and the OACK of almost any request; only when it fills up are
+ * bigger blocks malloc'd, each at least twice the size of the last.
+ * Nothing is freed on its own, except that the last object can be
+ * shrunk with arena_release().
+ */
+
+#include "config.h"             /* Must be included first! */
+#include "tftpd.h"
+
+union arena_align {
+    long l;
+    long long ll;
+    double d;
+    void *p;
+};
+
+#define ARENA_ALIGN	sizeof(union arena_align)
+
+struct arena_block {
+    struct arena_block *next;
+    union arena_align data[1];
+};
+
+void arena_init(struct arena *a, void *buf, size_t size)
+{
+    a->start = a->p = buf;
+    a->end = a->start + size;
+    a->blocks = NULL;
+}
+
+/*
+ * Switch to a new block with at least need bytes free, and copy the
+ * first len bytes of obj to it.
+ */
+static char *arena_newblock(struct arena *a, const char *obj, size_t len,
+                            size_t need)
+{
+    struct arena_block *b;
+    size_t size = (a->end - a->start) * 2;
+
+    if (size < need)
+        size = need;
+    b = tfmalloc(offsetof(struct arena_block, data) + size);
+    b->next = a->blocks;
+    a->blocks = b;
+
+    a->start = a->p = (char *)b->data;
+    a->end = a->start + size;
+    if (len)
+        memcpy(a->p, obj, len);
+    return a->p;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size_t pad = -(uintptr_t)a->p & (ARENA_ALIGN - 1);
+    char *p;
+
+    if ((size_t)(a->end - a->p) < pad + size) {
+        p = arena_newblock(a, NULL, 0, size);
+    } else {
+        p = a->p + pad;
+    }
+    a->p = p + size;
+    return p;
+}
+
+char *arena_strdup(struct arena *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return memcpy(arena_alloc(a, len), str, len);
+}
+
+char *arena_grow(struct arena *a, char *obj, size_t len, size_t more)
+{
+    if (!obj)
+        obj = a->p;
+
+    if ((size_t)(a->end - obj) < len + more)
+        obj = arena_newblock(a, obj, len, len + more);
+    if (a->p < obj + len + more)
+        a->p = obj + len + more;
+    return obj;
+}
+
+void arena_release(struct arena *a, void *p)
+{
+    if ((char *)p >= a->start && (char *)p <= a->p)
+        a->p = p;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b, *next;
+
+    for (b = a->blocks; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->blocks = NULL;
+    a->start = a->p = a->end = NULL;
+}
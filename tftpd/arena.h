@@ -0,0 +1,51 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * arena.h
+ *
+ * Bump allocator for what handling a request needs, all of which is
+ * freed at once with the transfer.
+ */
+
+#ifndef TFTPD_ARENA_H
+#define TFTPD_ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+    char *start;                /* The block being allocated from */
+    char *p;                    /* Its first free byte */
+    char *end;
+    struct arena_block *blocks; /* Blocks malloc'd when it filled up */
+};
+
+/* Set up an arena which starts out in the given buffer */
+void arena_init(struct arena *, void *, size_t);
+
+/* Allocate suitably aligned memory; doesn't fail */
+void *arena_alloc(struct arena *, size_t);
+
+char *arena_strdup(struct arena *, const char *);
+
+/* Make room for more bytes after the first len of an object, which
+   has to be the last thing allocated; it may move.  With a NULL
+   object, start a new one, not aligned.  The object owns everything
+   up to the top of the arena until arena_release() is called. */
+char *arena_grow(struct arena *, char *, size_t len, size_t more);
+
+/* Give back everything from this address on, if it is in the block
+   being allocated from */
+void arena_release(struct arena *, void *);
+
+/* Free the blocks the arena has had to malloc */
+void arena_free(struct arena *);
+
+#endif                          /* TFTPD_ARENA_H */
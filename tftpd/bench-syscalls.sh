@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Count the system calls tftpd makes per DATA block when serving a
+# download, using strace.  Run it against builds from before and after
+# a change to compare them, e.g.:
+#
+#	tftpd/bench-syscalls.sh ./tftpd/tftpd ./tftp/tftp
+#	tftpd/bench-syscalls.sh /usr/sbin/in.tftpd ./tftp/tftp
+#
+# Usage: bench-syscalls.sh [tftpd [tftp [blocks [tftpd options...]]]]
+#
+
+TFTPD="${1:-./tftpd/tftpd}"
+TFTP="${2:-./tftp/tftp}"
+BLOCKS="${3:-2000}"
+[ $# -gt 3 ] && shift 3 || set --
+PORT="${PORT:-16999}"
+
+if ! command -v strace >/dev/null 2>&1; then
+    echo "$0: strace is required" 1>&2
+    exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' 0 1 2 15
+
+mkdir "$dir/root"
+dd if=/dev/zero of="$dir/root/file" bs=512 count="$BLOCKS" 2>/dev/null
+# One short block to finish
+printf x >> "$dir/root/file"
+chmod 644 "$dir/root/file"
+
+strace -f -qq -o "$dir/trace" \
+    "$TFTPD" -L -a "127.0.0.1:$PORT" -s "$dir/root" \
+    -P "$dir/pid" "$@" &
+strace=$!
+
+i=0
+while [ ! -s "$dir/pid" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i+1))
+done
+sleep 0.2
+
+"$TFTP" -m octet 127.0.0.1 "$PORT" -c get file "$dir/out"
+# Let the transfer process see the final ACK and finish
+sleep 1
+kill "$(cat "$dir/pid")" 2>/dev/null
+wait $strace
+
+if ! cmp -s "$dir/root/file" "$dir/out"; then
+    echo "$0: transfer failed" 1>&2
+    exit 1
+fi
+
+blocks=$((BLOCKS + 1))
+echo "$TFTPD: $blocks blocks"
+sed -n 's/^[0-9][0-9]* *\([a-z_0-9]*\)(.*/\1/p' "$dir/trace" | \
+    sort | uniq -c | sort -rn | \
+    awk -v blocks=$blocks '
+	{ total += $1 }
+	$1 >= blocks / 10 { printf "%8d %6.2f/block  %s\n", $1, $1 / blocks, $2 }
+	END { printf "%8d %6.2f/block  total\n", total, total / blocks }'
@@ -0,0 +1,326 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * cache.c
+ *
+ * In-memory cache of the contents of files being served, for when a
+ * single process serves many transfers of the same few boot files.
+ * Files are identified by device, inode, modification and change
+ * times (to the nanosecond where struct stat has them) and size, so a
+ * file which has been changed or replaced is simply a different file,
+ * even if it was rewritten in place within the same second.  Entries
+ * are evicted least recently used first, once nothing is still
+ * sending them.  A file read in netascii mode is cached
+ * separately, already converted, so that it can be sent like a binary
+ * file and its converted size given for the tsize option.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <syslog.h>
+#include "tftpd.h"
+#include "cache.h"
+
+#ifdef WITH_WORKERS
+#include <pthread.h>
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()   pthread_mutex_lock(&cache_lock)
+#define UNLOCK() pthread_mutex_unlock(&cache_lock)
+#else
+#define LOCK()   ((void)0)
+#define UNLOCK() ((void)0)
+#endif
+
+#define CACHE_HASH 251
+
+struct cfile {
+    struct cfile *hnext;        /* Hash chain */
+    struct cfile *lnext, *lprev;        /* LRU list, most recent first */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_ns;
+    time_t ctime;
+    long ctime_ns;
+    off_t size;
+    int netascii;               /* data is converted to netascii */
+    size_t len;                 /* Size of data */
+    int refs;
+    int stale;                  /* No longer in the hash or LRU list */
+    char *data;
+};
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+#define ST_MTIME_NS(st)	((st)->st_mtim.tv_nsec)
+#define ST_CTIME_NS(st)	((st)->st_ctim.tv_nsec)
+#else
+#define ST_MTIME_NS(st)	0L
+#define ST_CTIME_NS(st)	0L
+#endif
+
+static struct cfile *hash[CACHE_HASH];
+static struct cfile lru;        /* List head */
+static size_t budget, used;
+static unsigned long hits, misses;
+
+void cache_init(size_t size)
+{
+    budget = size;
+    lru.lnext = lru.lprev = &lru;
+}
+
+static struct cfile **hash_slot(dev_t dev, ino_t ino)
+{
+    return &hash[((uintmax_t)ino ^ ((uintmax_t)dev << 7)) % CACHE_HASH];
+}
+
+static void lru_unlink(struct cfile *cf)
+{
+    cf->lprev->lnext = cf->lnext;
+    cf->lnext->lprev = cf->lprev;
+}
+
+static void lru_front(struct cfile *cf)
+{
+    cf->lnext = lru.lnext;
+    cf->lprev = &lru;
+    lru.lnext->lprev = cf;
+    lru.lnext = cf;
+}
+
+static void cf_free(struct cfile *cf)
+{
+    used -= cf->len;
+    free(cf->data);
+    free(cf);
+}
+
+/*
+ * Take an entry out of the cache; it is freed once unreferenced.
+ */
+static void cf_remove(struct cfile *cf)
+{
+    struct cfile **pp;
+
+    for (pp = hash_slot(cf->dev, cf->ino); *pp != cf; pp = &(*pp)->hnext)
+        ;
+    *pp = cf->hnext;
+    lru_unlink(cf);
+    cf->stale = 1;
+    if (!cf->refs)
+        cf_free(cf);
+}
+
+int cache_enabled(void)
+{
+    return budget != 0;
+}
+
+struct cfile *cache_get(const struct stat *st, int netascii)
+{
+    struct cfile *cf;
+
+    if (!budget)
+        return NULL;
+
+    LOCK();
+    for (cf = *hash_slot(st->st_dev, st->st_ino); cf; cf = cf->hnext) {
+        if (cf->dev == st->st_dev && cf->ino == st->st_ino &&
+            cf->netascii == netascii)
+            break;
+    }
+    if (cf) {
+        if (cf->mtime == st->st_mtime && cf->mtime_ns == ST_MTIME_NS(st) &&
+            cf->ctime == st->st_ctime && cf->ctime_ns == ST_CTIME_NS(st) &&
+            cf->size == st->st_size) {
+            cf->refs++;
+            lru_unlink(cf);
+            lru_front(cf);
+            hits++;
+        } else {
+            cf_remove(cf);      /* The file has changed */
+            cf = NULL;
+        }
+    }
+    if (!cf)
+        misses++;
+    UNLOCK();
+
+    return cf;
+}
+
+/*
+ * Make room for size more bytes, if we can.
+ */
+static int cache_evict(size_t size)
+{
+    struct cfile *cf, *prev;
+
+    for (cf = lru.lprev; cf != &lru && used + size > budget; cf = prev) {
+        prev = cf->lprev;
+        if (!cf->refs)
+            cf_remove(cf);
+    }
+    return used + size <= budget;
+}
+
+/*
+ * Convert a file read into memory to netascii.  Returns the converted
+ * copy, the original if nothing needs converting, or NULL if there
+ * isn't room for what conversion adds to the size.
+ */
+static char *cache_netascii(char *data, size_t *lenp)
+{
+    size_t len = *lenp, extra = 0, i, n;
+    int newline = 0, prevchar = -1;
+    char *conv;
+
+    for (i = 0; i < len; i++)
+        extra += (data[i] == '\r' || data[i] == '\n');
+    if (!extra)
+        return data;
+
+    LOCK();
+    if (len + extra > budget / 4 || !cache_evict(extra)) {
+        UNLOCK();
+        return NULL;
+    }
+    used += extra;
+    UNLOCK();
+
+    conv = malloc(len + extra);
+    if (!conv) {
+        LOCK();
+        used -= extra;
+        UNLOCK();
+        return NULL;
+    }
+    n = len;
+    netascii_encode(conv, len + extra, data, &n, &newline, &prevchar);
+    *lenp = len + extra;
+    return conv;
+}
+
+struct cfile *cache_fill(int fd, const struct stat *st, int netascii)
+{
+    struct cfile *cf, *old, **slot;
+    char *data, *conv;
+    size_t len = st->st_size;
+    off_t off;
+    ssize_t n;
+
+    /* Leave files which would crowd out everything else to the page
+       cache */
+    if (!budget || !S_ISREG(st->st_mode) || st->st_size <= 0 ||
+        (uintmax_t)st->st_size > budget / 4)
+        return NULL;
+
+    /* Reserve the space before reading anything */
+    LOCK();
+    if (!cache_evict(len)) {
+        UNLOCK();
+        return NULL;            /* Everything is in use */
+    }
+    used += len;
+    UNLOCK();
+
+    data = malloc(len);
+    for (off = 0; data && off < st->st_size; off += n) {
+        n = pread(fd, data + off, st->st_size - off, off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            free(data);         /* Error, or the file shrank */
+            data = NULL;
+        }
+    }
+    if (data && netascii) {
+        conv = cache_netascii(data, &len);
+        if (conv != data) {
+            free(data);
+            data = conv;
+        }
+    }
+    if (!data) {
+        LOCK();
+        used -= len;
+        UNLOCK();
+        return NULL;
+    }
+
+    cf = tfmalloc(sizeof *cf);
+    memset(cf, 0, sizeof *cf);
+    cf->dev = st->st_dev;
+    cf->ino = st->st_ino;
+    cf->mtime = st->st_mtime;
+    cf->mtime_ns = ST_MTIME_NS(st);
+    cf->ctime = st->st_ctime;
+    cf->ctime_ns = ST_CTIME_NS(st);
+    cf->size = st->st_size;
+    cf->netascii = netascii;
+    cf->len = len;
+    cf->refs = 1;
+    cf->data = data;
+
+    LOCK();
+    /* Someone else may have beaten us to it; the new one wins */
+    slot = hash_slot(cf->dev, cf->ino);
+    for (old = *slot; old; old = old->hnext) {
+        if (old->dev == cf->dev && old->ino == cf->ino &&
+            old->netascii == netascii) {
+            cf_remove(old);
+            break;
+        }
+    }
+    cf->hnext = *slot;
+    *slot = cf;
+    lru_front(cf);
+    UNLOCK();
+
+    return cf;
+}
+
+void cache_put(struct cfile *cf)
+{
+    LOCK();
+    if (!--cf->refs && cf->stale)
+        cf_free(cf);
+    UNLOCK();
+}
+
+const char *cache_data(const struct cfile *cf)
+{
+    return cf->data;
+}
+
+size_t cache_len(const struct cfile *cf)
+{
+    return cf->len;
+}
+
+void cache_report(void)
+{
+    unsigned long h, m;
+    size_t u;
+    int files = 0;
+    struct cfile *cf;
+
+    if (!budget)
+        return;
+
+    LOCK();
+    h = hits;
+    m = misses;
+    u = used;
+    for (cf = lru.lnext; cf != &lru; cf = cf->lnext)
+        files++;
+    UNLOCK();
+
+    syslog(LOG_INFO, "file cache: %lu hits, %lu misses, "
+           "%lu bytes in %d files", h, m, (unsigned long)u, files);
+}
@@ -0,0 +1,46 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * cache.h
+ *
+ * In-memory cache of the contents of files being served.
+ */
+
+#ifndef TFTPD_CACHE_H
+#define TFTPD_CACHE_H
+
+struct cfile;
+
+/* Set the memory budget; 0 disables the cache */
+void cache_init(size_t);
+
+/* True if there is a cache to look files up in */
+int cache_enabled(void);
+
+/* Look up a file by its stat() information, and whether it is to be
+   converted to netascii, returning a reference to its contents or
+   NULL */
+struct cfile *cache_get(const struct stat *, int);
+
+/* Read an open file into the cache, converting it to netascii if
+   asked to, if it fits, and return a reference to its contents or
+   NULL */
+struct cfile *cache_fill(int, const struct stat *, int);
+
+/* Drop a reference */
+void cache_put(struct cfile *);
+
+/* The contents of a cached file, and their size */
+const char *cache_data(const struct cfile *);
+size_t cache_len(const struct cfile *);
+
+/* Log the hit/miss counters */
+void cache_report(void);
+
+#endif                          /* TFTPD_CACHE_H */
@@ -0,0 +1,158 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * dirtrie.c
+ *
+ * Path component trie of the directories files may be served from.
+ * Each node has the components which can follow it in a sorted array,
+ * so with hundreds of directories under one parent a lookup is still a
+ * binary search; a filename is checked with one walk over it, which
+ * also looks out for ".." components.  Empty and "." components are
+ * skipped, in the directories and the filenames alike.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <syslog.h>
+#include "tftpd.h"
+#include "dirtrie.h"
+
+struct dirkid {
+    const char *name;           /* Not NUL-terminated */
+    size_t len;
+    struct dirtrie *node;
+};
+
+struct dirtrie {
+    int allowed;                /* A directory ends here */
+    int nkids;
+    struct dirkid *kids;        /* Sorted by length, then bytes */
+};
+
+static int dirkid_cmp(const char *name, size_t len, const struct dirkid *k)
+{
+    if (len != k->len)
+        return len < k->len ? -1 : 1;
+    return memcmp(name, k->name, len);
+}
+
+/* Index of the child with this name, or where it would go, negated
+   and less one, if there isn't one */
+static int dirtrie_find(const struct dirtrie *n, const char *name,
+                        size_t len)
+{
+    int lo = 0, hi = n->nkids, mid, c;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        c = dirkid_cmp(name, len, &n->kids[mid]);
+        if (!c)
+            return mid;
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return -lo - 1;
+}
+
+static struct dirtrie *dirtrie_node(void)
+{
+    struct dirtrie *n = tfmalloc(sizeof *n);
+
+    n->allowed = 0;
+    n->nkids = 0;
+    n->kids = NULL;
+    return n;
+}
+
+/* The next component of a path, from *pp on; returns its length, or 0
+   at the end, and leaves *pp pointing at it */
+static size_t next_component(const char **pp)
+{
+    const char *p = *pp;
+    size_t len;
+
+    for (;;) {
+        while (*p == '/')
+            p++;
+        len = strcspn(p, "/");
+        if (len != 1 || *p != '.')
+            break;
+        p++;                    /* Skip "." */
+    }
+    *pp = p;
+    return len;
+}
+
+static void dirtrie_add(struct dirtrie *root, const char *dir)
+{
+    struct dirtrie *n = root;
+    const char *p = dir;
+    size_t len;
+    int i;
+
+    while ((len = next_component(&p))) {
+        i = dirtrie_find(n, p, len);
+        if (i < 0) {
+            i = -i - 1;
+            n->kids = tfrealloc(n->kids, (n->nkids + 1) * sizeof *n->kids);
+            memmove(&n->kids[i + 1], &n->kids[i],
+                    (n->nkids - i) * sizeof *n->kids);
+            n->nkids++;
+            n->kids[i].name = p;
+            n->kids[i].len = len;
+            n->kids[i].node = dirtrie_node();
+        }
+        n = n->kids[i].node;
+        p += len;
+    }
+    n->allowed = 1;
+}
+
+struct dirtrie *dirtrie_build(const char *const *dirs)
+{
+    struct dirtrie *root = dirtrie_node();
+
+    if (!*dirs)
+        root->allowed = 1;      /* No restrictions */
+
+    for (; *dirs; dirs++) {
+        if (**dirs != '/') {
+            /* Filenames have to be absolute, so this can't match */
+            syslog(LOG_WARNING, "ignoring relative directory: %s", *dirs);
+            continue;
+        }
+        dirtrie_add(root, *dirs);
+    }
+
+    return root;
+}
+
+int dirtrie_check(const struct dirtrie *root, const char *filename)
+{
+    const struct dirtrie *n = root;
+    const char *p = filename;
+    size_t len;
+    int allowed = root->allowed;
+    int i;
+
+    while ((len = next_component(&p))) {
+        if (len == 2 && p[0] == '.' && p[1] == '.')
+            return DT_REVERSE;
+        if (!allowed && n) {
+            i = dirtrie_find(n, p, len);
+            n = (i >= 0) ? n->kids[i].node : NULL;
+            if (n && n->allowed)
+                allowed = 1;
+        }
+        p += len;
+    }
+
+    return allowed ? DT_OK : DT_FORBIDDEN;
+}
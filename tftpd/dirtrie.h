@@ -0,0 +1,34 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * dirtrie.h
+ *
+ * Check filenames against the directories given on the command line,
+ * one path component at a time.
+ */
+
+#ifndef TFTPD_DIRTRIE_H
+#define TFTPD_DIRTRIE_H
+
+/* Results of dirtrie_check() */
+#define DT_OK		0
+#define DT_REVERSE	1       /* Has a ".." component */
+#define DT_FORBIDDEN	2       /* Not in any of the directories */
+
+/* Opaque type */
+struct dirtrie;
+
+/* Build the trie from a NULL-terminated list of absolute directory
+   names; with none, every filename is in */
+struct dirtrie *dirtrie_build(const char *const *);
+
+/* Check an absolute filename, in one pass over it */
+int dirtrie_check(const struct dirtrie *, const char *);
+
+#endif                          /* TFTPD_DIRTRIE_H */
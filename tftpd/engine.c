@@ -0,0 +1,652 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * engine.c
+ *
+ * Event-driven engine serving many transfers from a single process.
+ * Each transfer has its own connected socket, which is registered with
+ * epoll; retransmission timeouts are kept on a timer wheel and handled
+ * between calls to epoll_wait().
+ *
+ * Where the kernel supports it, the engine instead runs on io_uring.
+ * Each transfer then always has a receive outstanding, linked to a
+ * timeout for its retransmission deadline, so the kernel keeps the
+ * timers; octet files are read with linked read+send pairs, and
+ * written a batch of blocks per writev, linked to an fdatasync when
+ * the upload is to be synced; and all of it is submitted and reaped in
+ * batches, one system call per round.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <stddef.h>
+#include <syslog.h>
+#include "tftpd.h"
+#include "engine.h"
+#include "timer.h"
+#include "uring.h"
+#include "recvfrom.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#ifdef WITH_URING
+#include <poll.h>
+#endif
+#ifdef WITH_WORKERS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define ENGINE_EVENTS	64      /* Events to fetch per epoll_wait() */
+#define ENGINE_BURST	64      /* Packets to read per socket per round */
+#define ENGINE_LISTEN	2       /* IPv4 and IPv6 */
+#define ENGINE_RING	1024    /* io_uring submission queue size */
+
+struct engine {
+#ifdef WITH_URING
+    struct uring ring;
+    int uring;                  /* Running on the ring, not epoll */
+    struct __kernel_timespec *ts;       /* Timeouts, by submission slot */
+#endif
+    int epfd;
+    struct wheel timers;        /* Retransmission timers of transfers */
+    struct transfer **byfd;     /* Transfers indexed by socket */
+    int nbyfd;
+    int listen[ENGINE_LISTEN];  /* Listening sockets */
+    int nlisten;
+    char pkt[MYRECV_MAX][MAX_SEGSIZE + 4];     /* Incoming requests */
+    struct myrecv rq[MYRECV_MAX];
+};
+
+static void engine_accept(struct engine *, int);
+
+#ifdef WITH_URING
+
+/*
+ * The low bits of the user data of each submission say what it was
+ * for; the rest is the transfer, or the socket for a listener.
+ */
+#define U_RECV		0
+#define U_TIMER		1
+#define U_SEND		2
+#define U_READ		3
+#define U_CANCEL	4
+#define U_LISTEN	5
+#define U_WRITE		6
+#define U_SYNC		7
+#define U_BITS		3
+#define U_MASK		((1 << U_BITS) - 1)
+
+#define U_DATA(xf, tag)	((__u64)(uintptr_t)(xf) | (tag))
+
+static void ur_listen(struct engine *e, int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&e->ring);
+
+    if (!sqe) {
+        syslog(LOG_ERR, "io_uring_enter: %m");
+        exit(EX_OSERR);
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = ((__u64)fd << U_BITS) | U_LISTEN;
+}
+
+/*
+ * Post a receive for the next packet, timing out at the deadline.
+ */
+static int ur_arm(struct engine *e, struct transfer *xf)
+{
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec *ts;
+    unsigned long long now = monotime();
+    unsigned long long dt = (xf->deadline > now) ? xf->deadline - now : 0;
+
+    if (uring_reserve(&e->ring, 2))
+        return -1;
+
+    sqe = uring_sqe(&e->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = xf->peer;
+    sqe->addr = (uintptr_t)xf->rxbuf;
+    sqe->len = xf->rxlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = U_DATA(xf, U_RECV);
+
+    /* The kernel copies the timeout when the entry is submitted, so
+       it can live alongside the submission slot until then */
+    sqe = uring_sqe(&e->ring);
+    ts = &e->ts[sqe - e->ring.sqes];
+    ts->tv_sec = dt / 1000000;
+    ts->tv_nsec = (dt % 1000000) * 1000;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = U_DATA(xf, U_TIMER);
+
+    xf->flags |= XF_RECV | XF_TIMER;
+    xf->pending += 2;
+    return 0;
+}
+
+/*
+ * Look after a transfer after something happened to it: wait for the
+ * next packet, or once it is finished, free it when the kernel no
+ * longer has anything of ours.
+ */
+static void ur_settle(struct engine *e, struct transfer *xf)
+{
+    struct io_uring_sqe *sqe;
+
+    if (xf->state != XS_DONE) {
+        if (!(xf->flags & (XF_RECV | XF_TIMER)) && ur_arm(e, xf)) {
+            syslog(LOG_WARNING, "io_uring_enter: %m");
+            xf->state = XS_DONE;
+        } else {
+            return;
+        }
+    }
+
+    if ((xf->flags & XF_RECV) && !(xf->flags & XF_CANCEL)) {
+        sqe = uring_sqe(&e->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = U_DATA(xf, U_RECV);
+            sqe->user_data = U_DATA(xf, U_CANCEL);
+            xf->flags |= XF_CANCEL;
+            xf->pending++;
+        }
+    }
+
+    if (!xf->pending)
+        xf_free(xf);
+}
+
+/*
+ * Handle a completion
+ */
+static void ur_complete(struct engine *e, __u64 data, int res)
+{
+    struct transfer *xf;
+    int fd;
+
+    if ((data & U_MASK) == U_LISTEN) {
+        fd = data >> U_BITS;
+        engine_accept(e, fd);
+        ur_listen(e, fd);
+        return;
+    }
+
+    xf = (struct transfer *)(uintptr_t)(data & ~(__u64)U_MASK);
+    xf->pending--;
+
+    switch (data & U_MASK) {
+    case U_RECV:
+        xf->flags &= ~XF_RECV;
+        xf->recvd = res;
+        break;
+    case U_TIMER:
+        xf->flags &= ~XF_TIMER;
+        if (res == -ETIME)
+            xf->flags |= XF_TIMEDOUT;
+        break;
+    case U_SEND:
+        /* A full socket buffer is just packet loss */
+        if (res < 0 && res != -EAGAIN && res != -ECANCELED &&
+            xf->state != XS_DONE) {
+            errno = -res;
+            syslog(LOG_WARNING, "tftpd: write: %m");
+            xf->state = XS_DONE;
+        }
+        break;
+    case U_READ:
+        xf_readdone(xf, res);
+        break;
+    case U_WRITE:
+        xf_writedone(xf, res);
+        break;
+    case U_SYNC:
+        xf_syncdone(xf, res);
+        break;
+    default:
+        break;
+    }
+
+    /* Once both halves of the receive are back, act on whichever
+       happened; a packet wins if they raced.  The timeout was posted
+       for the deadline as it was then; if a read or write finishing
+       has moved it on since, this isn't a timeout, and the receive
+       is just posted again */
+    if (((data & U_MASK) == U_RECV || (data & U_MASK) == U_TIMER) &&
+        !(xf->flags & (XF_RECV | XF_TIMER)) && xf->state != XS_DONE) {
+        if (xf->recvd >= 0) {
+            xf_input(xf, xf->recvd);
+        } else if (xf->flags & XF_TIMEDOUT) {
+            if (monotime() >= xf->deadline)
+                xf_timeout(xf);
+        } else if (xf->recvd != -ECANCELED && xf->recvd != -EINTR) {
+            errno = -xf->recvd;
+            syslog(LOG_WARNING, "tftpd: read: %m");
+            xf->state = XS_DONE;
+        }
+        xf->flags &= ~XF_TIMEDOUT;
+    }
+
+    ur_settle(e, xf);
+}
+
+static void ur_poll(struct engine *e)
+{
+    struct io_uring_cqe *cqe;
+    __u64 data;
+    int res;
+
+    if (uring_enter(&e->ring, 1) < 0 && errno != EINTR &&
+        errno != EBUSY) {
+        syslog(LOG_ERR, "io_uring_enter: %m");
+        exit(EX_OSERR);
+    }
+
+    while ((cqe = uring_cqe(&e->ring))) {
+        data = cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(&e->ring);
+        ur_complete(e, data, res);
+    }
+}
+
+int engine_async(struct engine *e)
+{
+    return e->uring;
+}
+
+int engine_send(struct transfer *xf, const void *p, int len)
+{
+    struct engine *e = xf->engine;
+    struct io_uring_sqe *sqe;
+
+    if (!e->uring)
+        return send(xf->peer, p, len, 0);
+
+    sqe = uring_sqe(&e->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = xf->peer;
+    sqe->addr = (uintptr_t)p;
+    sqe->len = len;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = U_DATA(xf, U_SEND);
+    xf->pending++;
+
+    return len;
+}
+
+int engine_send_block(struct transfer *xf)
+{
+    struct engine *e = xf->engine;
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(&e->ring, 2))
+        return -1;
+
+    /* A short read breaks the link, cancelling the send */
+    sqe = uring_sqe(&e->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = xf->fd;
+    sqe->off = xf->offset;
+    sqe->addr = (uintptr_t)xf->dp->th_data;
+    sqe->len = xf->size;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = U_DATA(xf, U_READ);
+
+    sqe = uring_sqe(&e->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = xf->peer;
+    sqe->addr = (uintptr_t)xf->dp;
+    sqe->len = xf->size + 4;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = U_DATA(xf, U_SEND);
+
+    xf->flags |= XF_READING;
+    xf->pending += 2;
+    return 0;
+}
+
+int engine_write(struct transfer *xf, const struct iovec *iov, int n,
+                 off_t off, int sync)
+{
+    struct engine *e = xf->engine;
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(&e->ring, sync ? 2 : 1))
+        return -1;
+
+    sqe = uring_sqe(&e->ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = xf->fd;
+    sqe->off = off;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = n;
+    sqe->user_data = U_DATA(xf, U_WRITE);
+    xf->flags |= XF_WRITING;
+    xf->pending++;
+
+    if (sync) {
+        /* A failed or short write cancels the sync */
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = uring_sqe(&e->ring);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = xf->fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = U_DATA(xf, U_SYNC);
+        xf->flags |= XF_SYNCING;
+        xf->pending++;
+    }
+    return 0;
+}
+
+#endif                          /* WITH_URING */
+
+struct engine *engine_new(void)
+{
+    struct engine *e = tfmalloc(sizeof *e);
+    int i;
+
+    memset(e, 0, sizeof *e);
+    for (i = 0; i < MYRECV_MAX; i++)
+        e->rq[i].buf = e->pkt[i];
+#ifdef WITH_URING
+    if (!uring_init(&e->ring, ENGINE_RING)) {
+        e->uring = 1;
+        e->ts = tfmalloc(e->ring.entries * sizeof(*e->ts));
+        return e;
+    }
+#endif
+    e->epfd = epoll_create(64);
+    if (e->epfd < 0) {
+        syslog(LOG_ERR, "epoll_create: %m");
+        exit(EX_OSERR);
+    }
+    wheel_init(&e->timers, monotime());
+    return e;
+}
+
+static int engine_add(struct engine *e, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void engine_listen(struct engine *e, int fd)
+{
+#ifdef WITH_URING
+    if (e->uring) {
+        ur_listen(e, fd);
+        return;
+    }
+#endif
+    if (e->nlisten >= ENGINE_LISTEN || engine_add(e, fd)) {
+        syslog(LOG_ERR, "epoll_ctl: %m");
+        exit(EX_OSERR);
+    }
+    e->listen[e->nlisten++] = fd;
+}
+
+static void engine_attach(struct engine *e, struct transfer *xf)
+{
+    int fd = xf->peer;
+
+#ifdef WITH_URING
+    if (e->uring) {
+        ur_settle(e, xf);
+        return;
+    }
+#endif
+
+    if (xf->state == XS_DONE) {
+        xf_free(xf);
+        return;
+    }
+    set_socket_nonblock(fd, 1);
+
+    if (fd >= e->nbyfd) {
+        int n = e->nbyfd ? e->nbyfd : 64;
+
+        while (n <= fd)
+            n <<= 1;
+        e->byfd = realloc(e->byfd, n * sizeof(*e->byfd));
+        if (!e->byfd) {
+            syslog(LOG_ERR, "out of memory");
+            exit(EX_OSERR);
+        }
+        memset(e->byfd + e->nbyfd, 0,
+               (n - e->nbyfd) * sizeof(*e->byfd));
+        e->nbyfd = n;
+    }
+
+    if (engine_add(e, fd)) {
+        syslog(LOG_WARNING, "epoll_ctl: %m");
+        xf_free(xf);
+        return;
+    }
+
+    e->byfd[fd] = xf;
+    timer_arm(&e->timers, &xf->timer, xf->deadline);
+}
+
+static void engine_detach(struct engine *e, struct transfer *xf)
+{
+    /* Closing the socket removes it from the epoll set */
+    e->byfd[xf->peer] = NULL;
+    timer_cancel(&e->timers, &xf->timer);
+    xf_free(xf);
+}
+
+/*
+ * Take new requests off a listening socket
+ */
+static void engine_accept(struct engine *e, int fd)
+{
+    struct myrecv *rq;
+    struct transfer *xf;
+    int i, j, n;
+
+    for (i = 0; i < ENGINE_BURST; i += n) {
+        n = recv_requests(fd, e->rq, MYRECV_MAX, sizeof(e->pkt[0]));
+        if (n <= 0) {
+            if (n < 0 && !E_WOULD_BLOCK(errno) && errno != EINTR)
+                syslog(LOG_WARNING, "recvfrom: %m");
+            return;
+        }
+
+        for (j = 0; j < n; j++) {
+            rq = &e->rq[j];
+            if (rq->len < 4)
+                continue;       /* Runt, ignore */
+
+            xf = xf_request(e, fd, (struct tftphdr *)rq->buf, rq->len,
+                            &rq->from, &rq->myaddr);
+            if (xf)
+                engine_attach(e, xf);
+        }
+    }
+}
+
+/*
+ * Feed packets waiting on a transfer socket into the transfer
+ */
+static void engine_input(struct engine *e, struct transfer *xf)
+{
+    int i, n;
+
+    for (i = 0; i < ENGINE_BURST && xf->state != XS_DONE; i++) {
+        n = recv(xf->peer, xf->rxbuf, xf->rxlen, 0);
+        if (n < 0) {
+            if (E_WOULD_BLOCK(errno) || errno == EINTR)
+                break;
+            syslog(LOG_WARNING, "tftpd: read: %m");
+            xf->state = XS_DONE;
+            break;
+        }
+        xf_input(xf, n);
+    }
+
+    if (xf->state == XS_DONE)
+        engine_detach(e, xf);
+    else
+        timer_arm(&e->timers, &xf->timer, xf->deadline);
+}
+
+/*
+ * Fire expired timers, and return the number of milliseconds until
+ * the next one, or -1 if there are none.
+ */
+static int engine_timers(struct engine *e)
+{
+    struct timer *t;
+    struct transfer *xf;
+    unsigned long long now = monotime();
+
+    while ((t = wheel_expired(&e->timers, now))) {
+        xf = (struct transfer *)((char *)t - offsetof(struct transfer, timer));
+        xf_timeout(xf);
+        if (xf->state == XS_DONE)
+            engine_detach(e, xf);
+        else
+            timer_arm(&e->timers, &xf->timer, xf->deadline);
+    }
+
+    return wheel_next(&e->timers, now);
+}
+
+void engine_poll(struct engine *e)
+{
+    struct epoll_event ev[ENGINE_EVENTS];
+    struct transfer *xf;
+    int i, j, n, fd, ms;
+
+#ifdef WITH_URING
+    if (e->uring) {
+        ur_poll(e);
+        return;
+    }
+#endif
+
+    ms = engine_timers(e);
+
+    n = epoll_wait(e->epfd, ev, ENGINE_EVENTS, ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "epoll_wait: %m");
+            exit(EX_OSERR);
+        }
+        return;                 /* Let the caller look at signals */
+    }
+
+    for (i = 0; i < n; i++) {
+        fd = ev[i].data.fd;
+        xf = (fd < e->nbyfd) ? e->byfd[fd] : NULL;
+        if (xf) {
+            engine_input(e, xf);
+        } else {
+            /* Either a listener, or a transfer which went away
+               earlier in this round */
+            for (j = 0; j < e->nlisten; j++)
+                if (e->listen[j] == fd)
+                    engine_accept(e, fd);
+        }
+    }
+}
+
+#ifdef WITH_WORKERS
+
+struct worker {
+    int fd4, fd6;               /* Listening sockets */
+    int n;                      /* Worker number */
+};
+
+/*
+ * Pin worker n to the n'th CPU we are allowed to run on (modulo the
+ * number of such CPUs).  This is only a performance hint, so any
+ * failure is ignored.
+ */
+static void worker_pin(int n)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t allowed, mine;
+    int cpu, ncpus;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+    ncpus = CPU_COUNT(&allowed);
+    if (!ncpus)
+        return;
+    n %= ncpus;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !n--) {
+            CPU_ZERO(&mine);
+            CPU_SET(cpu, &mine);
+            pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+            break;
+        }
+    }
+#else
+    (void)n;
+#endif
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct engine *e;
+
+    worker_pin(w->n);
+
+    e = engine_new();
+    if (w->fd4 >= 0)
+        engine_listen(e, w->fd4);
+    if (w->fd6 >= 0)
+        engine_listen(e, w->fd6);
+    free(w);
+
+    for (;;)
+        engine_poll(e);
+
+    return NULL;
+}
+
+void engine_spawn(int fd4, int fd6, int n)
+{
+    struct worker *w = tfmalloc(sizeof *w);
+    pthread_t thread;
+    int err;
+
+    w->fd4 = fd4;
+    w->fd6 = fd6;
+    w->n = n;
+
+    err = pthread_create(&thread, NULL, worker_main, w);
+    if (err) {
+        errno = err;
+        syslog(LOG_ERR, "cannot create worker thread: %m");
+        exit(EX_OSERR);
+    }
+    pthread_detach(thread);
+}
+
+#endif                          /* WITH_WORKERS */
+
+#endif                          /* HAVE_SYS_EPOLL_H */
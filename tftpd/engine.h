@@ -0,0 +1,56 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * engine.h
+ *
+ * Event-driven engine serving many transfers from a single process.
+ */
+
+#ifndef TFTPD_ENGINE_H
+#define TFTPD_ENGINE_H
+
+#ifdef HAVE_SYS_EPOLL_H
+
+struct engine;
+struct transfer;
+struct iovec;
+
+/* Create an engine */
+struct engine *engine_new(void);
+
+/* Accept requests arriving on a (nonblocking) listening socket */
+void engine_listen(struct engine *, int);
+
+/* Wait for and process one round of events and timeouts */
+void engine_poll(struct engine *);
+
+#ifdef WITH_URING
+/* True if the engine can queue file I/O (i.e. runs on io_uring) */
+int engine_async(struct engine *);
+
+/* Send a packet to a transfer's client */
+int engine_send(struct transfer *, const void *, int);
+
+/* Read the next xf->size bytes of the file at xf->offset into xf->dp,
+   and then send the block */
+int engine_send_block(struct transfer *);
+
+/* Write the buffers of iov[] to the file at the given offset, and then
+   if sync is set, fdatasync() it; xf_writedone() and xf_syncdone()
+   get the results */
+int engine_write(struct transfer *, const struct iovec *, int, off_t, int);
+#endif
+
+#ifdef WITH_WORKERS
+/* Start worker thread n, running an engine on the given listeners */
+void engine_spawn(int, int, int);
+#endif
+
+#endif                          /* HAVE_SYS_EPOLL_H */
+#endif                          /* TFTPD_ENGINE_H */
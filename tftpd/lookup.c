@@ -0,0 +1,282 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * lookup.c
+ *
+ * Cache of recent filename lookups, for when a single process serves
+ * a storm of requests for the same few names, most of which (the
+ * pxelinux.cfg/ probes of PXE clients) don't exist.  A name which
+ * wasn't there is answered as such until its entry expires; one which
+ * was keeps an open descriptor, which a transfer gets a duplicate of
+ * instead of opening the file again; transfers only use pread(), so
+ * they can all share its file offset.  Entries aren't refreshed by
+ * hits, so a file which appears, disappears or is replaced is seen
+ * once its entry has expired; the stat() information is always that
+ * of the open file, so a file changed in place is seen at once.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <syslog.h>
+#include <sys/resource.h>
+#include "tftpd.h"
+#include "lookup.h"
+
+#ifdef WITH_WORKERS
+#include <pthread.h>
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()   pthread_mutex_lock(&lookup_lock)
+#define UNLOCK() pthread_mutex_unlock(&lookup_lock)
+#else
+#define LOCK()   ((void)0)
+#define UNLOCK() ((void)0)
+#endif
+
+struct lookup {
+    struct lookup *hnext;       /* Hash chain */
+    struct lookup *lnext, *lprev;       /* LRU list, most recent first */
+    unsigned long long expires; /* See monotime() */
+    unsigned int hash;
+    int fd;                     /* -1 if there was no such file */
+    char name[1];
+};
+
+static struct lookup **hash;
+static unsigned int hashmask;
+static struct lookup lru;       /* List head */
+static int max_entries, entries;
+static int max_fds, fds;        /* Entries holding a descriptor */
+static unsigned long long ttl;
+static unsigned long hits, neg_hits, misses;
+
+void lookup_init(int n, unsigned long long t)
+{
+    struct rlimit rl;
+    unsigned int size = 1;
+
+    max_entries = n;
+    ttl = t;
+    lru.lnext = lru.lprev = &lru;
+    if (!n)
+        return;
+
+    while (size < (unsigned int)n)
+        size <<= 1;
+    hash = tfmalloc(size * sizeof *hash);
+    memset(hash, 0, size * sizeof *hash);
+    hashmask = size - 1;
+
+    /* Leave most descriptors to the transfers */
+    max_fds = n;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 4 < (rlim_t)max_fds)
+        max_fds = rl.rlim_cur / 4;
+}
+
+/* FNV-1a */
+static unsigned int name_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void lru_unlink(struct lookup *lk)
+{
+    lk->lprev->lnext = lk->lnext;
+    lk->lnext->lprev = lk->lprev;
+}
+
+static void lru_front(struct lookup *lk)
+{
+    lk->lnext = lru.lnext;
+    lk->lprev = &lru;
+    lru.lnext->lprev = lk;
+    lru.lnext = lk;
+}
+
+static struct lookup *lk_find(const char *name, unsigned int h)
+{
+    struct lookup *lk;
+
+    for (lk = hash[h & hashmask]; lk; lk = lk->hnext) {
+        if (lk->hash == h && !strcmp(lk->name, name))
+            break;
+    }
+    return lk;
+}
+
+static void lk_free(struct lookup *lk)
+{
+    if (lk->fd >= 0) {
+        close(lk->fd);
+        fds--;
+    }
+    free(lk);
+}
+
+static void lk_remove(struct lookup *lk)
+{
+    struct lookup **pp;
+
+    for (pp = &hash[lk->hash & hashmask]; *pp != lk; pp = &(*pp)->hnext)
+        ;
+    *pp = lk->hnext;
+    lru_unlink(lk);
+    entries--;
+    lk_free(lk);
+}
+
+/*
+ * Add an entry, replacing any for the same name, if there is room for
+ * it.  Called locked.
+ */
+static int lk_insert(struct lookup *lk)
+{
+    struct lookup *old, **slot;
+
+    if ((old = lk_find(lk->name, lk->hash)))
+        lk_remove(old);
+
+    while (lru.lprev != &lru &&
+           (entries >= max_entries || (lk->fd >= 0 && fds >= max_fds)))
+        lk_remove(lru.lprev);
+    if (lk->fd >= 0) {
+        if (fds >= max_fds)
+            return 0;           /* No descriptors to spare */
+        fds++;
+    }
+
+    slot = &hash[lk->hash & hashmask];
+    lk->hnext = *slot;
+    *slot = lk;
+    lru_front(lk);
+    entries++;
+    return 1;
+}
+
+static struct lookup *lk_new(const char *name, int fd)
+{
+    size_t len = strlen(name);
+    struct lookup *lk = tfmalloc(offsetof(struct lookup, name) + len + 1);
+
+    memcpy(lk->name, name, len + 1);
+    lk->hash = name_hash(name);
+    lk->expires = monotime() + ttl;
+    lk->fd = fd;
+    return lk;
+}
+
+int lookup_open(const char *name, int *fdp, struct stat *st)
+{
+    struct lookup *lk;
+    unsigned int h;
+    int fd;
+
+    if (!max_entries)
+        return -1;
+
+    h = name_hash(name);
+    LOCK();
+    lk = lk_find(name, h);
+    if (lk && lk->expires <= monotime()) {
+        lk_remove(lk);
+        lk = NULL;
+    }
+    if (!lk) {
+        misses++;
+        UNLOCK();
+        return -1;
+    }
+    lru_unlink(lk);
+    lru_front(lk);
+    if (lk->fd < 0) {
+        neg_hits++;
+        UNLOCK();
+        return ENOTFOUND;
+    }
+    fd = dup(lk->fd);
+    if (fd < 0 || fstat(fd, st)) {
+        if (fd >= 0)
+            close(fd);
+        misses++;
+        UNLOCK();
+        return -1;
+    }
+    hits++;
+    UNLOCK();
+
+    *fdp = fd;
+    return 0;
+}
+
+void lookup_add(const char *name, int fd, const struct stat *st)
+{
+    struct lookup *lk;
+
+    if (!max_entries || !S_ISREG(st->st_mode) || (fd = dup(fd)) < 0)
+        return;
+
+    lk = lk_new(name, fd);
+    LOCK();
+    if (!lk_insert(lk)) {
+        close(fd);
+        free(lk);
+    }
+    UNLOCK();
+}
+
+void lookup_missing(const char *name)
+{
+    struct lookup *lk;
+
+    if (!max_entries)
+        return;
+
+    lk = lk_new(name, -1);
+    LOCK();
+    lk_insert(lk);              /* Always room for one without a file */
+    UNLOCK();
+}
+
+void lookup_forget(const char *name)
+{
+    struct lookup *lk;
+
+    if (!max_entries)
+        return;
+
+    LOCK();
+    if ((lk = lk_find(name, name_hash(name))))
+        lk_remove(lk);
+    UNLOCK();
+}
+
+void lookup_report(void)
+{
+    unsigned long h, n, m;
+    int e, f;
+
+    if (!max_entries)
+        return;
+
+    LOCK();
+    h = hits;
+    n = neg_hits;
+    m = misses;
+    e = entries;
+    f = fds;
+    UNLOCK();
+
+    syslog(LOG_INFO, "lookup cache: %lu hits, %lu not found, %lu misses, "
+           "%d names, %d open files", h, n, m, e, f);
+}
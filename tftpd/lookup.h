@@ -0,0 +1,40 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * lookup.h
+ *
+ * Cache of recent filename lookups for files being read: the files
+ * which weren't there, and open descriptors of those which were.
+ */
+
+#ifndef TFTPD_LOOKUP_H
+#define TFTPD_LOOKUP_H
+
+/* Set the number of filenames to remember, and for how long (in
+   microseconds); 0 entries disables the cache */
+void lookup_init(int, unsigned long long);
+
+/* Look up a file to read.  Returns 0 with a new descriptor of it and
+   its stat() information; ENOTFOUND if it recently wasn't there; or
+   -1 if it has to be opened. */
+int lookup_open(const char *, int *, struct stat *);
+
+/* Remember a file which has just been opened for reading */
+void lookup_add(const char *, int, const struct stat *);
+
+/* Remember that there is no such file */
+void lookup_missing(const char *);
+
+/* Forget a file, which is about to be written */
+void lookup_forget(const char *);
+
+/* Log the hit/miss counters */
+void lookup_report(void);
+
+#endif                          /* TFTPD_LOOKUP_H */
@@ -52,6 +52,21 @@ void *tfmalloc(size_t size)
     return p;
 }
 
+/*
+ * realloc() that does the equivalent
+ */
+void *tfrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (!p) {
+        syslog(LOG_ERR, "realloc: %m");
+        exit(EX_OSERR);
+    }
+
+    return p;
+}
+
 /*
  * strdup() that does the equivalent
  */
@@ -66,3 +81,24 @@ char *tfstrdup(const char *str)
 
     return p;
 }
+
+/*
+ * Current time in microseconds, for timeout calculations.  Use the
+ * monotonic clock if we have one, so that setting the clock doesn't
+ * make transfers time out.
+ */
+unsigned long long monotime(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000ULL + tv.tv_usec;
+    }
+}
@@ -113,33 +113,51 @@ err:
     return rv;
 }
 
-int
-myrecvfrom(int s, void *buf, int len, unsigned int flags,
-           struct sockaddr *from, socklen_t * fromlen,
-           union sock_addr *myaddr)
-{
-    struct msghdr msg;
-    struct iovec iov;
-    int n;
-    struct cmsghdr *cmptr;
-    union {
-        struct cmsghdr cm;
+/* Room for the local address, however it is delivered */
+union control_buf {
+    struct cmsghdr cm;
 #ifdef IP_PKTINFO
-        char control[CMSG_SPACE(sizeof(struct in_addr)) +
-                     CMSG_SPACE(sizeof(struct in_pktinfo))];
+    char control[CMSG_SPACE(sizeof(struct in_addr)) +
+                 CMSG_SPACE(sizeof(struct in_pktinfo))];
 #else
-        char control[CMSG_SPACE(sizeof(struct in_addr))];
+    char control[CMSG_SPACE(sizeof(struct in_addr))];
 #endif
 #ifdef HAVE_IPV6
 #ifdef HAVE_STRUCT_IN6_PKTINFO
-        char control6[CMSG_SPACE(sizeof(struct in6_addr)) +
-                     CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    char control6[CMSG_SPACE(sizeof(struct in6_addr)) +
+                  CMSG_SPACE(sizeof(struct in6_pktinfo))];
 #else
-        char control6[CMSG_SPACE(sizeof(struct in6_addr))];
+    char control6[CMSG_SPACE(sizeof(struct in6_addr))];
 #endif
 #endif
-    } control_un;
+};
+
+/* Try to enable getting the return address */
+static void want_myaddr(int s, int family)
+{
     int on = 1;
+
+#ifdef IP_RECVDSTADDR
+    if (family == AF_INET)
+        setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &on, sizeof(on));
+#endif
+#ifdef IP_PKTINFO
+    if (family == AF_INET)
+        setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+#endif
+#ifdef HAVE_IPV6
+#ifdef IPV6_RECVPKTINFO
+    if (family == AF_INET6)
+        setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+#endif
+#endif
+}
+
+/* Dig the local address out of a received message */
+static void get_myaddr(struct msghdr *msg, const struct sockaddr *from,
+                       union sock_addr *myaddr)
+{
+    struct cmsghdr *cmptr;
 #ifdef IP_PKTINFO
     struct in_pktinfo pktinfo;
 #endif
@@ -147,21 +165,84 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
     struct in6_pktinfo pktinfo6;
 #endif
 
-    /* Try to enable getting the return address */
+    bzero(myaddr, sizeof(*myaddr));
+    myaddr->sa.sa_family = from->sa_family;
+
+    if (msg->msg_controllen < sizeof(struct cmsghdr) ||
+        (msg->msg_flags & MSG_CTRUNC))
+        return;                 /* No information available */
+
+    for (cmptr = CMSG_FIRSTHDR(msg); cmptr != NULL;
+         cmptr = CMSG_NXTHDR(msg, cmptr)) {
+
+        if (from->sa_family == AF_INET) {
+            myaddr->sa.sa_family = AF_INET;
 #ifdef IP_RECVDSTADDR
-    if (from->sa_family == AF_INET)
-        setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &on, sizeof(on));
+            if (cmptr->cmsg_level == IPPROTO_IP &&
+                cmptr->cmsg_type == IP_RECVDSTADDR) {
+                memcpy(&myaddr->si.sin_addr, CMSG_DATA(cmptr),
+                       sizeof(struct in_addr));
+            }
 #endif
+
 #ifdef IP_PKTINFO
-    if (from->sa_family == AF_INET)
-        setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+            if (cmptr->cmsg_level == IPPROTO_IP &&
+                cmptr->cmsg_type == IP_PKTINFO) {
+                memcpy(&pktinfo, CMSG_DATA(cmptr),
+                       sizeof(struct in_pktinfo));
+                memcpy(&myaddr->si.sin_addr, &pktinfo.ipi_addr,
+                       sizeof(struct in_addr));
+            }
 #endif
+        }
 #ifdef HAVE_IPV6
-#ifdef IPV6_RECVPKTINFO
-    if (from->sa_family == AF_INET6)
-        setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+        else if (from->sa_family == AF_INET6) {
+            myaddr->sa.sa_family = AF_INET6;
+#ifdef IP6_RECVDSTADDR
+            if (cmptr->cmsg_level == IPPROTO_IPV6 &&
+                cmptr->cmsg_type == IPV6_RECVDSTADDR )
+                memcpy(&myaddr->s6.sin6_addr, CMSG_DATA(cmptr),
+                       sizeof(struct in6_addr));
 #endif
+
+#ifdef HAVE_STRUCT_IN6_PKTINFO
+            if (cmptr->cmsg_level == IPPROTO_IPV6 &&
+                (cmptr->cmsg_type == IPV6_RECVPKTINFO ||
+                 cmptr->cmsg_type == IPV6_PKTINFO)) {
+                memcpy(&pktinfo6, CMSG_DATA(cmptr),
+                       sizeof(struct in6_pktinfo));
+                memcpy(&myaddr->s6.sin6_addr, &pktinfo6.ipi6_addr,
+                       sizeof(struct in6_addr));
+            }
 #endif
+        }
+#endif
+    }
+    /* If the address is not a valid local address,
+     * then bind to any address...
+     */
+    if (address_is_local(myaddr) != 1) {
+        if (myaddr->sa.sa_family == AF_INET)
+            ((struct sockaddr_in *)myaddr)->sin_addr.s_addr = INADDR_ANY;
+#ifdef HAVE_IPV6
+        else if (myaddr->sa.sa_family == AF_INET6)
+            memset(&myaddr->s6.sin6_addr, 0, sizeof(struct in6_addr));
+#endif
+    }
+}
+
+int
+myrecvfrom(int s, void *buf, int len, unsigned int flags,
+           struct sockaddr *from, socklen_t * fromlen,
+           union sock_addr *myaddr)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    int n;
+    union control_buf control_un;
+
+    want_myaddr(s, from->sa_family);
+
     bzero(&msg, sizeof msg);    /* Clear possible system-dependent fields */
     msg.msg_control = control_un.control;
     msg.msg_controllen = sizeof(control_un);
@@ -179,74 +260,51 @@ myrecvfrom(int s, void *buf, int len, unsigned int flags,
 
     *fromlen = msg.msg_namelen;
 
-    if (myaddr) {
-        bzero(myaddr, sizeof(*myaddr));
-        myaddr->sa.sa_family = from->sa_family;
-
-        if (msg.msg_controllen < sizeof(struct cmsghdr) ||
-            (msg.msg_flags & MSG_CTRUNC))
-            return n;           /* No information available */
-
-        for (cmptr = CMSG_FIRSTHDR(&msg); cmptr != NULL;
-             cmptr = CMSG_NXTHDR(&msg, cmptr)) {
-
-            if (from->sa_family == AF_INET) {
-                myaddr->sa.sa_family = AF_INET;
-#ifdef IP_RECVDSTADDR
-                if (cmptr->cmsg_level == IPPROTO_IP &&
-                    cmptr->cmsg_type == IP_RECVDSTADDR) {
-                    memcpy(&myaddr->si.sin_addr, CMSG_DATA(cmptr),
-                           sizeof(struct in_addr));
-                }
-#endif
+    if (myaddr)
+        get_myaddr(&msg, from, myaddr);
+    return n;
+}
 
-#ifdef IP_PKTINFO
-                if (cmptr->cmsg_level == IPPROTO_IP &&
-                    cmptr->cmsg_type == IP_PKTINFO) {
-                    memcpy(&pktinfo, CMSG_DATA(cmptr),
-                           sizeof(struct in_pktinfo));
-                    memcpy(&myaddr->si.sin_addr, &pktinfo.ipi_addr,
-                           sizeof(struct in_addr));
-                }
-#endif
-            }
-#ifdef HAVE_IPV6
-            else if (from->sa_family == AF_INET6) {
-                myaddr->sa.sa_family = AF_INET6;
-#ifdef IP6_RECVDSTADDR
-                if (cmptr->cmsg_level == IPPROTO_IPV6 &&
-                    cmptr->cmsg_type == IPV6_RECVDSTADDR )
-                    memcpy(&myaddr->s6.sin6_addr, CMSG_DATA(cmptr),
-                           sizeof(struct in6_addr));
-#endif
+#ifdef WITH_RECVMMSG
+/*
+ * The same, for up to n datagrams at once (n <= MYRECV_MAX).  Waits
+ * for the first one only, unless the socket is nonblocking.  Returns
+ * the number of datagrams received, with their lengths in rv[].len.
+ */
+int myrecvmmsg(int s, struct myrecv *rv, int n, unsigned int flags)
+{
+    struct mmsghdr msgs[MYRECV_MAX];
+    struct iovec iov[MYRECV_MAX];
+    union control_buf control_un[MYRECV_MAX];
+    struct msghdr *msg;
+    int i;
+
+    if (n > MYRECV_MAX)
+        n = MYRECV_MAX;
+
+    want_myaddr(s, rv[0].from.sa.sa_family);
+
+    bzero(msgs, n * sizeof msgs[0]);
+    for (i = 0; i < n; i++) {
+        msg = &msgs[i].msg_hdr;
+        msg->msg_control = control_un[i].control;
+        msg->msg_controllen = sizeof(control_un[i]);
+        msg->msg_name = &rv[i].from;
+        msg->msg_namelen = sizeof(rv[i].from);
+        iov[i].iov_base = rv[i].buf;
+        iov[i].iov_len = rv[i].len;
+        msg->msg_iov = &iov[i];
+        msg->msg_iovlen = 1;
+    }
 
-#ifdef HAVE_STRUCT_IN6_PKTINFO
-                if (cmptr->cmsg_level == IPPROTO_IPV6 &&
-                    (cmptr->cmsg_type == IPV6_RECVPKTINFO ||
-                     cmptr->cmsg_type == IPV6_PKTINFO)) {
-                    memcpy(&pktinfo6, CMSG_DATA(cmptr),
-                           sizeof(struct in6_pktinfo));
-                    memcpy(&myaddr->s6.sin6_addr, &pktinfo6.ipi6_addr,
-                           sizeof(struct in6_addr));
-                }
-#endif
-            }
-#endif
-        }
-        /* If the address is not a valid local address,
-         * then bind to any address...
-         */
-        if (address_is_local(myaddr) != 1) {
-            if (myaddr->sa.sa_family == AF_INET)
-                ((struct sockaddr_in *)myaddr)->sin_addr.s_addr = INADDR_ANY;
-#ifdef HAVE_IPV6
-            else if (myaddr->sa.sa_family == AF_INET6)
-                memset(&myaddr->s6.sin6_addr, 0, sizeof(struct in6_addr));
-#endif
-        }
+    n = recvmmsg(s, msgs, n, flags | MSG_WAITFORONE, NULL);
+    for (i = 0; i < n; i++) {
+        rv[i].len = msgs[i].msg_len;
+        get_myaddr(&msgs[i].msg_hdr, &rv[i].from.sa, &rv[i].myaddr);
     }
     return n;
 }
+#endif
 
 #else                           /* pointless... */
 
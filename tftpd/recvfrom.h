@@ -21,3 +21,17 @@ int
 myrecvfrom(int s, void *buf, int len, unsigned int flags,
            struct sockaddr *from, socklen_t *fromlen,
            union sock_addr *myaddr);
+
+#define MYRECV_MAX 8            /* Most datagrams myrecvmmsg() reads */
+
+/* One datagram for myrecvmmsg(); needs common/tftpsubs.h */
+struct myrecv {
+    void *buf;
+    int len;                    /* Size of buf, then of the datagram */
+    union sock_addr from;
+    union sock_addr myaddr;
+};
+
+#ifdef WITH_RECVMMSG
+int myrecvmmsg(int s, struct myrecv *rv, int n, unsigned int flags);
+#endif
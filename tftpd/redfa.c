@@ -0,0 +1,865 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * redfa.c
+ *
+ * Match a string against many extended regular expressions at once.
+ *
+ * The patterns are compiled into one Thompson NFA.  A DFA state is the
+ * set of NFA nodes the string so far can have reached in any of the
+ * patterns, with every pattern started afresh at each position since
+ * the patterns aren't anchored; once a pattern has matched, it stays
+ * matched and drops out of the state.  States are only built when the
+ * input first leads to them, and remembered, so after a few strings
+ * matching is a table lookup per character.  Bytes which no pattern
+ * tells apart share a column in the tables.
+ *
+ * This only says which patterns match, not where or with which
+ * subexpressions; that is left to regexec().  Anything whose meaning
+ * isn't plain in the C locale (GNU \-extensions, backreferences,
+ * collating elements, odd placement of repetition operators) makes us
+ * refuse the pattern, so the caller uses regexec() for it instead.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <ctype.h>
+#include <limits.h>
+#include "tftpd.h"
+#include "redfa.h"
+
+#ifdef WITH_WORKERS
+#include <pthread.h>
+#define LOCK(d)   pthread_mutex_lock(&(d)->lock)
+#define UNLOCK(d) pthread_mutex_unlock(&(d)->lock)
+#else
+#define LOCK(d)   ((void)0)
+#define UNLOCK(d) ((void)0)
+#endif
+
+#define NFA_MAX		4096    /* Most NFA nodes for one pattern */
+#define DFA_MAX		1024    /* DFA states to keep before starting over */
+#define DUP_MAX		255     /* Largest repeat count */
+
+enum nop {
+    N_EPS,                      /* Go to out */
+    N_SPLIT,                    /* Go to out and out1 */
+    N_SET,                      /* Consume a character in the set */
+    N_BOL,                      /* Only at the start of the string */
+    N_EOL,                      /* Only at the end of the string */
+    N_MATCH                     /* The pattern has matched */
+};
+
+struct nnode {
+    enum nop op;
+    int out, out1;
+    int set;                    /* Character set, for N_SET */
+    int pat;                    /* Pattern this node belongs to */
+};
+
+struct dstate {
+    struct dstate *hnext;       /* Hash chain */
+    unsigned int hash;
+    int atstart;                /* Nothing read yet */
+    int nnodes;
+    int *node;                  /* NFA nodes, sorted */
+    unsigned long *final;       /* Patterns matched if the string ends here */
+    struct dstate *next[1];     /* By byte class; NULL until needed */
+};
+
+struct redfa {
+    struct nnode *nfa;
+    int nnfa, nfamax;
+    unsigned char (*sets)[32];
+    int nsets, setmax;
+    int *start;                 /* Start node of each pattern */
+    int npat, patmax;
+
+    /* The DFA, built as strings are matched */
+    int ncls;                   /* Byte classes; 0 until worked out */
+    unsigned char cls[256];
+    unsigned char rep[256];     /* A byte of each class */
+    struct dstate *hash[2 * DFA_MAX];
+    int nstates;
+    unsigned int flushes;
+    struct dstate *first;       /* Start state */
+    unsigned int gen;           /* For marking nodes and patterns */
+    unsigned int *mark, *pmark;
+    int *stack, *list;
+#ifdef WITH_WORKERS
+    pthread_mutex_t lock;
+#endif
+};
+
+/* A piece of NFA; end is an N_EPS node whose out isn't set yet */
+struct frag {
+    int start, end;
+};
+
+struct parse {
+    struct redfa *d;
+    const unsigned char *p;
+    int icase;
+    int pat;
+    int base;                   /* First node of the pattern */
+    int anchors;                /* ^ and $ seen so far */
+    int bad;
+};
+
+#define SETBIT(s, c)	((s)[(c) >> 3] |= 1 << ((c) & 7))
+#define TESTBIT(s, c)	((s)[(c) >> 3] & (1 << ((c) & 7)))
+
+struct redfa *redfa_new(void)
+{
+    struct redfa *d = tfmalloc(sizeof *d);
+
+    memset(d, 0, sizeof *d);
+#ifdef WITH_WORKERS
+    pthread_mutex_init(&d->lock, NULL);
+#endif
+    return d;
+}
+
+int redfa_words(const struct redfa *d)
+{
+    return (d->npat + REDFA_BITS - 1) / REDFA_BITS;
+}
+
+static int newnode(struct parse *ps, enum nop op, int out, int out1, int set)
+{
+    struct redfa *d = ps->d;
+    struct nnode *n;
+
+    if (d->nnfa - ps->base >= NFA_MAX)
+        ps->bad = 1;            /* Carry on; the parse unwinds shortly */
+    if (d->nnfa >= d->nfamax) {
+        d->nfamax = d->nfamax ? d->nfamax * 2 : 256;
+        d->nfa = tfrealloc(d->nfa, d->nfamax * sizeof *d->nfa);
+    }
+    n = &d->nfa[d->nnfa];
+    n->op = op;
+    n->out = out;
+    n->out1 = out1;
+    n->set = set;
+    n->pat = ps->pat;
+    return d->nnfa++;
+}
+
+static unsigned char *newset(struct parse *ps, int *index)
+{
+    struct redfa *d = ps->d;
+
+    if (d->nsets >= d->setmax) {
+        d->setmax = d->setmax ? d->setmax * 2 : 64;
+        d->sets = tfrealloc(d->sets, d->setmax * sizeof *d->sets);
+    }
+    *index = d->nsets;
+    memset(d->sets[d->nsets], 0, sizeof d->sets[0]);
+    return d->sets[d->nsets++];
+}
+
+static struct frag f_node(struct parse *ps, enum nop op, int set)
+{
+    struct frag f;
+
+    f.end = newnode(ps, N_EPS, -1, -1, 0);
+    f.start = newnode(ps, op, f.end, -1, set);
+    return f;
+}
+
+static struct frag f_cat(struct parse *ps, struct frag a, struct frag b)
+{
+    ps->d->nfa[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+static struct frag f_alt(struct parse *ps, struct frag a, struct frag b)
+{
+    struct frag f;
+
+    f.end = newnode(ps, N_EPS, -1, -1, 0);
+    f.start = newnode(ps, N_SPLIT, a.start, b.start, 0);
+    ps->d->nfa[a.end].out = f.end;
+    ps->d->nfa[b.end].out = f.end;
+    return f;
+}
+
+static struct frag f_star(struct parse *ps, struct frag a)
+{
+    struct frag f;
+
+    f.end = newnode(ps, N_EPS, -1, -1, 0);
+    f.start = newnode(ps, N_SPLIT, a.start, f.end, 0);
+    ps->d->nfa[a.end].out = f.start;
+    return f;
+}
+
+static struct frag f_plus(struct parse *ps, struct frag a)
+{
+    struct frag f;
+    int split;
+
+    f.start = a.start;
+    f.end = newnode(ps, N_EPS, -1, -1, 0);
+    split = newnode(ps, N_SPLIT, a.start, f.end, 0);
+    ps->d->nfa[a.end].out = split;
+    return f;
+}
+
+static struct frag f_quest(struct parse *ps, struct frag a)
+{
+    struct frag f;
+
+    f.end = newnode(ps, N_EPS, -1, -1, 0);
+    f.start = newnode(ps, N_SPLIT, a.start, f.end, 0);
+    ps->d->nfa[a.end].out = f.end;
+    return f;
+}
+
+/*
+ * Make a copy of a fragment, which is made up of the nodes from lo up
+ * to hi.
+ */
+static struct frag f_copy(struct parse *ps, struct frag a, int lo, int hi)
+{
+    int off = ps->d->nnfa - lo;
+    struct nnode n;
+    int i;
+
+    for (i = lo; i < hi && !ps->bad; i++) {
+        n = ps->d->nfa[i];
+        if (n.out >= lo && n.out < hi)
+            n.out += off;
+        if (n.out1 >= lo && n.out1 < hi)
+            n.out1 += off;
+        newnode(ps, n.op, n.out, n.out1, n.set);
+    }
+    a.start += off;
+    a.end += off;
+    return a;
+}
+
+/*
+ * {n}, {n,}, {n,m} or {,m}: n copies, then either any number more, or
+ * up to m - n optional ones.
+ */
+static struct frag f_repeat(struct parse *ps, struct frag a, int lo)
+{
+    const unsigned char *p = ps->p + 1;
+    struct frag f, c[DUP_MAX + 1];
+    int hi = ps->d->nnfa;
+    int n = 0, m, i, k;
+
+    if (!isdigit(*p) && *p != ',')
+        goto bad;
+    while (isdigit(*p) && n <= DUP_MAX)
+        n = n * 10 + *p++ - '0';
+    m = n;
+    if (*p == ',') {
+        p++;
+        if (isdigit(*p)) {
+            m = 0;
+            while (isdigit(*p) && m <= DUP_MAX)
+                m = m * 10 + *p++ - '0';
+        } else if (p[-2] == '{') {
+            goto bad;           /* {,} */
+        } else {
+            m = -1;
+        }
+    }
+    if (*p != '}' || n > DUP_MAX || m > DUP_MAX || (m >= 0 && m < n))
+        goto bad;
+    ps->p = p + 1;
+
+    /* Copy first, since wiring up the copies changes the original */
+    k = (m < 0) ? n + 1 : m;
+    for (i = 0; i < k && !ps->bad; i++)
+        c[i] = i ? f_copy(ps, a, lo, hi) : a;
+    if (ps->bad)
+        return a;
+
+    f.start = f.end = newnode(ps, N_EPS, -1, -1, 0);
+    for (i = 0; i < k; i++) {
+        if (i < n)
+            f = f_cat(ps, f, c[i]);
+        else if (m < 0)
+            f = f_cat(ps, f, f_star(ps, c[i]));
+        else
+            f = f_cat(ps, f, f_quest(ps, c[i]));
+    }
+    return f;
+
+  bad:
+    ps->bad = 1;
+    return a;
+}
+
+static void addchar(const struct parse *ps, unsigned char *set, int c)
+{
+    SETBIT(set, c);
+    if (ps->icase) {
+        SETBIT(set, tolower(c));
+        SETBIT(set, toupper(c));
+    }
+}
+
+static const struct {
+    const char *name;
+    int (*test) (int);
+} classes[] = {
+    { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+    { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+    { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+    { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+};
+
+/* A bracket expression; ps->p points past the [ */
+static struct frag p_bracket(struct parse *ps)
+{
+    const unsigned char *p = ps->p;
+    const unsigned char *q;
+    unsigned char *set;
+    int neg = 0, c, e, i, s;
+
+    set = newset(ps, &s);
+    if (*p == '^') {
+        neg = 1;
+        p++;
+    }
+    /* A ] straight after the [ or ^ is an ordinary character, which
+       can start a range like any other */
+    do {
+        if (!*p || (*p == '[' && (p[1] == '.' || p[1] == '=')))
+            goto bad;
+        if (*p == '[' && p[1] == ':') {
+            q = (const unsigned char *)strstr((const char *)p + 2, ":]");
+            if (!q)
+                goto bad;
+            for (i = 0; i < (int)(sizeof classes / sizeof classes[0]); i++) {
+                if (strlen(classes[i].name) == (size_t)(q - p - 2) &&
+                    !memcmp(classes[i].name, p + 2, q - p - 2))
+                    break;
+            }
+            if (i >= (int)(sizeof classes / sizeof classes[0]))
+                goto bad;
+            for (c = 1; c < 256; c++) {
+                if (classes[i].test(c))
+                    addchar(ps, set, c);
+            }
+            p = q + 2;
+            if (*p == '-' && p[1] != ']')
+                goto bad;       /* A class can't start a range */
+            continue;
+        }
+        c = *p++;
+        if (*p == '-' && p[1] && p[1] != ']') {
+            e = p[1];
+            if (e == '[' || e < c)
+                goto bad;
+            p += 2;
+            for (; c <= e; c++)
+                addchar(ps, set, c);
+        } else {
+            addchar(ps, set, c);
+        }
+    } while (*p != ']');
+    ps->p = p + 1;
+
+    if (neg) {
+        for (i = 0; i < 32; i++)
+            set[i] = ~set[i];
+    }
+    set[0] &= ~1;               /* Never NUL */
+    return f_node(ps, N_SET, s);
+
+  bad:
+    ps->bad = 1;
+    return f_node(ps, N_EPS, 0);
+}
+
+/*
+ * Could the rest of a match be empty from here?  That is, is this the
+ * end of the pattern, or of a branch or group which is at the end?
+ */
+static int atend(const unsigned char *p)
+{
+    int depth;
+
+    for (;;) {
+        switch (*p) {
+        case '\0':
+            return 1;
+        case ')':
+            p++;
+            if (*p == '*' || *p == '+' || *p == '?' || *p == '{')
+                return 0;       /* The group may come round again */
+            break;
+        case '|':
+            /* Skip the other branches of this group */
+            for (depth = 0; *p && (*p != ')' || depth); p++) {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                } else if (*p == '(') {
+                    depth++;
+                } else if (*p == ')') {
+                    depth--;
+                } else if (*p == '[') {
+                    p++;
+                    if (*p == '^')
+                        p++;
+                    if (*p == ']')
+                        p++;
+                    while (*p && *p != ']') {
+                        if (*p == '[' && p[1] == ':' &&
+                            strstr((const char *)p + 2, ":]"))
+                            p = (const unsigned char *)
+                                strstr((const char *)p + 2, ":]") + 1;
+                        p++;
+                    }
+                    if (!*p)
+                        return 0;
+                }
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+}
+
+static struct frag p_alt(struct parse *ps, int start);
+
+/*
+ * An atom.  glibc doesn't treat ^ and $ as plain anchors everywhere,
+ * so we only take them where nothing can come before or after them.
+ */
+static struct frag p_atom(struct parse *ps, int start)
+{
+    struct frag f;
+    unsigned char *set;
+    int c, s;
+
+    c = *ps->p++;
+    switch (c) {
+    case '(':
+        f = p_alt(ps, start);
+        if (ps->bad || *ps->p != ')')
+            ps->bad = 1;
+        else
+            ps->p++;
+        return f;
+    case '[':
+        return p_bracket(ps);
+    case '^':
+        if (!start)
+            ps->bad = 1;
+        ps->anchors++;
+        return f_node(ps, N_BOL, 0);
+    case '$':
+        if (!atend(ps->p))
+            ps->bad = 1;
+        ps->anchors++;
+        return f_node(ps, N_EOL, 0);
+    case '.':
+        set = newset(ps, &s);
+        memset(set, 0xff, 32);
+        set[0] &= ~1;
+        return f_node(ps, N_SET, s);
+    case '\\':
+        c = *ps->p++;
+        if (!c || isalnum(c) || strchr("<>`'", c))
+            ps->bad = 1;        /* GNU extension or backreference */
+        break;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case ')':
+    case '|':
+    case '\0':
+        ps->bad = 1;            /* Nothing to repeat, or empty */
+        break;
+    }
+
+    set = newset(ps, &s);
+    addchar(ps, set, c);
+    return f_node(ps, N_SET, s);
+}
+
+static struct frag p_piece(struct parse *ps, int start)
+{
+    int lo = ps->d->nnfa;
+    int anchors = ps->anchors;
+    struct frag f;
+
+    f = p_atom(ps, start);
+    while (!ps->bad) {
+        switch (*ps->p) {
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            if (ps->anchors != anchors) {
+                ps->bad = 1;    /* Repeated anchor */
+                return f;
+            }
+            break;
+        default:
+            return f;
+        }
+        switch (*ps->p) {
+        case '*':
+            ps->p++;
+            f = f_star(ps, f);
+            break;
+        case '+':
+            ps->p++;
+            f = f_plus(ps, f);
+            break;
+        case '?':
+            ps->p++;
+            f = f_quest(ps, f);
+            break;
+        case '{':
+            f = f_repeat(ps, f, lo);
+            break;
+        }
+    }
+    return f;
+}
+
+static struct frag p_concat(struct parse *ps, int start)
+{
+    struct frag f = p_piece(ps, start);
+
+    while (!ps->bad && *ps->p && *ps->p != '|' && *ps->p != ')')
+        f = f_cat(ps, f, p_piece(ps, 0));
+    return f;
+}
+
+static struct frag p_alt(struct parse *ps, int start)
+{
+    struct frag f = p_concat(ps, start);
+
+    while (!ps->bad && *ps->p == '|') {
+        ps->p++;
+        f = f_alt(ps, f, p_concat(ps, start));
+    }
+    return f;
+}
+
+static void dfa_flush(struct redfa *);
+
+int redfa_add(struct redfa *d, const char *rx, int icase)
+{
+    struct parse ps;
+    struct frag f;
+    int nsets = d->nsets;
+
+    dfa_flush(d);
+    d->ncls = 0;
+
+    ps.d = d;
+    ps.p = (const unsigned char *)rx;
+    ps.icase = icase;
+    ps.pat = d->npat;
+    ps.base = d->nnfa;
+    ps.anchors = 0;
+    ps.bad = 0;
+
+    f = p_alt(&ps, 1);
+    if (!ps.bad && *ps.p)
+        ps.bad = 1;             /* Unbalanced ) */
+    if (!ps.bad)
+        d->nfa[f.end].out = newnode(&ps, N_MATCH, -1, -1, 0);
+    if (ps.bad) {
+        d->nnfa = ps.base;
+        d->nsets = nsets;
+        return -1;
+    }
+
+    if (d->npat >= d->patmax) {
+        d->patmax = d->patmax ? d->patmax * 2 : 64;
+        d->start = tfrealloc(d->start, d->patmax * sizeof *d->start);
+    }
+    d->start[d->npat] = f.start;
+    return d->npat++;
+}
+
+/*
+ * Split the bytes into classes which every character set either
+ * contains all or none of.
+ */
+static void dfa_classes(struct redfa *d)
+{
+    short map[2][256];
+    unsigned char cls[256];
+    int i, c, in, n;
+
+    memset(d->cls, 0, sizeof d->cls);
+    d->ncls = 1;
+    for (i = 0; i < d->nsets; i++) {
+        memset(map, 0xff, sizeof map);
+        n = 0;
+        for (c = 0; c < 256; c++) {
+            in = !!TESTBIT(d->sets[i], c);
+            if (map[in][d->cls[c]] < 0)
+                map[in][d->cls[c]] = n++;
+            cls[c] = map[in][d->cls[c]];
+        }
+        memcpy(d->cls, cls, sizeof cls);
+        d->ncls = n;
+    }
+    for (c = 255; c >= 0; c--)
+        d->rep[d->cls[c]] = c;
+
+    free(d->mark);
+    free(d->pmark);
+    free(d->stack);
+    free(d->list);
+    d->mark = tfmalloc(d->nnfa * sizeof *d->mark);
+    d->pmark = tfmalloc(d->npat * sizeof *d->pmark);
+    d->stack = tfmalloc((d->nnfa * 2 + 1) * sizeof *d->stack);
+    d->list = tfmalloc(d->nnfa * sizeof *d->list);
+    memset(d->mark, 0, d->nnfa * sizeof *d->mark);
+    memset(d->pmark, 0, d->npat * sizeof *d->pmark);
+    d->gen = 0;
+}
+
+static void dfa_flush(struct redfa *d)
+{
+    struct dstate *st, *next;
+    int i;
+
+    for (i = 0; i < 2 * DFA_MAX; i++) {
+        for (st = d->hash[i]; st; st = next) {
+            next = st->hnext;
+            free(st->node);
+            free(st->final);
+            free(st);
+        }
+        d->hash[i] = NULL;
+    }
+    d->nstates = 0;
+    d->first = NULL;
+    d->flushes++;
+}
+
+/* Start a new set of nodes */
+static void dfa_gen(struct redfa *d)
+{
+    if (!++d->gen) {
+        memset(d->mark, 0, d->nnfa * sizeof *d->mark);
+        memset(d->pmark, 0, d->npat * sizeof *d->pmark);
+        d->gen = 1;
+    }
+}
+
+/*
+ * Add the nodes reachable from n without reading a character to the
+ * list, as far as the anchors allow.  Only nodes which consume a
+ * character, or wait for the end of the string, or match, are listed.
+ */
+static void closure(struct redfa *d, int n, int bol, int eol, int *cnt)
+{
+    const struct nnode *nn;
+    int sp = 0;
+
+    d->stack[sp++] = n;
+    while (sp) {
+        n = d->stack[--sp];
+        if (n < 0 || d->mark[n] == d->gen)
+            continue;
+        d->mark[n] = d->gen;
+        nn = &d->nfa[n];
+        switch (nn->op) {
+        case N_SPLIT:
+            d->stack[sp++] = nn->out1;
+            /* fall through */
+        case N_EPS:
+            d->stack[sp++] = nn->out;
+            break;
+        case N_BOL:
+            if (bol)
+                d->stack[sp++] = nn->out;
+            break;
+        case N_EOL:
+            if (eol) {
+                d->stack[sp++] = nn->out;
+                break;
+            }
+            /* fall through */
+        case N_SET:
+        case N_MATCH:
+            d->list[(*cnt)++] = n;
+            break;
+        }
+    }
+}
+
+static int cmpint(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Find or make the state for the node list */
+static struct dstate *dfa_state(struct redfa *d, int cnt, int atstart)
+{
+    unsigned int h = 2166136261U ^ atstart;     /* FNV-1a */
+    struct dstate *st, **sp;
+    int i;
+
+    qsort(d->list, cnt, sizeof *d->list, cmpint);
+    for (i = 0; i < cnt; i++)
+        h = (h ^ d->list[i]) * 16777619U;
+
+    sp = &d->hash[h % (2 * DFA_MAX)];
+    for (st = *sp; st; st = st->hnext) {
+        if (st->hash == h && st->atstart == atstart && st->nnodes == cnt &&
+            !memcmp(st->node, d->list, cnt * sizeof *d->list))
+            return st;
+    }
+
+    if (d->nstates >= DFA_MAX) {
+        dfa_flush(d);
+        sp = &d->hash[h % (2 * DFA_MAX)];
+    }
+    st = tfmalloc(sizeof *st + (d->ncls - 1) * sizeof st->next[0]);
+    memset(st->next, 0, d->ncls * sizeof st->next[0]);
+    st->hash = h;
+    st->atstart = atstart;
+    st->nnodes = cnt;
+    st->node = tfmalloc((cnt ? cnt : 1) * sizeof *st->node);
+    memcpy(st->node, d->list, cnt * sizeof *d->list);
+    st->final = NULL;
+    st->hnext = *sp;
+    *sp = st;
+    d->nstates++;
+    return st;
+}
+
+static struct dstate *dfa_first(struct redfa *d)
+{
+    int cnt = 0;
+    int i;
+
+    dfa_gen(d);
+    for (i = 0; i < d->npat; i++)
+        closure(d, d->start[i], 1, 0, &cnt);
+    return d->first = dfa_state(d, cnt, 1);
+}
+
+/* Where the state goes on reading a byte of the class */
+static struct dstate *dfa_step(struct redfa *d, struct dstate *st, int k)
+{
+    const unsigned char c = d->rep[k];
+    const struct nnode *nn;
+    struct dstate *next;
+    unsigned int flushes = d->flushes;
+    int cnt = 0;
+    int i;
+
+    dfa_gen(d);
+
+    /* Patterns which have matched stay matched, and need no more */
+    for (i = 0; i < st->nnodes; i++) {
+        nn = &d->nfa[st->node[i]];
+        if (nn->op == N_MATCH) {
+            d->pmark[nn->pat] = d->gen;
+            d->mark[st->node[i]] = d->gen;
+            d->list[cnt++] = st->node[i];
+        }
+    }
+
+    for (i = 0; i < st->nnodes; i++) {
+        nn = &d->nfa[st->node[i]];
+        if (nn->op == N_SET && d->pmark[nn->pat] != d->gen &&
+            TESTBIT(d->sets[nn->set], c))
+            closure(d, nn->out, 0, 0, &cnt);
+    }
+    for (i = 0; i < d->npat; i++) {
+        if (d->pmark[i] != d->gen)
+            closure(d, d->start[i], 0, 0, &cnt);
+    }
+
+    next = dfa_state(d, cnt, 0);
+    if (d->flushes == flushes)
+        st->next[k] = next;     /* Unless st has just been freed */
+    return next;
+}
+
+/* The patterns matched if the string ends in this state */
+static void dfa_final(struct redfa *d, struct dstate *st)
+{
+    const struct nnode *nn;
+    int words = redfa_words(d);
+    int cnt = 0;
+    int i;
+
+    st->final = tfmalloc((words ? words : 1) * sizeof *st->final);
+    memset(st->final, 0, (words ? words : 1) * sizeof *st->final);
+
+    dfa_gen(d);
+    for (i = 0; i < st->nnodes; i++) {
+        nn = &d->nfa[st->node[i]];
+        if (nn->op == N_MATCH) {
+            d->mark[st->node[i]] = d->gen;
+            d->list[cnt++] = st->node[i];
+        } else if (nn->op == N_EOL)
+            closure(d, nn->out, st->atstart, 1, &cnt);
+    }
+    for (i = 0; i < cnt; i++) {
+        nn = &d->nfa[d->list[i]];
+        if (nn->op == N_MATCH)
+            st->final[nn->pat / REDFA_BITS] |= 1UL << (nn->pat % REDFA_BITS);
+    }
+}
+
+void redfa_match(struct redfa *d, const char *str, unsigned long *match)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    struct dstate *st, *next;
+
+    if (!d->npat)
+        return;
+
+    LOCK(d);
+    if (!d->ncls)
+        dfa_classes(d);
+    st = d->first ? d->first : dfa_first(d);
+    for (; *s; s++) {
+        next = st->next[d->cls[*s]];
+        st = next ? next : dfa_step(d, st, d->cls[*s]);
+    }
+    if (!st->final)
+        dfa_final(d, st);
+    memcpy(match, st->final, redfa_words(d) * sizeof *match);
+    UNLOCK(d);
+}
+
+void redfa_free(struct redfa *d)
+{
+    if (!d)
+        return;
+
+    dfa_flush(d);
+#ifdef WITH_WORKERS
+    pthread_mutex_destroy(&d->lock);
+#endif
+    free(d->nfa);
+    free(d->sets);
+    free(d->start);
+    free(d->mark);
+    free(d->pmark);
+    free(d->stack);
+    free(d->list);
+    free(d);
+}
@@ -0,0 +1,44 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * redfa.h
+ *
+ * Match a string against many extended regular expressions at once,
+ * with a lazily built DFA.
+ */
+
+#ifndef TFTPD_REDFA_H
+#define TFTPD_REDFA_H
+
+#include <limits.h>
+
+#define REDFA_BITS	(sizeof(unsigned long) * CHAR_BIT)
+
+/* Opaque type */
+struct redfa;
+
+/* Create an empty set of patterns */
+struct redfa *redfa_new(void);
+
+/* Add a pattern, already known to compile with regcomp(REG_EXTENDED);
+   returns its number, or -1 if it uses anything the DFA doesn't
+   handle, in which case the caller has to use regexec() for it */
+int redfa_add(struct redfa *, const char *, int icase);
+
+/* Number of words in a set of pattern numbers */
+int redfa_words(const struct redfa *);
+
+/* Set the bit for each pattern which matches the string, and clear
+   the rest */
+void redfa_match(struct redfa *, const char *, unsigned long *);
+
+/* Destroy a set of patterns */
+void redfa_free(struct redfa *);
+
+#endif                          /* TFTPD_REDFA_H */
@@ -12,18 +12,55 @@
  * remap.c
  *
  * Perform regular-expression based filename remapping.
+ *
+ * With hundreds of rules, most of them cannot match a given filename,
+ * and running regexec() to find that out is what costs.  So when the
+ * rules are read, we pick out literal text that any match of each
+ * regex has to contain: the prefix of a ^-anchored regex, and the
+ * longest run of literal characters.  The prefixes go into a trie,
+ * which is walked once for each string we rewrite; rules whose
+ * literals aren't there are known not to match without running the
+ * regex.
+ *
+ * Alternatively, with REMAP_DFA, the regexes are all compiled into one
+ * DFA, which finds out which of them match a string in a single pass
+ * over it; regexec() is then only run on a rule which does match, if
+ * its subexpressions are needed.  Regexes the DFA can't handle still
+ * go through the prefilter and regexec().
+ *
+ * During a boot wave the same few filenames are rewritten over and
+ * over, so the results can also be memoised: keyed by the string and
+ * the G/P mode, plus the expansions of any macros (like \i) the rules
+ * substitute, since those are all the result depends on.
+ *
+ * The rewritten strings are built in the caller's arena, so rewriting
+ * a filename doesn't touch the heap.
  */
 
 #include "config.h"             /* Must be included first! */
 #include <ctype.h>
+#include <limits.h>
 #include <syslog.h>
 #include <regex.h>
 
 #include "tftpd.h"
 #include "remap.h"
+#include "redfa.h"
+#include "arena.h"
+
+#ifdef WITH_WORKERS
+#include <pthread.h>
+static pthread_mutex_t rcache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()   pthread_mutex_lock(&rcache_lock)
+#define UNLOCK() pthread_mutex_unlock(&rcache_lock)
+#else
+#define LOCK()   ((void)0)
+#define UNLOCK() ((void)0)
+#endif
 
 #define DEADMAN_MAX_STEPS	1024    /* Timeout after this many steps */
 #define MAXLINE			16384   /* Truncate a line at this many bytes */
+#define PREFIX_MAX		64      /* Longest literal prefix used per rule */
 
 #define RULE_REWRITE	0x01    /* This is a rewrite rule */
 #define RULE_GLOBAL	0x02    /* Global rule (repeat until no match) */
@@ -32,6 +69,13 @@
 #define RULE_ABORT	0x10    /* Terminate processing with an error */
 #define RULE_INVERSE	0x20    /* Execute if regex *doesn't* match */
 
+/* Trie of the literal prefixes of the regexes */
+struct pnode {
+    struct pnode *child;        /* First child */
+    struct pnode *sibling;      /* Next child of the same parent */
+    unsigned char c;
+};
+
 struct rule {
     struct rule *next;
     int nrule;
@@ -39,6 +83,48 @@ struct rule {
     char rule_mode;
     regex_t rx;
     const char *pattern;
+    /* Literals any match has to contain, folded to lower case for
+       case-insensitive rules */
+    int icase;
+    const struct pnode *prefix; /* Trie node of the prefix, if any */
+    int plen;                   /* Length of the prefix */
+    char *lit;                  /* Literal substring, if any */
+    int litlen;
+    int litend;                 /* The substring must end the string */
+    /* With the DFA, for skipping rules it says can't match */
+    int dfa;                    /* Pattern number in the DFA, or -1 */
+    int pos;                    /* Position in the rule file */
+    int seq[2];                 /* Earlier rules which apply to G, P */
+    int nextpat;                /* First DFA pattern after this rule */
+    const struct rule *slow;    /* Next rule which can't be skipped */
+};
+
+struct ruleset {
+    struct rule *rules;
+    struct pnode trie[2];       /* Prefixes; [1] for case-insensitive */
+    struct redfa *dfa;          /* All the regexes, with REMAP_DFA */
+    const struct rule **dfarule;        /* Rule for each DFA pattern */
+    int flags;                  /* From parserulefile() */
+    int npat;
+    int nrules[2];              /* Rules which apply to G, P */
+    char macros[UCHAR_MAX + 1]; /* Macros substituted by any rule */
+};
+
+/* A memoised result */
+struct rcentry {
+    struct rcentry *hnext;      /* Hash chain */
+    struct rcentry *lnext, *lprev;      /* LRU list, most recent first */
+    unsigned int hash;
+    size_t keylen;
+    char *key;
+    char *result;               /* NULL if rejected */
+    char *errmsg;
+};
+
+/* The trie nodes a string's prefix leads to, and how deep it goes */
+struct prefixpath {
+    const struct pnode *node[2][PREFIX_MAX + 1];
+    int depth[2];
 };
 
 static int xform_null(int c)
@@ -56,28 +142,31 @@ static int xform_tolower(int c)
     return tolower(c);
 }
 
-/* Do \-substitution.  Call with string == NULL to get length only. */
-static int genmatchstring(char *string, const char *pattern,
-                          const char *input, const regmatch_t * pmatch,
-                          match_pattern_callback macrosub)
+/*
+ * Do \-substitution, in one pass, into a new string at the top of the
+ * arena.  Returns it, with its length in *lenp.
+ */
+static char *genmatchstring(struct arena *a, const char *pattern,
+                            const char *input, const regmatch_t * pmatch,
+                            match_pattern_callback macrosub,
+                            const void *cookie, size_t *lenp)
 {
     int (*xform) (int) = xform_null;
-    int len = 0;
-    int n, mlen, sublen;
-    int endbytes;
+    size_t len, n, mlen, endbytes;
+    char *string;
+    const char *p;
+    int sublen;
 
-    /* Get section before match; note pmatch[0] is the whole match */
-    endbytes = strlen(input) - pmatch[0].rm_eo;
-    len = pmatch[0].rm_so + endbytes;
-    if (string) {
-        memcpy(string, input, pmatch[0].rm_so);
-        string += pmatch[0].rm_so;
-    }
+    /* Copy section before match; note pmatch[0] is the whole match.
+       Make room for the pattern copied as is, which is usually it. */
+    endbytes = strlen(input + pmatch[0].rm_eo);
+    len = pmatch[0].rm_so;
+    string = arena_grow(a, NULL, 0,
+                        len + strlen(pattern) + endbytes + 1);
+    memcpy(string, input, len);
 
     /* Transform matched section */
     while (*pattern) {
-        mlen = 0;
-
         if (*pattern == '\\' && pattern[1] != '\0') {
             char macro = pattern[1];
             switch (macro) {
@@ -95,12 +184,9 @@ static int genmatchstring(char *string, const char *pattern,
 
                 if (pmatch[n].rm_so != -1) {
                     mlen = pmatch[n].rm_eo - pmatch[n].rm_so;
-                    len += mlen;
-                    if (string) {
-                        const char *p = input + pmatch[n].rm_so;
-                        while (mlen--)
-                            *string++ = xform(*p++);
-                    }
+                    string = arena_grow(a, string, len, mlen);
+                    for (p = input + pmatch[n].rm_so; mlen--; p++)
+                        string[len++] = xform(*p);
                 }
                 break;
 
@@ -117,36 +203,38 @@ static int genmatchstring(char *string, const char *pattern,
                 break;
 
             default:
-                if (macrosub && (sublen = macrosub(macro, string)) >= 0) {
+                if (macrosub &&
+                    (sublen = macrosub(macro, NULL, cookie)) >= 0) {
+                    /* Room for the NUL it may write, too */
+                    string = arena_grow(a, string, len, sublen + 1);
+                    macrosub(macro, string + len, cookie);
                     while (sublen--) {
+                        string[len] = xform(string[len]);
                         len++;
-                        if (string) {
-                            *string = xform(*string);
-                            string++;
-                        }
                     }
                 } else {
-                    len++;
-                    if (string)
-                        *string++ = xform(pattern[1]);
+                    string = arena_grow(a, string, len, 1);
+                    string[len++] = xform(pattern[1]);
                 }
             }
             pattern += 2;
         } else {
-            len++;
-            if (string)
-                *string++ = xform(*pattern);
-            pattern++;
+            /* A run of plain characters */
+            n = strcspn(pattern + 1, "\\") + 1;
+            string = arena_grow(a, string, len, n);
+            while (n--)
+                string[len++] = xform(*pattern++);
         }
     }
 
     /* Copy section after match */
-    if (string) {
-        memcpy(string, input + pmatch[0].rm_eo, endbytes);
-        string[endbytes] = '\0';
-    }
+    string = arena_grow(a, string, len, endbytes + 1);
+    memcpy(string + len, input + pmatch[0].rm_eo, endbytes + 1);
+    len += endbytes;
+    arena_release(a, string + len + 1);
 
-    return len;
+    *lenp = len;
+    return string;
 }
 
 /*
@@ -185,8 +273,283 @@ static int readescstring(char *buf, char **str)
     return len;
 }
 
+/*
+ * Skip a bracket expression; p points to the [.
+ */
+static const char *skipbracket(const char *p)
+{
+    p++;
+    if (*p == '^')
+        p++;
+    if (*p == ']')
+        p++;                    /* A leading ] is literal */
+    while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char end = p[1];
+            for (p += 2; *p && !(p[0] == end && p[1] == ']'); p++) ;
+            if (*p)
+                p++;
+        }
+        if (*p)
+            p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+/*
+ * Skip a parenthesized group; p points to the (.
+ */
+static const char *skipgroup(const char *p)
+{
+    int depth = 0;
+
+    while (*p) {
+        switch (*p) {
+        case '\\':
+            p += p[1] ? 2 : 1;
+            continue;
+        case '[':
+            p = skipbracket(p);
+            continue;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (!--depth)
+                return p + 1;
+            break;
+        }
+        p++;
+    }
+    return p;
+}
+
+static struct pnode *trie_insert(struct pnode *n, const char *s, int len)
+{
+    struct pnode *c;
+
+    while (len--) {
+        for (c = n->child; c && c->c != (unsigned char)*s; c = c->sibling) ;
+        if (!c) {
+            c = tfmalloc(sizeof *c);
+            c->child = NULL;
+            c->c = (unsigned char)*s;
+            c->sibling = n->child;
+            n->child = c;
+        }
+        n = c;
+        s++;
+    }
+    return n;
+}
+
+static void trie_free(struct pnode *n)
+{
+    struct pnode *c, *next;
+
+    for (c = n->child; c; c = next) {
+        next = c->sibling;
+        trie_free(c);
+        free(c);
+    }
+}
+
+/*
+ * Walk the string down both tries as far as it goes.
+ */
+static void trie_walk(const struct ruleset *set, const char *str,
+                      struct prefixpath *path)
+{
+    const struct pnode *n, *c;
+    const unsigned char *s;
+    int i, ch, d;
+
+    for (i = 0; i < 2; i++) {
+        n = path->node[i][0] = &set->trie[i];
+        s = (const unsigned char *)str;
+        for (d = 0; *s && d < PREFIX_MAX; d++, s++) {
+            ch = i ? tolower(*s) : *s;
+            for (c = n->child; c && c->c != ch; c = c->sibling) ;
+            if (!c)
+                break;
+            path->node[i][d + 1] = n = c;
+        }
+        path->depth[i] = d;
+    }
+}
+
+/*
+ * Pick out literal text any string the regex matches has to contain:
+ * the prefix of a ^-anchored regex, and the longest run of literal
+ * characters outside of groups, noting if it has to end the string.
+ * Anything we don't make sense of just ends a run, and alternation
+ * outside of a group makes us give up, so whatever we find really is
+ * required.
+ */
+static void findliterals(struct ruleset *set, struct rule *r,
+                         const char *rx)
+{
+    char *run = tfmalloc(strlen(rx) + 1);
+    char *best = tfmalloc(strlen(rx) + 1);
+    char prefix[PREFIX_MAX];
+    int rlen = 0, blen = 0, plen = 0;
+    int bestend = 0, bestprefix = 0;
+    int inprefix = 0, atend;
+    const char *p = rx;
+    int c;
+
+    if (*p == '^') {
+        inprefix = 1;
+        p++;
+    }
+
+    for (;;) {
+        atend = 0;
+        c = *p;
+        switch (c) {
+        case '\0':
+            break;
+        case '|':
+            goto done;          /* Alternation: no literals */
+        case '*':
+        case '?':
+        case '{':
+            if (rlen)
+                rlen--;         /* The last character is optional */
+            if (c == '{') {
+                while (*p && *p != '}')
+                    p++;
+            }
+            break;
+        case '+':
+            break;
+        case '(':
+            p = skipgroup(p) - 1;
+            break;
+        case '[':
+            p = skipbracket(p) - 1;
+            break;
+        case '$':
+            atend = !p[1];
+            break;
+        case '.':
+        case '^':
+            break;
+        case '\\':
+            c = (unsigned char)p[1];
+            if (!c || isalnum(c) || strchr("<>`'", c)) {
+                if (c)
+                    p++;        /* A GNU extension or backreference */
+                break;
+            }
+            p++;
+            /* fall through */
+        default:
+            if (r->icase) {
+                if (c & 0x80)
+                    break;      /* Case folding depends on the locale */
+                c = tolower(c);
+            }
+            run[rlen++] = c;
+            p++;
+            continue;
+        }
+
+        /* Whatever isn't a literal character ends the run */
+        if (rlen > blen || (atend && rlen && rlen == blen)) {
+            memcpy(best, run, rlen);
+            blen = rlen;
+            bestend = atend;
+            bestprefix = inprefix;
+        }
+        if (inprefix) {
+            plen = (rlen < PREFIX_MAX) ? rlen : PREFIX_MAX;
+            memcpy(prefix, run, plen);
+            inprefix = 0;
+        }
+        rlen = 0;
+
+        if (!*p || !*++p)
+            break;
+    }
+
+    if (plen)
+        r->prefix = trie_insert(&set->trie[r->icase], prefix, plen);
+    r->plen = plen;
+
+    /* The prefix already covers the run it came from, unless it was
+       cut short or has to end the string too */
+    if (blen && (!bestprefix || bestend || blen > plen)) {
+        best[blen] = '\0';
+        r->lit = tfstrdup(best);
+        r->litlen = blen;
+        r->litend = bestend;
+    }
+
+  done:
+    free(run);
+    free(best);
+}
+
+/*
+ * Could the rule's regex match the string?  If this says no, it won't.
+ */
+static int mightmatch(const struct rule *r, const char *s,
+                      const struct prefixpath *path)
+{
+    const char *p;
+    int i, n;
+
+    if (r->prefix && (r->plen > path->depth[r->icase] ||
+                      path->node[r->icase][r->plen] != r->prefix))
+        return 0;
+
+    if (!r->lit)
+        return 1;
+
+    if (r->litend) {
+        n = strlen(s);
+        if (n < r->litlen)
+            return 0;
+        s += n - r->litlen;
+        return r->icase ? !strcasecmp(s, r->lit) : !strcmp(s, r->lit);
+    }
+
+    if (!r->icase)
+        return strstr(s, r->lit) != NULL;
+
+    for (p = s; *p; p++) {
+        for (i = 0; i < r->litlen; i++)
+            if (tolower((unsigned char)p[i]) != (unsigned char)r->lit[i])
+                break;
+        if (i == r->litlen)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Note the macros a pattern substitutes, i.e. the \-escapes which
+ * genmatchstring() hands to the callback.
+ */
+static void findmacros(struct ruleset *set, const char *p)
+{
+    int n = strlen(set->macros);
+
+    for (; *p; p++) {
+        if (*p != '\\' || !p[1])
+            continue;
+        p++;
+        if (isdigit((unsigned char)*p) || *p == 'L' || *p == 'U' ||
+            *p == 'E' || strchr(set->macros, *p))
+            continue;
+        set->macros[n++] = *p;
+    }
+}
+
 /* Parse a line into a set of instructions */
-static int parseline(char *line, struct rule *r, int lineno)
+static int parseline(char *line, struct rule *r, int lineno,
+                     struct ruleset *set)
 {
     char buffer[MAXLINE];
     char *p;
@@ -260,10 +623,15 @@ static int parseline(char *line, struct rule *r, int lineno)
                errbuf);
         return -1;              /* Error */
     }
+    r->icase = !!(rxflags & REG_ICASE);
+    r->dfa = set->dfa ? redfa_add(set->dfa, buffer, r->icase) : -1;
+    if (r->dfa < 0)
+        findliterals(set, r, buffer);
 
     /* Read the rewrite pattern, if any */
     if (readescstring(buffer, &line)) {
         r->pattern = tfstrdup(buffer);
+        findmacros(set, r->pattern);
     } else {
         r->pattern = "";
     }
@@ -272,19 +640,70 @@ static int parseline(char *line, struct rule *r, int lineno)
     return 1;                   /* Rule found */
 }
 
-/* Read a rule file */
-struct rule *parserulefile(FILE * f)
+/*
+ * Note where each rule stands, so that with the DFA we can skip
+ * straight past the rules it says can't match.  Inverse rules fire
+ * when their regex doesn't match, so those are never skipped.
+ */
+static void index_rules(struct ruleset *set)
+{
+    struct rule *r, **v;
+    const struct rule *slow = NULL;
+    int n = 0, npat = 0, nextpat, i;
+
+    for (r = set->rules; r; r = r->next) {
+        n++;
+        if (r->dfa >= 0)
+            npat++;
+    }
+    v = tfmalloc((n ? n : 1) * sizeof *v);
+    set->dfarule = tfmalloc((npat ? npat : 1) * sizeof *set->dfarule);
+    set->npat = npat;
+
+    n = 0;
+    for (r = set->rules; r; r = r->next) {
+        r->pos = n;
+        r->seq[0] = set->nrules[0];
+        r->seq[1] = set->nrules[1];
+        if (r->rule_mode != 'P')
+            set->nrules[0]++;
+        if (r->rule_mode != 'G')
+            set->nrules[1]++;
+        if (r->dfa >= 0)
+            set->dfarule[r->dfa] = r;
+        v[n++] = r;
+    }
+
+    nextpat = npat;
+    for (i = n - 1; i >= 0; i--) {
+        v[i]->slow = slow;
+        v[i]->nextpat = nextpat;
+        if (v[i]->dfa < 0 || (v[i]->rule_flags & RULE_INVERSE))
+            slow = v[i];
+        if (v[i]->dfa >= 0)
+            nextpat = v[i]->dfa;
+    }
+    free(v);
+}
+
+/* Read a rule file; returns NULL if it has any errors */
+struct ruleset *parserulefile(FILE * f, int flags)
 {
     char line[MAXLINE];
-    struct rule *first_rule = NULL;
-    struct rule **last_rule = &first_rule;
+    struct ruleset *set = tfmalloc(sizeof(struct ruleset));
+    struct rule **last_rule = &set->rules;
     struct rule *this_rule = tfmalloc(sizeof(struct rule));
     int rv;
     int lineno = 0;
     int err = 0;
 
+    memset(set, 0, sizeof *set);
+    set->flags = flags;
+    if (flags & REMAP_DFA)
+        set->dfa = redfa_new();
+
     while (lineno++, fgets(line, MAXLINE, f)) {
-        rv = parseline(line, this_rule, lineno);
+        rv = parseline(line, this_rule, lineno, set);
         if (rv < 0)
             err = 1;
         if (rv > 0) {
@@ -296,20 +715,27 @@ struct rule *parserulefile(FILE * f)
 
     free(this_rule);            /* Last one is always unused */
 
+    if (set->dfa)
+        index_rules(set);
+
     if (err) {
-        /* Bail on error, we have already logged an error message */
-        exit(EX_CONFIG);
+        /* We have already logged an error message */
+        freerules(set);
+        return NULL;
     }
 
-    return first_rule;
+    return set;
 }
 
 /* Destroy a rule file data structure */
-void freerules(struct rule *r)
+void freerules(struct ruleset *set)
 {
-    struct rule *next;
+    struct rule *r, *next;
+
+    if (!set)
+        return;
 
-    while (r) {
+    for (r = set->rules; r; r = next) {
         next = r->next;
 
         regfree(&r->rx);
@@ -317,34 +743,130 @@ void freerules(struct rule *r)
         /* "" patterns aren't allocated by malloc() */
         if (r->pattern && *r->pattern)
             free((void *)r->pattern);
+        free(r->lit);
 
         free(r);
+    }
+
+    trie_free(&set->trie[0]);
+    trie_free(&set->trie[1]);
+    redfa_free(set->dfa);
+    free(set->dfarule);
+    free(set);
+}
+
+/*
+ * Work out which rules can match the string.
+ */
+static void prescan(const struct ruleset *set, const char *str,
+                    struct prefixpath *path, unsigned long *matches)
+{
+    trie_walk(set, str, path);
+    if (matches)
+        redfa_match(set->dfa, str, matches);
+}
 
-        r = next;
+/*
+ * Run a rule's regex on the string, unless we know it can't match, or
+ * know it does and have no use for the subexpressions.  With
+ * REMAP_NOPREFILTER, and no DFA, the regex is always run.
+ */
+static int rule_exec(const struct ruleset *set, const struct rule *r,
+                     const char *s,
+                     const struct prefixpath *path,
+                     const unsigned long *matches, regmatch_t * pmatch)
+{
+    if (r->dfa >= 0) {
+        if (!(matches[r->dfa / REDFA_BITS] &
+              (1UL << (r->dfa % REDFA_BITS))))
+            return REG_NOMATCH;
+        if ((r->rule_flags & RULE_INVERSE) ||
+            !((r->rule_flags & RULE_REWRITE) ||
+              ((r->rule_flags & RULE_ABORT) && r->pattern[0])))
+            return 0;
+    } else if (!(set->flags & REMAP_NOPREFILTER) &&
+               !mightmatch(r, s, path)) {
+        return REG_NOMATCH;
     }
+    return regexec(&r->rx, s, 10, pmatch, 0);
 }
 
-/* Execute a rule set on a string; returns a malloc'd new string. */
-char *rewrite_string(const char *input, const struct rule *rules,
-                     char mode, match_pattern_callback macrosub,
-                     const char **errmsg)
+/*
+ * The next rule to try after r.  With the DFA, rules it says can't
+ * match are skipped, but still count towards the deadman; if that
+ * runs out among them, we go one at a time so it goes off where it
+ * would have.
+ */
+static const struct rule *next_rule(const struct ruleset *set,
+                                    const struct rule *r, char mode,
+                                    const unsigned long *matches,
+                                    int *deadman)
 {
-    char *current = tfstrdup(input);
-    char *newstr;
+    const struct rule *to;
+    unsigned long w;
+    int m = (mode == 'P');
+    int i, skipped;
+
+    if (!matches)
+        return r->next;
+
+    /* The first rule on which the DFA says matches, or it doesn't cover */
+    to = r->slow;
+    for (i = r->nextpat; i < set->npat;) {
+        w = matches[i / REDFA_BITS] >> (i % REDFA_BITS);
+        if (w) {
+            while (!(w & 1)) {
+                w >>= 1;
+                i++;
+            }
+            if (!to || set->dfarule[i]->pos < to->pos)
+                to = set->dfarule[i];
+            break;
+        }
+        i = (i / REDFA_BITS + 1) * REDFA_BITS;
+    }
+
+    skipped = (to ? to->seq[m] : set->nrules[m]) - r->seq[m];
+    if (!r->rule_mode || r->rule_mode == mode)
+        skipped--;              /* r itself */
+    if (skipped > *deadman) {
+        *deadman = 0;
+        return r->next;
+    }
+    *deadman -= skipped;
+    return to;
+}
+
+/* Execute a rule set on a string; returns a new string in the arena. */
+static char *rewrite_rules(const char *input, const struct ruleset *set,
+                           char mode, match_pattern_callback macrosub,
+                           const void *cookie, const char **errmsg,
+                           struct arena *a)
+{
+    char *current, *newstr;
+    const struct rule *rules = set->rules;
     const struct rule *ruleptr = rules;
+    struct prefixpath path;
+    unsigned long *matches = NULL;
     regmatch_t pmatch[10];
-    int len;
+    size_t curlen, len;
+    int rv;
     int was_match = 0;
     int deadman = DEADMAN_MAX_STEPS;
 
-    /* Default error */
-    *errmsg = "Remap table failure";
+    *errmsg = NULL;
+    if (set->dfa)
+        matches = arena_alloc(a, redfa_words(set->dfa) * sizeof *matches);
+    curlen = strlen(input);
+    current = memcpy(arena_alloc(a, curlen + 1), input, curlen + 1);
+    prescan(set, current, &path, matches);
 
     if (verbosity >= 3) {
         syslog(LOG_INFO, "remap: input: %s", current);
     }
 
-    for (ruleptr = rules; ruleptr; ruleptr = ruleptr->next) {
+    for (ruleptr = rules; ruleptr;
+         ruleptr = next_rule(set, ruleptr, mode, matches, &deadman)) {
 	if (ruleptr->rule_mode && ruleptr->rule_mode != mode)
             continue;           /* Rule not applicable, try next */
 
@@ -352,13 +874,14 @@ char *rewrite_string(const char *input, const struct rule *rules,
             syslog(LOG_WARNING,
                    "remap: Breaking loop, input = %s, last = %s", input,
                    current);
-            free(current);
+            *errmsg = "Remap table failure";
             return NULL;        /* Did not terminate! */
         }
 
         do {
-            if (regexec(&ruleptr->rx, current, 10, pmatch, 0) ==
-                (ruleptr->rule_flags & RULE_INVERSE ? REG_NOMATCH : 0)) {
+            rv = rule_exec(set, ruleptr, current, &path, matches, pmatch);
+
+            if (rv == (ruleptr->rule_flags & RULE_INVERSE ? REG_NOMATCH : 0)) {
                 /* Match on this rule */
                 was_match = 1;
 
@@ -376,28 +899,28 @@ char *rewrite_string(const char *input, const struct rule *rules,
                     }
                     if (ruleptr->pattern[0]) {
                         /* Custom error message */
-                        len =
-                            genmatchstring(NULL, ruleptr->pattern, current,
-                                           pmatch, macrosub);
-                        newstr = tfmalloc(len + 1);
-                        genmatchstring(newstr, ruleptr->pattern, current,
-                                       pmatch, macrosub);
-                        *errmsg = newstr;
+                        *errmsg = genmatchstring(a, ruleptr->pattern,
+                                                 current, pmatch, macrosub,
+                                                 cookie, &len);
                     } else {
                         *errmsg = NULL;
                     }
-                    free(current);
                     return (NULL);
                 }
 
                 if (ruleptr->rule_flags & RULE_REWRITE) {
-                    len = genmatchstring(NULL, ruleptr->pattern, current,
-                                         pmatch, macrosub);
-                    newstr = tfmalloc(len + 1);
-                    genmatchstring(newstr, ruleptr->pattern, current,
-                                   pmatch, macrosub);
-                    free(current);
-                    current = newstr;
+                    newstr = genmatchstring(a, ruleptr->pattern, current,
+                                            pmatch, macrosub, cookie, &len);
+                    if (newstr == current + curlen + 1) {
+                        /* Reuse the space, so a long chain of rewrites
+                           doesn't keep growing the arena */
+                        memmove(current, newstr, len + 1);
+                        arena_release(a, current + len + 1);
+                    } else {
+                        current = newstr;
+                    }
+                    curlen = len;
+                    prescan(set, current, &path, matches);
                     if (verbosity >= 3) {
                         syslog(LOG_INFO, "remap: rule %d: rewrite: %s",
                                ruleptr->nrule, current);
@@ -433,3 +956,200 @@ char *rewrite_string(const char *input, const struct rule *rules,
     }
     return current;
 }
+
+static struct rcentry **rc_hash;
+static struct rcentry rc_lru;   /* List head */
+static unsigned long rc_max, rc_count, rc_mask;
+static unsigned long rc_hits, rc_misses;
+
+void remap_cache_init(unsigned long entries)
+{
+    unsigned long n;
+
+    if (rc_max) {
+        remap_cache_flush();    /* Being resized or turned off */
+        free(rc_hash);
+        rc_hash = NULL;
+    }
+
+    rc_lru.lnext = rc_lru.lprev = &rc_lru;
+    rc_max = entries;
+    if (!entries)
+        return;
+
+    /* Keep the chains about one entry long when full */
+    for (n = 16; n < entries && n < (1UL << 24); n <<= 1) ;
+    rc_hash = tfmalloc(n * sizeof *rc_hash);
+    memset(rc_hash, 0, n * sizeof *rc_hash);
+    rc_mask = n - 1;
+}
+
+static void rc_unlink(struct rcentry *rc)
+{
+    struct rcentry **pp;
+
+    for (pp = &rc_hash[rc->hash & rc_mask]; *pp != rc; pp = &(*pp)->hnext) ;
+    *pp = rc->hnext;
+    rc->lprev->lnext = rc->lnext;
+    rc->lnext->lprev = rc->lprev;
+    rc_count--;
+}
+
+static void rc_free(struct rcentry *rc)
+{
+    free(rc->key);
+    free(rc->result);
+    free(rc->errmsg);
+    free(rc);
+}
+
+void remap_cache_flush(void)
+{
+    struct rcentry *rc;
+
+    if (!rc_max)
+        return;
+
+    LOCK();
+    while ((rc = rc_lru.lnext) != &rc_lru) {
+        rc_unlink(rc);
+        rc_free(rc);
+    }
+    UNLOCK();
+}
+
+void remap_cache_report(void)
+{
+    unsigned long h, m, n;
+
+    if (!rc_max)
+        return;
+
+    LOCK();
+    h = rc_hits;
+    m = rc_misses;
+    n = rc_count;
+    UNLOCK();
+
+    syslog(LOG_INFO, "remap cache: %lu hits, %lu misses, %lu entries",
+           h, m, n);
+}
+
+/*
+ * Build the key for a rewrite: the mode, the input and the expansion of
+ * each macro the rules use, each NUL-terminated.
+ */
+static char *rc_key(const char *input, const struct ruleset *set,
+                    char mode, match_pattern_callback macrosub,
+                    const void *cookie, size_t *keylen, struct arena *a)
+{
+    int mlen[sizeof set->macros];
+    const char *m;
+    size_t len, inlen = strlen(input);
+    char *key, *p;
+    int i;
+
+    len = inlen + 2;
+    for (i = 0, m = set->macros; *m; i++, m++) {
+        mlen[i] = macrosub ? macrosub(*m, NULL, cookie) : -1;
+        if (mlen[i] > 0)
+            len += mlen[i];
+        len++;
+    }
+
+    p = key = arena_alloc(a, len + 1);  /* Room for the callback's NUL */
+    *p++ = mode;
+    memcpy(p, input, inlen + 1);
+    p += inlen + 1;
+    for (i = 0, m = set->macros; *m; i++, m++) {
+        if (mlen[i] > 0)
+            macrosub(*m, p, cookie);
+        p += (mlen[i] > 0) ? mlen[i] : 0;
+        *p++ = '\0';
+    }
+
+    *keylen = p - key;
+    return key;
+}
+
+static unsigned int rc_hashkey(const char *key, size_t len)
+{
+    unsigned int h = 2166136261U;       /* FNV-1a */
+
+    while (len--)
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+    return h;
+}
+
+/* Execute a rule set on a string; returns a new string in the arena. */
+char *rewrite_string(const char *input, const struct ruleset *set,
+                     char mode, match_pattern_callback macrosub,
+                     const void *cookie, const char **errmsg,
+                     struct arena *a)
+{
+    struct rcentry *rc;
+    char *key, *result;
+    size_t keylen;
+    unsigned int hash;
+
+    if (!rc_max)
+        return rewrite_rules(input, set, mode, macrosub, cookie, errmsg,
+                             a);
+
+    key = rc_key(input, set, mode, macrosub, cookie, &keylen, a);
+    hash = rc_hashkey(key, keylen);
+
+    LOCK();
+    for (rc = rc_hash[hash & rc_mask]; rc; rc = rc->hnext) {
+        if (rc->hash == hash && rc->keylen == keylen &&
+            !memcmp(rc->key, key, keylen))
+            break;
+    }
+    if (rc) {
+        rc_hits++;
+        rc->lprev->lnext = rc->lnext;
+        rc->lnext->lprev = rc->lprev;
+        rc->lnext = rc_lru.lnext;
+        rc->lprev = &rc_lru;
+        rc_lru.lnext->lprev = rc;
+        rc_lru.lnext = rc;
+        result = rc->result ? arena_strdup(a, rc->result) : NULL;
+        *errmsg = rc->errmsg ? arena_strdup(a, rc->errmsg) : NULL;
+        UNLOCK();
+        if (verbosity >= 3) {
+            syslog(LOG_INFO, "remap: cached: %s -> %s", input,
+                   result ? result : "(rejected)");
+        }
+        return result;
+    }
+    rc_misses++;
+    UNLOCK();
+
+    result = rewrite_rules(input, set, mode, macrosub, cookie, errmsg, a);
+
+    rc = tfmalloc(sizeof *rc);
+    rc->hash = hash;
+    rc->key = memcpy(tfmalloc(keylen), key, keylen);
+    rc->keylen = keylen;
+    rc->result = result ? tfstrdup(result) : NULL;
+    rc->errmsg = *errmsg ? tfstrdup(*errmsg) : NULL;
+
+    LOCK();
+    rc->hnext = rc_hash[hash & rc_mask];
+    rc_hash[hash & rc_mask] = rc;
+    rc->lnext = rc_lru.lnext;
+    rc->lprev = &rc_lru;
+    rc_lru.lnext->lprev = rc;
+    rc_lru.lnext = rc;
+    rc_count++;
+    /* Another thread may have raced us to add the same key; the older
+       copy just ages out */
+    while (rc_count > rc_max) {
+        struct rcentry *old = rc_lru.lprev;
+        rc_unlink(old);
+        rc_free(old);
+    }
+    UNLOCK();
+
+    return result;
+}
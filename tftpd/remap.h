@@ -17,26 +17,47 @@
 #ifndef TFTPD_REMAP_H
 #define TFTPD_REMAP_H
 
-/* Opaque type */
-struct rule;
+/* Opaque types */
+struct ruleset;
+struct arena;
 
 #ifdef WITH_REGEX
 
 /* This is called when we encounter a substitution like \i.  The
    macro character is passed as the first argument; the output buffer,
-   if any, is passed as the second argument.  The function should return
+   if any, is passed as the second argument, and the third argument is
+   the cookie passed to rewrite_string().  The function should return
    the number of characters output, or -1 on failure. */
-typedef int (*match_pattern_callback) (char, char *);
+typedef int (*match_pattern_callback) (char, char *, const void *);
 
-/* Read a rule file */
-struct rule *parserulefile(FILE *);
+/* Flags for parserulefile() */
+#define REMAP_DFA	1       /* Match the regexes with one DFA */
+#define REMAP_NOPREFILTER 2     /* Run every regex, for remapfuzz */
+
+/* Read a rule file; returns NULL, having logged why, if it has any
+   errors */
+struct ruleset *parserulefile(FILE *, int);
 
 /* Destroy a rule file data structure */
-void freerules(struct rule *);
+void freerules(struct ruleset *);
+
+/* Execute a rule set on a string; returns a new string allocated
+   from the arena.  If the string is rejected, returns NULL, and the
+   error message, if any, which is also in the arena. */
+char *rewrite_string(const char *, const struct ruleset *, char,
+                     match_pattern_callback, const void *, const char **,
+                     struct arena *);
+
+/* Memoise the results of rewrite_string() for up to this many inputs;
+   0 disables it.  The callback must return the right length when
+   passed a NULL buffer.  Calling it again empties the cache. */
+void remap_cache_init(unsigned long);
+
+/* Forget all memoised results, for when the rules are reread */
+void remap_cache_flush(void);
 
-/* Execute a rule set on a string; returns a malloc'd new string. */
-char *rewrite_string(const char *, const struct rule *, char,
-                     match_pattern_callback, const char **);
+/* Log the hit and miss counts */
+void remap_cache_report(void);
 
 #endif                          /* WITH_REGEX */
 #endif                          /* TFTPD_REMAP_H */
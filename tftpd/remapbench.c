@@ -0,0 +1,267 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * remapbench.c
+ *
+ * Benchmark for the remap engine: load a rule file, replay a list of
+ * filenames through rewrite_string() and report the rewrite rate, the
+ * median and 99th percentile latency, and the allocations made by the
+ * remap code per rewrite (those made inside the regex library are not
+ * counted).  Each rewrite gets an arena like that of a transfer.
+ *
+ *	make -C tftpd remapbench
+ *	./tftpd/remapbench [-d] [-c entries] [-n passes] rulefile [names]
+ *
+ * The names are read one per line from the file, or stdin.  A line
+ * holding "from <address> filename <name>", as logged by tftpd for
+ * each request, is replayed as that request, with its client address
+ * and direction; any other line is taken as a filename to read.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <syslog.h>
+#include "tftpd.h"
+#include "remap.h"
+
+int verbosity = 0;
+
+static unsigned long nallocs;
+
+/* The remap code allocates through these; count the calls */
+void *tfmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p) {
+        perror("malloc");
+        exit(1);
+    }
+    nallocs++;
+    return p;
+}
+
+void *tfrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (!p) {
+        perror("realloc");
+        exit(1);
+    }
+    nallocs++;
+    return p;
+}
+
+char *tfstrdup(const char *str)
+{
+    char *p = strdup(str);
+
+    if (!p) {
+        perror("strdup");
+        exit(1);
+    }
+    nallocs++;
+    return p;
+}
+
+struct request {
+    char *name;
+    char mode;                  /* 'G' or 'P' */
+    struct in_addr from;
+};
+
+static int macros(char macro, char *output, const void *cookie)
+{
+    const struct request *rq = cookie;
+    char tb[INET_ADDRSTRLEN];
+
+    switch (macro) {
+    case 'i':
+        inet_ntop(AF_INET, &rq->from, tb, sizeof tb);
+        if (output)
+            strcpy(output, tb);
+        return strlen(tb);
+    case 'x':
+        if (output)
+            sprintf(output, "%08lX", (unsigned long)ntohl(rq->from.s_addr));
+        return 8;
+    default:
+        return -1;
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Parse one line of the name list; returns 0 for a blank line */
+static int parse_request(char *line, struct request *rq)
+{
+    char *p, *from, *name;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    rq->mode = 'G';
+    inet_pton(AF_INET, "192.0.2.1", &rq->from);
+
+    name = line;
+    if ((p = strstr(line, " filename ")) && (from = strstr(line, "from "))) {
+        if (strstr(line, "WRQ from"))
+            rq->mode = 'P';
+        from += 5;
+        from[strcspn(from, " ")] = '\0';
+        inet_pton(AF_INET, from, &rq->from);
+        name = p + 10;
+        if ((p = strstr(name, " remapped to ")))
+            *p = '\0';
+    }
+    if (!*name)
+        return 0;
+
+    rq->name = strdup(name);
+    return rq->name != NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-c entries] [-n passes] "
+            "rulefile [names]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct request *rqs = NULL;
+    struct ruleset *rules;
+    unsigned long long *lat, t, total;
+    unsigned long n = 0, nmax = 0, i, pass, passes = 10, cache = 0;
+    unsigned long allocs, accepted = 0;
+    const char *errmsg;
+    char line[BUFSIZ], *result;
+    char arenabuf[XF_ARENA];    /* As in a transfer */
+    struct arena arena;
+    FILE *f;
+    int flags = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "dc:n:")) != -1) {
+        switch (c) {
+        case 'd':
+            flags |= REMAP_DFA;
+            break;
+        case 'c':
+            cache = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            passes = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || argc - optind > 2 || !passes)
+        usage(argv[0]);
+
+    /* Parse errors are logged; show them here instead */
+    openlog("remapbench", LOG_PERROR, LOG_USER);
+
+    if (!(f = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+    t = now_ns();
+    rules = parserulefile(f, flags);
+    t = now_ns() - t;
+    fclose(f);
+    if (!rules) {
+        fprintf(stderr, "%s: errors in rule file\n", argv[optind]);
+        return 1;
+    }
+    printf("rule file loaded in %.3f ms\n", t / 1e6);
+
+    f = stdin;
+    if (argc - optind > 1 && !(f = fopen(argv[optind + 1], "r"))) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    while (fgets(line, sizeof line, f)) {
+        if (n == nmax) {
+            nmax = nmax ? nmax * 2 : 1024;
+            rqs = realloc(rqs, nmax * sizeof *rqs);
+            if (!rqs) {
+                perror("realloc");
+                return 1;
+            }
+        }
+        if (parse_request(line, &rqs[n]))
+            n++;
+    }
+    if (f != stdin)
+        fclose(f);
+    if (!n) {
+        fprintf(stderr, "no filenames to replay\n");
+        return 1;
+    }
+
+    lat = malloc(n * passes * sizeof *lat);
+    if (!lat) {
+        perror("malloc");
+        return 1;
+    }
+
+    remap_cache_init(cache);
+
+    nallocs = 0;
+    total = 0;
+    for (pass = 0; pass < passes; pass++) {
+        for (i = 0; i < n; i++) {
+            t = now_ns();
+            arena_init(&arena, arenabuf, sizeof arenabuf);
+            result = rewrite_string(rqs[i].name, rules, rqs[i].mode,
+                                    macros, &rqs[i], &errmsg, &arena);
+            arena_free(&arena);
+            t = now_ns() - t;
+            lat[pass * n + i] = t;
+            total += t;
+            if (result)
+                accepted++;
+        }
+    }
+    allocs = nallocs;
+
+    qsort(lat, n * passes, sizeof *lat, cmp_ull);
+    printf("%lu names, %lu passes, %lu rewrites accepted, %s%s\n",
+           n, passes, accepted, (flags & REMAP_DFA) ? "DFA" : "regexec",
+           cache ? " with cache" : "");
+    printf("%-24s %12.0f\n", "rewrites/sec", n * passes * 1e9 / total);
+    printf("%-24s %12llu ns\n", "p50 latency", lat[n * passes / 2]);
+    printf("%-24s %12llu ns\n", "p99 latency",
+           lat[n * passes * 99 / 100]);
+    printf("%-24s %12.2f\n", "allocations/rewrite",
+           (double)allocs / (n * passes));
+
+    free(lat);
+    for (i = 0; i < n; i++)
+        free(rqs[i].name);
+    free(rqs);
+    remap_cache_init(0);
+    freerules(rules);
+    return 0;
+}
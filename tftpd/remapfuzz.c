@@ -0,0 +1,381 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * remapfuzz.c
+ *
+ * Differential fuzzer for the remap engine: every way of running the
+ * rules (the literal and prefix prefilter, the DFA, the result cache)
+ * has to give byte for byte the same result and error message as
+ * running every rule's regex with plain regexec().
+ *
+ *	make -C tftpd remapfuzz
+ *	./tftpd/remapfuzz [-n rulesets] [-s seed]
+ *	./tftpd/remapfuzz rulefile names
+ *
+ * With no files, random rule sets and filenames are generated.  Built
+ * with -DLIBFUZZER, it is a libFuzzer target instead, taking the rules,
+ * a NUL and then the filenames, one per line.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <syslog.h>
+#include "tftpd.h"
+#include "remap.h"
+
+int verbosity = 0;
+
+void *tfmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+        abort();
+    return p;
+}
+
+void *tfrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (!p)
+        abort();
+    return p;
+}
+
+char *tfstrdup(const char *str)
+{
+    char *p = strdup(str);
+
+    if (!p)
+        abort();
+    return p;
+}
+
+/* The first one is the reference */
+static const struct backend {
+    const char *name;
+    int flags;                  /* For parserulefile() */
+    unsigned long cache;        /* For remap_cache_init() */
+} backends[] = {
+    { "regexec",   REMAP_NOPREFILTER, 0 },
+    { "prefilter", 0,                 0 },
+    { "dfa",       REMAP_DFA,         0 },
+    { "cache",     0,                 64 },
+    { "dfa+cache", REMAP_DFA,         64 },
+};
+#define NBACKENDS (sizeof backends / sizeof backends[0])
+
+/* Client addresses for \i and \x; varied to check the cache keys */
+static const char *const clients[] = { "192.0.2.1", "198.51.100.7" };
+
+static int macros(char macro, char *output, const void *cookie)
+{
+    const char *client = cookie;
+    struct in_addr a;
+
+    switch (macro) {
+    case 'i':
+        if (output)
+            strcpy(output, client);
+        return strlen(client);
+    case 'x':
+        inet_pton(AF_INET, client, &a);
+        if (output)
+            sprintf(output, "%08lX", (unsigned long)ntohl(a.s_addr));
+        return 8;
+    default:
+        return -1;
+    }
+}
+
+struct outcome {
+    char *result;
+    const char *errmsg;
+    struct arena arena;
+    char buf[16];               /* Small, to make the arena grow */
+};
+
+static void rewrite(const char *name, const struct ruleset *rules,
+                    char mode, const char *client, struct outcome *o)
+{
+    arena_init(&o->arena, o->buf, sizeof o->buf);
+    o->result = rewrite_string(name, rules, mode, macros, client,
+                               &o->errmsg, &o->arena);
+}
+
+static int same(const struct outcome *a, const struct outcome *b)
+{
+    if (!a->result != !b->result || !a->errmsg != !b->errmsg)
+        return 0;
+    if (a->result && strcmp(a->result, b->result))
+        return 0;
+    return !a->errmsg || !strcmp(a->errmsg, b->errmsg);
+}
+
+static void forget(struct outcome *o)
+{
+    arena_free(&o->arena);
+}
+
+static struct ruleset *load(const char *text, int flags)
+{
+    struct ruleset *rules;
+    FILE *f = fmemopen((void *)text, strlen(text), "r");
+
+    if (!f)
+        abort();
+    rules = parserulefile(f, flags);
+    fclose(f);
+    return rules;
+}
+
+/*
+ * Run each name through every backend.  Returns the number of
+ * mismatches, which are reported on stdout.
+ */
+static unsigned long check(const char *text, char *const *names, int nnames)
+{
+    struct ruleset *rules[NBACKENDS];
+    struct outcome ref, o;
+    unsigned long bad = 0;
+    unsigned int b;
+    int i, k, mode;
+
+    for (b = 0; b < NBACKENDS; b++)
+        rules[b] = load(text, backends[b].flags);
+    if (!rules[0])
+        goto out;               /* Not a valid rule file */
+    for (b = 1; b < NBACKENDS; b++) {
+        if (!rules[b]) {
+            printf("MISMATCH %s: rejected rules\n%s\n", backends[b].name,
+                   text);
+            bad++;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nnames; i++) {
+        for (mode = 0; mode < 2; mode++) {
+            for (k = 0; k < 2; k++) {
+                remap_cache_init(0);
+                rewrite(names[i], rules[0], "GP"[mode], clients[k], &ref);
+                for (b = 1; b < NBACKENDS; b++) {
+                    remap_cache_init(backends[b].cache);
+                    /* Twice, so a cache gets a miss and then a hit */
+                    rewrite(names[i], rules[b], "GP"[mode], clients[k], &o);
+                    if (same(&ref, &o)) {
+                        forget(&o);
+                        rewrite(names[i], rules[b], "GP"[mode],
+                                clients[k], &o);
+                    }
+                    if (!same(&ref, &o)) {
+                        printf("MISMATCH %s: %c \"%s\" from %s: "
+                               "\"%s\" (%s) vs \"%s\" (%s)\n%s\n",
+                               backends[b].name, "GP"[mode], names[i],
+                               clients[k],
+                               ref.result ? ref.result : "(rejected)",
+                               ref.errmsg ? ref.errmsg : "",
+                               o.result ? o.result : "(rejected)",
+                               o.errmsg ? o.errmsg : "", text);
+                        bad++;
+                    }
+                    forget(&o);
+                }
+                forget(&ref);
+            }
+        }
+    }
+
+  out:
+    remap_cache_init(0);
+    for (b = 0; b < NBACKENDS; b++)
+        freerules(rules[b]);
+    return bad;
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    char *buf = malloc(size + 1), *text, *p, **names = NULL;
+    int nnames = 0;
+
+    if (!buf)
+        return 0;
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    text = buf;
+    for (p = buf + strlen(buf); p < buf + size; *p = '\0') {
+        p++;                    /* Past the NUL or newline */
+        names = realloc(names, (nnames + 1) * sizeof *names);
+        if (!names)
+            abort();
+        names[nnames++] = p;
+        p += strcspn(p, "\n");
+    }
+    setlogmask(LOG_MASK(LOG_EMERG));
+    if (check(text, names, nnames))
+        abort();
+    free(names);
+    free(buf);
+    return 0;
+}
+
+#else
+
+static unsigned long long rnd_state = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+    rnd_state = rnd_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rnd_state >> 33) % n;
+}
+
+#define PICK(a) (a[rnd(sizeof a / sizeof a[0])])
+
+/*
+ * Pieces of rules, picked to hit the DFA's corner cases (anchors,
+ * classes, alternation, case folding, what it refuses and leaves to
+ * regexec()) and the rewriting loop (g, s and a rules, substitutions).
+ */
+static const char *const ops[] = {
+    "r", "rg", "e", "s", "a", "ri", "rgi", "ei", "~e", "~a", "rG", "rP",
+    "i~s", "re", "rs",
+};
+static const char *const atoms[] = {
+    "a", "b", "c", "ab", "abc", "x", "/", "\\.", "\\\\", "\\#", ".",
+    "[ab]", "[^a]", "(a|b)", "(ab)", "(x)?", "a*", "b+", "c?", "a{2}",
+    "^", "$", "|", "\\<", "\\1", "A", "B", "[[:alpha:]]", "-", "01",
+    "cfg", "pxe", "[]a]", "[]-a]", "\\w",
+};
+/* A g rule loops forever, in tftpd too, unless what it substitutes
+   can't match again */
+static const char *const gatoms[] = {
+    "a", "b", "ab", "abc", "x", "\\.", "-", "01", "[ab]", "b+", "^a",
+    "c$",
+};
+static const char *const grepls[] = { "", "/" };
+static const char *const repls[] = {
+    "", "X", "\\0", "\\1y", "\\U\\0", "/\\i", "\\x-", "",
+};
+static const char namechars[] = "abcxABC/.-01#\\_^";
+
+static void genrules(char *text, size_t size)
+{
+    char rx[256], line[512];
+    const char *op, *repl;
+    int i, j, n = 1 + rnd(12);
+
+    text[0] = '\0';
+    for (i = 0; i < n; i++) {
+        op = PICK(ops);
+        rx[0] = '\0';
+        if (strchr(op, 'g')) {
+            for (j = 1 + rnd(2); j; j--)
+                strcat(rx, PICK(gatoms));
+            repl = PICK(grepls);
+        } else {
+            if (!rnd(2))
+                strcat(rx, "^");
+            for (j = 1 + rnd(5); j; j--)
+                strcat(rx, PICK(atoms));
+            if (!rnd(4))
+                strcat(rx, "$");
+            repl = strchr(op, '~') ? "" : PICK(repls);
+        }
+        snprintf(line, sizeof line, "%s\t%s\t%s\n", op, rx, repl);
+        if (strlen(text) + strlen(line) < size)
+            strcat(text, line);
+    }
+}
+
+static void genname(char *name)
+{
+    int i, len = rnd(12);
+
+    for (i = 0; i < len; i++)
+        name[i] = namechars[rnd(sizeof namechars - 1)];
+    name[len] = '\0';
+}
+
+static char *slurp(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    char *buf;
+    long len;
+
+    if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0) {
+        perror(file);
+        exit(1);
+    }
+    rewind(f);
+    buf = tfmalloc(len + 1);
+    buf[fread(buf, 1, len, f)] = '\0';
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iters = 1000, i, bad = 0;
+    char text[8192], namebuf[30][16], *names[30], *p;
+    int c, k, n;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            iters = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            rnd_state = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n rulesets] [-s seed]\n"
+                    "       %s rulefile names\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    /* Random rules often have bad regexes; don't log them */
+    setlogmask(LOG_MASK(LOG_EMERG));
+
+    if (argc - optind == 2) {
+        char *rules = slurp(argv[optind]);
+        char *list = slurp(argv[optind + 1]);
+        char **all = NULL;
+        struct ruleset *set;
+
+        n = 0;
+        for (p = strtok(list, "\r\n"); p; p = strtok(NULL, "\r\n")) {
+            all = tfrealloc(all, (n + 1) * sizeof *all);
+            all[n++] = p;
+        }
+        if (!(set = load(rules, 0))) {
+            fprintf(stderr, "%s: errors in rule file\n", argv[optind]);
+            return 1;
+        }
+        freerules(set);
+        bad = check(rules, all, n);
+        printf("%d names, %lu mismatches\n", n, bad);
+        return bad != 0;
+    }
+
+    for (k = 0; k < 30; k++)
+        names[k] = namebuf[k];
+    for (i = 0; i < iters; i++) {
+        genrules(text, sizeof text);
+        for (k = 0; k < 30; k++)
+            genname(names[k]);
+        bad += check(text, names, 30);
+    }
+    printf("%lu rule sets, %lu mismatches\n", iters, bad);
+    return bad != 0;
+}
+
+#endif
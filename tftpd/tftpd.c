@@ -43,6 +43,7 @@
  */
 
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <signal.h>
 #include <ctype.h>
 #include <pwd.h>
@@ -52,11 +53,44 @@
 #include "common/tftpsubs.h"
 #include "recvfrom.h"
 #include "remap.h"
+#include "engine.h"
+#include "cache.h"
+#include "dirtrie.h"
+#include "lookup.h"
 
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>          /* Necessary for FIONBIO on Solaris */
 #endif
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef WITH_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>       /* For --watch-map */
+#endif
+
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>        /* For UDP_SEGMENT */
+#endif
+
+#ifdef MSG_DONTWAIT
+#define RECV_NOWAIT MSG_DONTWAIT
+#else
+#define RECV_NOWAIT 0           /* Transfer sockets are nonblocking */
+#endif
+
+#ifdef WITH_WORKERS
+#include <pthread.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+#endif
+
 #ifdef HAVE_TCPWRAPPERS
 #include <tcpd.h>
 
@@ -64,6 +98,9 @@ int deny_severity = LOG_WARNING;
 int allow_severity = -1;        /* Don't log at all */
 
 static struct request_info wrap_request;
+#ifdef WITH_WORKERS
+static pthread_mutex_t wrap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 #endif
 
 #ifdef HAVE_IPV6
@@ -73,32 +110,39 @@ static int ai_fam = AF_INET;
 #endif
 
 #define	TIMEOUT 1000000         /* Default timeout (us) */
+#define MIN_TIMEOUT 10000       /* Default floor of the adaptive timeout (us) */
+#define ZEROCOPY_MIN 16384      /* Smallest block worth MSG_ZEROCOPY */
+#define READ_AHEAD 4            /* Read-ahead ring depth beyond the window */
+#define WRITE_BEHIND 8          /* Least write-behind ring depth */
+#define WRITE_BATCH 65536       /* Bytes of an upload to write at once */
+#define WINDOW_BATCH 64         /* Most blocks handed to the kernel at once */
+#define GSO_MAX 65000           /* Most bytes in one UDP GSO buffer */
 #define TRIES   6               /* Number of attempts to send each packet */
 #define TIMEOUT_LIMIT ((1 << TRIES)-1)
 
 const char *__progname;
-static int peer;
-static unsigned long timeout  = TIMEOUT;        /* Current timeout value */
 static unsigned long rexmtval = TIMEOUT;       /* Basic timeout value */
 static unsigned long maxtimeout = TIMEOUT_LIMIT * TIMEOUT;
-static int timeout_quit = 0;
-static sigjmp_buf timeoutbuf;
-static uint16_t rollover_val = 0;
+static unsigned long min_timeout = MIN_TIMEOUT; /* Adaptive timeout floor */
+static int adaptive_timeout = 0;
+static int sync_end = 0;        /* Sync uploads before the final ACK, */
+static uintmax_t sync_every = 0;        /* ... and every so many bytes */
 
 #define	PKTSIZE	MAX_SEGSIZE+4
 static char buf[PKTSIZE];
-static char ackbuf[PKTSIZE];
+static char rqbuf[MYRECV_MAX][PKTSIZE];        /* Requests read at once */
 static unsigned int max_blksize = MAX_SEGSIZE;
+static unsigned int max_window = 64;
 
-static char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
 
-static union sock_addr from;
-static socklen_t fromlen;
-static off_t tsize;
-static int tsize_ok;
+static struct sockaddr_in bindaddr4;
+#ifdef HAVE_IPV6
+static struct sockaddr_in6 bindaddr6;
+#endif
 
 static int ndirs;
 static const char **dirs;
+static struct dirtrie *dirtrie;         /* dirs[], for validate_access() */
 
 static int secure = 0;
 int cancreate = 0;
@@ -109,24 +153,29 @@ int verbosity = 0;
 
 struct formats;
 #ifdef WITH_REGEX
-static struct rule *rewrite_rules = NULL;
+static struct ruleset *rewrite_rules = NULL;
+#ifdef WITH_WORKERS
+/* Worker threads use the rules while the main thread reloads them */
+static pthread_rwlock_t rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
 #endif
 
-int tftp(struct tftphdr *, int);
-static void nak(int, const char *);
-static void timer(int);
-static void do_opt(const char *, const char *, char **);
+static void tftp(struct transfer *, struct tftphdr *, int);
+static void nak(struct transfer *, int, const char *);
+static int do_opt(struct transfer *, const char *, const char *, char **,
+                  const char *);
 
-static int set_blksize(uintmax_t *);
-static int set_blksize2(uintmax_t *);
-static int set_tsize(uintmax_t *);
-static int set_timeout(uintmax_t *);
-static int set_utimeout(uintmax_t *);
-static int set_rollover(uintmax_t *);
+static int set_blksize(struct transfer *, uintmax_t *);
+static int set_blksize2(struct transfer *, uintmax_t *);
+static int set_tsize(struct transfer *, uintmax_t *);
+static int set_timeout(struct transfer *, uintmax_t *);
+static int set_utimeout(struct transfer *, uintmax_t *);
+static int set_rollover(struct transfer *, uintmax_t *);
+static int set_windowsize(struct transfer *, uintmax_t *);
 
 struct options {
     const char *o_opt;
-    int (*o_fnc)(uintmax_t *);
+    int (*o_fnc)(struct transfer *, uintmax_t *);
 } options[] = {
     {"blksize",  set_blksize},
     {"blksize2", set_blksize2},
@@ -134,6 +183,7 @@ struct options {
     {"timeout",  set_timeout},
     {"utimeout", set_utimeout},
     {"rollover", set_rollover},
+    {"windowsize", set_windowsize},
     {NULL, NULL}
 };
 
@@ -152,31 +202,278 @@ static void handle_exit(int sig)
     exit_signal = sig;
 }
 
-/* Handle timeout signal or timeout event */
-void timer(int sig)
+#ifdef WITH_REGEX
+static FILE *rewrite_fp;        /* Map file, if kept open for reloading */
+static int remap_flags;         /* For parserulefile() */
+static struct stat rewrite_stat;        /* Map file as last read */
+
+/*
+ * Read the map file.  If keep_open is set the file is kept open and
+ * simply reread next time, for when we won't be able to open it again
+ * after chroot() and dropping privileges.  Unless fatal is set, errors
+ * are logged and NULL returned, so the caller can keep the rules it
+ * has.
+ */
+static struct ruleset *read_remap_rules(const char *file, int keep_open,
+                                        int fatal)
 {
-    (void)sig;                  /* Suppress unused warning */
-    timeout <<= 1;
-    if (timeout >= maxtimeout || timeout_quit)
-        exit(0);
-    siglongjmp(timeoutbuf, 1);
+    FILE *f = rewrite_fp;
+    struct ruleset *rulep;
+
+    if (f) {
+        rewind(f);
+    } else {
+        f = fopen(file, "rt");
+        if (!f) {
+            syslog(LOG_ERR, "Cannot open map file: %s: %m", file);
+            if (fatal)
+                exit(EX_NOINPUT);
+            return NULL;
+        }
+    }
+    fstat(fileno(f), &rewrite_stat);
+    rulep = parserulefile(f, remap_flags);
+    if (keep_open)
+        rewrite_fp = f;
+    else
+        fclose(f);
+
+    if (!rulep && fatal)
+        exit(EX_CONFIG);
+
+    return rulep;
 }
 
-#ifdef WITH_REGEX
-static struct rule *read_remap_rules(const char *file)
+/*
+ * Reread the map file and switch to the new rules, or keep the old
+ * ones if it has errors.  The new rules are compiled without holding
+ * any lock; the write lock only covers swapping the pointer, and once
+ * we have had it no request can still be using the old rules.
+ * Returns 1 if the rules were replaced.
+ */
+static int reload_remap_rules(const char *file, int keep_open)
 {
-    FILE *f;
-    struct rule *rulep;
+    struct ruleset *new_rules, *old_rules;
 
-    f = fopen(file, "rt");
-    if (!f) {
-        syslog(LOG_ERR, "Cannot open map file: %s: %m", file);
-        exit(EX_NOINPUT);
+    new_rules = read_remap_rules(file, keep_open, 0);
+    if (!new_rules) {
+        syslog(LOG_WARNING, "Keeping the old rules, map file %s is bad",
+               file);
+        return 0;
     }
-    rulep = parserulefile(f);
-    fclose(f);
 
-    return rulep;
+#ifdef WITH_WORKERS
+    pthread_rwlock_wrlock(&rules_lock);
+#endif
+    remap_cache_report();
+    remap_cache_flush();
+    old_rules = rewrite_rules;
+    rewrite_rules = new_rules;
+#ifdef WITH_WORKERS
+    pthread_rwlock_unlock(&rules_lock);
+#endif
+
+    freerules(old_rules);
+    return 1;
+}
+
+#ifdef WITH_WORKERS
+/*
+ * Map file reloads run on their own thread, so compiling a large map
+ * file doesn't hold up requests.  The main loop wakes it through a
+ * pipe on SIGHUP, and with --watch-map it also wakes up when the map
+ * file is written.  In prefork mode it writes to a second pipe when it
+ * is done, so the main loop can replace the workers.
+ */
+static const char *reload_file;
+static int reload_keep_open;
+static int reload_pipe[2] = { -1, -1 };
+static int reloaded_pipe[2] = { -1, -1 };
+static int watch_fd = -1;       /* inotify descriptor for --watch-map */
+static const char *watch_name;  /* Name of the map file in its directory */
+
+/*
+ * Forking while the reload thread holds the write lock would leave the
+ * child with a lock nobody will ever release.
+ */
+static void rules_atfork_prepare(void)
+{
+    pthread_rwlock_rdlock(&rules_lock);
+}
+
+static void rules_atfork_done(void)
+{
+    pthread_rwlock_unlock(&rules_lock);
+}
+
+static void drain_fd(int fd)
+{
+    char junk[64];
+
+    while (read(fd, junk, sizeof junk) > 0)
+        ;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Watch the directory holding the map file rather than the file, so
+ * that a file replaced by rename() is seen, and the watch keeps working
+ * after chroot().
+ */
+static void watch_remap_file(const char *file)
+{
+    char *dir = tfstrdup(file);
+    char *p = strrchr(dir, '/');
+
+    if (!p) {
+        watch_name = file;
+        strcpy(dir, ".");
+    } else {
+        watch_name = file + (p - dir) + 1;
+        if (p == dir)
+            p++;                /* File in the root directory */
+        *p = '\0';
+    }
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0 ||
+        inotify_add_watch(watch_fd, dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+        syslog(LOG_ERR, "Cannot watch map file: %s: %m", file);
+        exit(EX_OSERR);
+    }
+    free(dir);
+}
+
+/*
+ * Read the pending events, and return 1 if the map file has changed
+ * since we last read it.
+ */
+static int remap_file_changed(void)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    const struct inotify_event *ev;
+    struct stat st;
+    ssize_t len;
+    char *p;
+    int hit = 0;
+
+    while ((len = read(watch_fd, u.buf, sizeof u.buf)) > 0) {
+        for (p = u.buf; p < u.buf + len; p += sizeof *ev + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, watch_name))
+                hit = 1;
+        }
+    }
+    if (!hit)
+        return 0;
+
+    /* In multiplex mode we can only reread the file we have open */
+    if (rewrite_fp ? fstat(fileno(rewrite_fp), &st) :
+        stat(reload_file, &st))
+        return 0;
+
+    return st.st_mtime != rewrite_stat.st_mtime ||
+        st.st_size != rewrite_stat.st_size ||
+        st.st_ino != rewrite_stat.st_ino ||
+        st.st_dev != rewrite_stat.st_dev;
+}
+#endif
+
+static void *reload_thread(void *arg)
+{
+    fd_set readset;
+    int maxfd = reload_pipe[0] > watch_fd ? reload_pipe[0] : watch_fd;
+    int reload;
+
+    (void)arg;
+
+    for (;;) {
+        FD_ZERO(&readset);
+        FD_SET(reload_pipe[0], &readset);
+        if (watch_fd >= 0)
+            FD_SET(watch_fd, &readset);
+        if (select(maxfd + 1, &readset, NULL, NULL, NULL) < 0)
+            continue;
+
+        reload = 0;
+        if (FD_ISSET(reload_pipe[0], &readset)) {
+            drain_fd(reload_pipe[0]);
+            reload = 1;
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        if (watch_fd >= 0 && FD_ISSET(watch_fd, &readset) &&
+            remap_file_changed())
+            reload = 1;
+#endif
+
+        if (reload && reload_remap_rules(reload_file, reload_keep_open) &&
+            reloaded_pipe[1] >= 0)
+            write(reloaded_pipe[1], "", 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the reload thread.  It takes no signals, so they are always
+ * seen by the main loop.
+ */
+static void reload_start(const char *file, int keep_open, int notify)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    reload_file = file;
+    reload_keep_open = keep_open;
+
+    if (pipe(reload_pipe) ||
+        (notify && pipe(reloaded_pipe))) {
+        syslog(LOG_ERR, "pipe: %m");
+        exit(EX_OSERR);
+    }
+    set_socket_nonblock(reload_pipe[0], 1);
+    set_socket_nonblock(reload_pipe[1], 1);
+    if (notify) {
+        set_socket_nonblock(reloaded_pipe[0], 1);
+        set_socket_nonblock(reloaded_pipe[1], 1);
+    }
+
+    pthread_atfork(rules_atfork_prepare, rules_atfork_done,
+                   rules_atfork_done);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, reload_thread, NULL)) {
+        syslog(LOG_ERR, "Cannot start the map file reload thread");
+        exit(EX_OSERR);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif
+
+/*
+ * Reload the map file on SIGHUP.  Returns 1 if it is being done in
+ * the background, 0 if it is already done.
+ */
+static int reload_request(const char *file, int keep_open)
+{
+#ifdef WITH_WORKERS
+    if (reload_pipe[1] >= 0) {
+        /* If the pipe is full, a reload is pending already */
+        write(reload_pipe[1], "", 1);
+        return 1;
+    }
+#endif
+    reload_remap_rules(file, keep_open);
+    return 0;
 }
 #endif
 
@@ -192,6 +489,15 @@ static int lock_file(int fd, int lock_write)
   fl.l_whence = SEEK_SET;
   fl.l_start  = 0;
   fl.l_len    = 0;		/* Whole file */
+#ifdef F_OFD_SETLK
+  /* Open file description locks conflict even within a single process,
+     which matters when one process is serving many transfers. */
+  fl.l_pid    = 0;
+  if (!fcntl(fd, F_OFD_SETLK, &fl))
+      return 0;
+  if (errno != EINVAL)
+      return -1;		/* Old kernel if EINVAL, fall back */
+#endif
   return fcntl(fd, F_SETLK, &fl);
 #elif defined(HAVE_LOCK_SH_DEFINITION)
   return flock(fd, lock_write ? LOCK_EX|LOCK_NB : LOCK_SH|LOCK_NB);
@@ -200,7 +506,7 @@ static int lock_file(int fd, int lock_write)
 #endif
 }
 
-static void set_socket_nonblock(int fd, int flag)
+void set_socket_nonblock(int fd, int flag)
 {
     int err;
     int flags;
@@ -229,61 +535,171 @@ static void pmtu_discovery_off(int fd)
 #endif
 }
 
+#ifdef WITH_WORKERS
 /*
- * Receive packet with synchronous timeout; timeout is adjusted
- * to account for time spent waiting.
+ * Let several sockets bind to the same address, with the kernel
+ * spreading incoming requests between them.
  */
-static int recv_time(int s, void *rbuf, int len, unsigned int flags,
-                     unsigned long *timeout_us_p)
+static void set_reuseport(int fd)
 {
-    fd_set fdset;
-    struct timeval tmv, t0, t1;
-    int rv, err;
-    unsigned long timeout_us = *timeout_us_p;
-    unsigned long timeout_left, dt;
+    int on = 1;
 
-    gettimeofday(&t0, NULL);
-    timeout_left = timeout_us;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+        syslog(LOG_ERR, "cannot setsockopt SO_REUSEPORT: %m");
+        exit(EX_OSERR);
+    }
+}
 
-    for (;;) {
-        FD_ZERO(&fdset);
-        FD_SET(s, &fdset);
+/*
+ * Open another socket bound to the same address as the listening
+ * socket fd, for a worker thread.
+ */
+static int clone_listener(int fd)
+{
+    union sock_addr addr;
+    socklen_t len = sizeof(addr);
+    int nfd;
 
-        do {
-            tmv.tv_sec = timeout_left / 1000000;
-            tmv.tv_usec = timeout_left % 1000000;
+    if (getsockname(fd, &addr.sa, &len) < 0) {
+        syslog(LOG_ERR, "getsockname: %m");
+        exit(EX_OSERR);
+    }
+
+    nfd = socket(addr.sa.sa_family, SOCK_DGRAM, 0);
+    if (nfd < 0) {
+        syslog(LOG_ERR, "cannot open worker socket: %m");
+        exit(EX_OSERR);
+    }
+    set_socket_nonblock(nfd, 1);
+    set_reuseport(nfd);
+
+#if defined(HAVE_IPV6) && defined(IPV6_V6ONLY)
+    if (addr.sa.sa_family == AF_INET6) {
+        int on = 0;
+        socklen_t onlen = sizeof(on);
+
+        if (!getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&on, &onlen)
+            && on)
+            setsockopt(nfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&on,
+                       sizeof(on));
+    }
+#endif
+
+    if (bind(nfd, &addr.sa, len) < 0) {
+        syslog(LOG_ERR, "cannot bind worker socket: %m");
+        exit(EX_OSERR);
+    }
+
+    return nfd;
+}
+
+/*
+ * Hand each request to the worker running on the CPU which received
+ * it, so a client's retries and the rest of its transfer stay on
+ * the same CPU and worker.  This only makes sense if the workers
+ * are pinned to CPUs; if the kernel can't do it, we get the default
+ * hash of the addresses, which is just as consistent per client.
+ */
+static void steer_listener(int fd, int workers)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(HAVE_LINUX_FILTER_H) && \
+    defined(HAVE_PTHREAD_SETAFFINITY_NP)
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) && verbosity >= 1)
+        syslog(LOG_INFO, "cannot attach reuseport steering program: %m");
+#else
+    (void)fd;
+    (void)workers;
+#endif
+}
+#endif
+
+/*
+ * Wait until socket s is readable, for up to timeout_us microseconds.
+ * Returns as select() does.
+ */
+static int wait_readable(int s, unsigned long long timeout_us)
+{
+#ifdef HAVE_POLL_H
+    struct pollfd pfd;
+    unsigned long long ms = (timeout_us + 999) / 1000;
+
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, (ms > INT_MAX) ? INT_MAX : (int)ms);
+#else
+    fd_set fdset;
+    struct timeval tmv;
+
+    FD_ZERO(&fdset);
+    FD_SET(s, &fdset);
+    tmv.tv_sec = timeout_us / 1000000;
+    tmv.tv_usec = timeout_us % 1000000;
+    return select(s + 1, &fdset, NULL, NULL, &tmv);
+#endif
+}
 
-            rv = select(s + 1, &fdset, NULL, NULL, &tmv);
-            err = errno;
+#ifdef MSG_ZEROCOPY
+static void flush_errqueue(int s)
+{
+    char cbuf[256];
+    struct msghdr msg;
 
-            gettimeofday(&t1, NULL);
+    do {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+    } while (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+}
+#endif
 
-            dt = (t1.tv_sec - t0.tv_sec) * 1000000 +
-		 (t1.tv_usec - t0.tv_usec);
-            *timeout_us_p = timeout_left =
-                (dt >= timeout_us) ? 1 : (timeout_us - dt);
-        } while (rv == -1 && err == EINTR);
+/*
+ * Receive a packet, waiting no later than deadline (see monotime()).
+ * Returns -1 with errno set to ETIMEDOUT if the deadline passes.
+ *
+ * The receive itself must not block, in case the packet which woke us
+ * up has gone away by the time we get to it; if we don't have
+ * MSG_DONTWAIT the socket has been made nonblocking instead.
+ */
+static int recv_time(int s, void *rbuf, int len, unsigned int flags,
+                     unsigned long long deadline)
+{
+    unsigned long long now;
+    int rv;
 
-        if (rv == 0) {
-            timer(0);           /* Should not return */
+    for (;;) {
+        now = monotime();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
             return -1;
         }
 
-        set_socket_nonblock(s, 1);
-        rv = recv(s, rbuf, len, flags);
-        err = errno;
-        set_socket_nonblock(s, 0);
+        rv = wait_readable(s, deadline - now);
+        if (rv < 0 && errno != EINTR)
+            return -1;
+        if (rv <= 0)
+            continue;
 
-        if (rv < 0) {
-            if (E_WOULD_BLOCK(err) || err == EINTR) {
-                continue;       /* Once again, with feeling... */
-            } else {
-                errno = err;
-                return rv;
-            }
-        } else {
+        rv = recv(s, rbuf, len, flags | RECV_NOWAIT);
+        if (rv >= 0 || (!E_WOULD_BLOCK(errno) && errno != EINTR))
             return rv;
-        }
+
+#ifdef MSG_ZEROCOPY
+        /* Woken up with nothing to read: probably MSG_ZEROCOPY
+           completions, which we don't need (we never modify the
+           pages sent from), but which poll() reports until read */
+        if (E_WOULD_BLOCK(errno))
+            flush_errqueue(s);
+#endif
     }
 }
 
@@ -322,83 +738,613 @@ static int split_port(char **ap, char **pp)
     return ret;
 }
 
-enum long_only_options {
-    OPT_VERBOSITY	= 256,
-};
-    
-static struct option long_options[] = {
-    { "ipv4",        0, NULL, '4' },
-    { "ipv6",        0, NULL, '6' },
-    { "create",      0, NULL, 'c' },
-    { "secure",      0, NULL, 's' },
-    { "permissive",  0, NULL, 'p' },
-    { "verbose",     0, NULL, 'v' },
-    { "verbosity",   1, NULL, OPT_VERBOSITY },
-    { "version",     0, NULL, 'V' },
-    { "listen",      0, NULL, 'l' },
-    { "foreground",  0, NULL, 'L' },
-    { "address",     1, NULL, 'a' },
-    { "blocksize",   1, NULL, 'B' },
-    { "user",        1, NULL, 'u' },
-    { "umask",       1, NULL, 'U' },
-    { "refuse",      1, NULL, 'r' },
-    { "timeout",     1, NULL, 't' },
-    { "retransmit",  1, NULL, 'T' },
-    { "port-range",  1, NULL, 'R' },
-    { "map-file",    1, NULL, 'm' },
-    { "pidfile",     1, NULL, 'P' },
-    { NULL, 0, NULL, 0 }
-};
-static const char short_options[] = "46cspvVlLa:B:u:U:r:t:T:R:m:P:";
-
-int main(int argc, char **argv)
+/*
+ * myrecvfrom() may not have captured the local address a request was
+ * sent to; but we might have bound to a specific address, if so we
+ * should use it.
+ */
+static void fix_myaddr(const union sock_addr *from, union sock_addr *myaddr)
 {
-    struct tftphdr *tp;
-    struct passwd *pw;
-    struct options *opt;
-    union sock_addr myaddr;
-    struct sockaddr_in bindaddr4;
+    if ((from->sa.sa_family == AF_INET) &&
+        (myaddr->si.sin_addr.s_addr == INADDR_ANY)) {
+        memcpy(SOCKADDR_P(myaddr), &bindaddr4.sin_addr,
+               sizeof(bindaddr4.sin_addr));
 #ifdef HAVE_IPV6
-    struct sockaddr_in6 bindaddr6;
-    int force_ipv6 = 0;
-#endif
-    int n;
-    int fd = -1;
-    int fd4 = -1;
-    int fd6 = -1;
-    int fdmax = 0;
-    int standalone = 0;         /* Standalone (listen) mode */
-    int nodaemon = 0;           /* Do not detach process */
-    char *address = NULL;       /* Address to listen to */
-    pid_t pid;
-    mode_t my_umask = 0;
-    int spec_umask = 0;
-    int c;
-    int setrv;
-    int waittime = 900;         /* Default time to wait for a connect */
-    const char *user = "nobody";        /* Default user */
-    char *p, *ep;
-#ifdef WITH_REGEX
-    char *rewrite_file = NULL;
+    } else if ((from->sa.sa_family == AF_INET6) &&
+               IN6_IS_ADDR_UNSPECIFIED((struct in6_addr *)
+                                       SOCKADDR_P(myaddr))) {
+        memcpy(SOCKADDR_P(myaddr), &bindaddr6.sin6_addr,
+               sizeof(bindaddr6.sin6_addr));
 #endif
-    const char *pidfile = NULL;
-    u_short tp_opcode;
+    }
+}
 
-    /* basename() is way too much of a pain from a portability standpoint */
+/*
+ * Read up to n requests (n <= MYRECV_MAX) from a listening socket with
+ * a single system call where we can, into the size byte buffers that
+ * rq[].buf point to, and find out which local address each was sent
+ * to.  Returns the number of requests read.
+ */
+int recv_requests(int fd, struct myrecv *rq, int n, int size)
+{
+    int i;
 
-    p = strrchr(argv[0], '/');
-    __progname = (p && p[1]) ? p + 1 : argv[0];
+#ifdef WITH_RECVMMSG
+    for (i = 0; i < n; i++)
+        rq[i].len = size;
+    n = myrecvmmsg(fd, rq, n, 0);
+#else
+    socklen_t fromlen = sizeof(rq[0].from);
+
+    n = myrecvfrom(fd, rq[0].buf, size, 0, &rq[0].from.sa, &fromlen,
+                   &rq[0].myaddr);
+    if (n < 0)
+        return n;
+    rq[0].len = n;
+    n = 1;
+#endif
+    for (i = 0; i < n; i++)
+        fix_myaddr(&rq[i].from, &rq[i].myaddr);
+    return n;
+}
 
-    openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+#ifdef HAVE_TCPWRAPPERS
+/*
+ * Verify if this was a legal request for us.  For a forked child
+ * this is done before the chroot, while /etc is still accessible.
+ */
+static int check_access(int fd, const union sock_addr *from,
+                        const union sock_addr *myaddr)
+{
+    char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
+    int ok;
 
-    srand(time(NULL) ^ getpid());
+#ifdef WITH_WORKERS
+    pthread_mutex_lock(&wrap_lock);     /* libwrap is not thread safe */
+#endif
+    request_init(&wrap_request,
+                 RQ_DAEMON, __progname,
+                 RQ_FILE, fd,
+                 RQ_CLIENT_SIN, from, RQ_SERVER_SIN, myaddr, 0);
+    sock_methods(&wrap_request);
 
-    while ((c = getopt_long(argc, argv, short_options, long_options, NULL))
-           != -1)
-        switch (c) {
-        case '4':
-            ai_fam = AF_INET;
-            break;
+    tmp_p = (char *)inet_ntop(myaddr->sa.sa_family, SOCKADDR_P(myaddr),
+                              tmpbuf, INET6_ADDRSTRLEN);
+    if (!tmp_p) {
+        tmp_p = tmpbuf;
+        strcpy(tmpbuf, "???");
+    }
+    ok = hosts_access(&wrap_request);
+#ifdef WITH_WORKERS
+    pthread_mutex_unlock(&wrap_lock);
+#endif
+    if (ok == 0) {
+        if (deny_severity != -1)
+            syslog(deny_severity, "connection refused from %s", tmp_p);
+        return -1;              /* Access denied */
+    } else if (allow_severity != -1) {
+        syslog(allow_severity, "connect from %s", tmp_p);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Set up the supplementary group access list, chroot if running
+ * secure, and drop privileges.
+ */
+static void drop_privileges(const char *user, const struct passwd *pw)
+{
+    int setrv;
+
+    /* Set up the supplementary group access list if possible */
+    /* /etc/group still need to be accessible at this point */
+#ifdef HAVE_INITGROUPS
+    setrv = initgroups(user, pw->pw_gid);
+    if (setrv) {
+        syslog(LOG_ERR, "cannot set groups for user %s", user);
+        exit(EX_OSERR);
+    }
+#else
+    (void)user;
+#ifdef HAVE_SETGROUPS
+    if (setgroups(0, NULL)) {
+        syslog(LOG_ERR, "cannot clear group list");
+    }
+#endif
+#endif
+
+    /* Chroot and drop privileges */
+    if (secure) {
+        if (chroot(".")) {
+            syslog(LOG_ERR, "chroot: %m");
+            exit(EX_OSERR);
+        }
+#ifdef __CYGWIN__
+        chdir("/");             /* Cygwin chroot() bug workaround */
+#endif
+    }
+#ifdef HAVE_SETREGID
+    setrv = setregid(pw->pw_gid, pw->pw_gid);
+#else
+    setrv = setegid(pw->pw_gid) || setgid(pw->pw_gid);
+#endif
+
+#ifdef HAVE_SETREUID
+    setrv = setrv || setreuid(pw->pw_uid, pw->pw_uid);
+#else
+    /* Important: setuid() must come first */
+    setrv = setrv || setuid(pw->pw_uid) ||
+        (geteuid() != pw->pw_uid && seteuid(pw->pw_uid));
+#endif
+
+    if (setrv) {
+        syslog(LOG_ERR, "cannot drop privileges: %m");
+        exit(EX_OSERR);
+    }
+}
+
+static struct transfer *xf_new(const union sock_addr *,
+                               const union sock_addr *);
+static int xf_connect(struct transfer *);
+static void xf_run(struct transfer *);
+
+#ifdef WITH_PREFORK
+/*
+ * Prefork pool: worker processes which have already done the chroot
+ * and dropped privileges, and are waiting for requests.  Each worker
+ * has a socketpair to the parent; the parent sends a request (a
+ * struct pool_request followed by the packet) down it, and the worker
+ * sends a byte back whenever it is ready for another one.
+ */
+enum pool_state {
+    PS_DEAD,                    /* No process */
+    PS_STARTING,                /* Not ready yet */
+    PS_IDLE,                    /* Waiting for a request */
+    PS_BUSY                     /* Running a transfer */
+};
+
+struct pool_worker {
+    int fd;                     /* Our end of the socketpair */
+    enum pool_state state;
+    int stale;                  /* Replace when done (rules reloaded) */
+};
+
+struct pool_request {
+    union sock_addr from;
+    union sock_addr myaddr;
+};
+
+static struct pool_worker *pool;
+static int npool;
+static int pool_next;           /* Where to start looking for an idle one */
+static unsigned long pool_recycle = 1000;       /* Transfers per worker */
+static const char *pool_user;
+static struct passwd pool_pw;
+static int pool_listen[2] = { -1, -1 };
+
+/*
+ * Close the parent's end of all the socketpairs; for a newly forked
+ * process, so that workers see end of file when the parent lets go.
+ */
+static void pool_close(void)
+{
+    int i;
+
+    for (i = 0; i < npool; i++) {
+        if (pool[i].fd >= 0) {
+            close(pool[i].fd);
+            pool[i].fd = -1;
+        }
+    }
+}
+
+/*
+ * The worker process: serve requests until told to go away, or
+ * until it is time to be recycled.
+ */
+static void pool_worker(int fd)
+{
+    struct pool_request req;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct transfer *xf;
+    int spare4 = -1, spare6 = -1, *spare;
+    unsigned long count = 0;
+    int n;
+
+    set_signal(SIGTERM, SIG_DFL, 0);
+    set_signal(SIGINT, SIG_DFL, 0);
+    set_signal(SIGHUP, SIG_IGN, 0);
+
+    close(pool_listen[0]);
+    close(pool_listen[1]);
+    pool_close();
+
+    /* Get sockets for the first transfer while we still can; see the
+       comments in the child process code in main() */
+    if (pool_listen[0] >= 0)
+        spare4 = socket(AF_INET, SOCK_DGRAM, 0);
+#ifdef HAVE_IPV6
+    if (pool_listen[1] >= 0)
+        spare6 = socket(AF_INET6, SOCK_DGRAM, 0);
+#endif
+
+    if (secure) {
+        closelog();
+        openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+    }
+    drop_privileges(pool_user, &pool_pw);
+
+    for (;;) {
+        if (send(fd, "", 1, 0) != 1)
+            exit(0);            /* Parent went away */
+
+        do {
+            iov[0].iov_base = &req;
+            iov[0].iov_len = sizeof(req);
+            iov[1].iov_base = buf;
+            iov[1].iov_len = sizeof(buf);
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+            n = recvmsg(fd, &msg, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= (int)sizeof(req))
+            exit(0);            /* Retired, or the parent went away */
+        n -= sizeof(req);
+
+        xf = xf_new(&req.from, &req.myaddr);
+        spare = (req.myaddr.sa.sa_family == AF_INET) ? &spare4 : &spare6;
+        xf->peer = *spare;
+        *spare = -1;
+        if (xf->peer < 0)
+            xf->peer = socket(req.myaddr.sa.sa_family, SOCK_DGRAM, 0);
+
+        if (xf->peer < 0) {
+            syslog(LOG_ERR, "socket: %m");
+        } else if (!xf_connect(xf)) {
+            tftp(xf, (struct tftphdr *)buf, n);
+            xf_run(xf);
+        }
+        xf_free(xf);
+
+        if (pool_recycle && ++count >= pool_recycle)
+            exit(0);
+
+        /* If we can't get a socket after the chroot, let the parent
+           start a fresh worker instead */
+        *spare = socket(req.myaddr.sa.sa_family, SOCK_DGRAM, 0);
+        if (*spare < 0)
+            exit(0);
+    }
+}
+
+static void pool_spawn(struct pool_worker *w)
+{
+    int sv[2];
+    pid_t pid;
+
+    w->state = PS_DEAD;
+    w->stale = 0;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+        syslog(LOG_ERR, "socketpair: %m");
+        return;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "fork: %m");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    } else if (pid == 0) {
+        close(sv[0]);
+        pool_worker(sv[1]);
+        exit(0);                /* Not reached */
+    }
+
+    close(sv[1]);
+    set_socket_nonblock(sv[0], 1);
+    w->fd = sv[0];
+    w->state = PS_STARTING;
+}
+
+/*
+ * Get rid of a worker, and start a new one in its place unless it
+ * died before it ever got going.
+ */
+static void pool_replace(struct pool_worker *w)
+{
+    enum pool_state state = w->state;
+
+    close(w->fd);
+    w->fd = -1;
+    w->state = PS_DEAD;
+
+    if (state == PS_STARTING && !w->stale) {
+        syslog(LOG_ERR, "prefork worker failed to start");
+        return;                 /* Try again on SIGHUP */
+    }
+    pool_spawn(w);
+}
+
+static void pool_start(int n, int fd4, int fd6, const char *user,
+                       const struct passwd *pw)
+{
+    int i;
+
+    npool = n;
+    pool = xmalloc(n * sizeof(*pool));
+    pool_user = user;
+    pool_pw = *pw;
+    pool_listen[0] = fd4;
+    pool_listen[1] = fd6;
+
+    /* We'd rather get EPIPE than die if a worker goes away */
+    set_signal(SIGPIPE, SIG_IGN, 0);
+
+    for (i = 0; i < n; i++) {
+        pool[i].fd = -1;
+        pool_spawn(&pool[i]);
+    }
+}
+
+/*
+ * After rereading the configuration, replace all the workers as soon
+ * as they are not busy.
+ */
+static void pool_reload(void)
+{
+    int i;
+
+    for (i = 0; i < npool; i++) {
+        if (pool[i].state == PS_BUSY) {
+            pool[i].stale = 1;
+        } else if (pool[i].state == PS_DEAD) {
+            pool_spawn(&pool[i]);
+        } else {
+            pool[i].stale = 1;
+            pool_replace(&pool[i]);
+        }
+    }
+}
+
+static void pool_fdset(fd_set *set, int *maxfd)
+{
+    int i;
+
+    for (i = 0; i < npool; i++) {
+        if (pool[i].fd >= 0) {
+            FD_SET(pool[i].fd, set);
+            if (pool[i].fd > *maxfd)
+                *maxfd = pool[i].fd;
+        }
+    }
+}
+
+/*
+ * Collect status from the workers.
+ */
+static void pool_check(fd_set *set)
+{
+    struct pool_worker *w;
+    char c;
+    int i, n;
+
+    for (i = 0; i < npool; i++) {
+        w = &pool[i];
+        if (w->fd < 0 || !FD_ISSET(w->fd, set))
+            continue;
+
+        n = recv(w->fd, &c, 1, 0);
+        if (n == 1) {
+            if (w->stale)
+                pool_replace(w);
+            else
+                w->state = PS_IDLE;
+        } else if (n < 0 && (E_WOULD_BLOCK(errno) || errno == EINTR)) {
+            continue;
+        } else {
+            pool_replace(w);    /* Exited */
+        }
+    }
+}
+
+/*
+ * Hand a request to an idle worker.  Returns -1 if there isn't one.
+ */
+static int pool_dispatch(void *pkt, int n, const union sock_addr *from,
+                         const union sock_addr *myaddr)
+{
+    struct pool_request req;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct pool_worker *w;
+    int i;
+
+    memset(&req, 0, sizeof req);
+    req.from = *from;
+    req.myaddr = *myaddr;
+
+    for (i = 0; i < npool; i++) {
+        w = &pool[(pool_next + i) % npool];
+        if (w->state != PS_IDLE)
+            continue;
+
+        iov[0].iov_base = &req;
+        iov[0].iov_len = sizeof(req);
+        iov[1].iov_base = pkt;
+        iov[1].iov_len = n;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        if (sendmsg(w->fd, &msg, 0) == (ssize_t)(sizeof(req) + n)) {
+            w->state = PS_BUSY;
+            pool_next = (pool_next + i + 1) % npool;
+            return 0;
+        }
+        pool_replace(w);        /* It must have died on us */
+    }
+
+    return -1;
+}
+#endif
+
+/*
+ * Parse a number of bytes, which may be followed by k, m or g.
+ * Returns nonzero if that isn't what it is.
+ */
+static int parse_size(const char *str, uintmax_t *vp)
+{
+    char *ep;
+    uintmax_t v = strtoumax(str, &ep, 10);
+
+    switch (*ep) {
+    case 'g': case 'G':
+        v <<= 10;
+        /* fall through */
+    case 'm': case 'M':
+        v <<= 10;
+        /* fall through */
+    case 'k': case 'K':
+        v <<= 10;
+        ep++;
+        break;
+    }
+    *vp = v;
+    return *ep != '\0';
+}
+
+enum long_only_options {
+    OPT_VERBOSITY	= 256,
+    OPT_MULTIPLEX,
+    OPT_WORKERS,
+    OPT_PREFORK,
+    OPT_RECYCLE,
+    OPT_CACHE_SIZE,
+    OPT_WINDOWSIZE,
+    OPT_ADAPTIVE_TIMEOUT,
+    OPT_MIN_TIMEOUT,
+    OPT_REMAP_CACHE,
+    OPT_REMAP_DFA,
+    OPT_WATCH_MAP,
+    OPT_LOOKUP_CACHE,
+    OPT_LOOKUP_TTL,
+    OPT_SYNC,
+};
+    
+static struct option long_options[] = {
+    { "ipv4",        0, NULL, '4' },
+    { "ipv6",        0, NULL, '6' },
+    { "create",      0, NULL, 'c' },
+    { "secure",      0, NULL, 's' },
+    { "permissive",  0, NULL, 'p' },
+    { "verbose",     0, NULL, 'v' },
+    { "verbosity",   1, NULL, OPT_VERBOSITY },
+    { "version",     0, NULL, 'V' },
+    { "listen",      0, NULL, 'l' },
+    { "foreground",  0, NULL, 'L' },
+    { "address",     1, NULL, 'a' },
+    { "blocksize",   1, NULL, 'B' },
+    { "windowsize",  1, NULL, OPT_WINDOWSIZE },
+    { "user",        1, NULL, 'u' },
+    { "umask",       1, NULL, 'U' },
+    { "refuse",      1, NULL, 'r' },
+    { "timeout",     1, NULL, 't' },
+    { "retransmit",  1, NULL, 'T' },
+    { "adaptive-timeout", 0, NULL, OPT_ADAPTIVE_TIMEOUT },
+    { "min-timeout", 1, NULL, OPT_MIN_TIMEOUT },
+    { "port-range",  1, NULL, 'R' },
+    { "map-file",    1, NULL, 'm' },
+    { "remap-cache", 1, NULL, OPT_REMAP_CACHE },
+    { "remap-dfa",   0, NULL, OPT_REMAP_DFA },
+    { "watch-map",   0, NULL, OPT_WATCH_MAP },
+    { "pidfile",     1, NULL, 'P' },
+    { "multiplex",   0, NULL, OPT_MULTIPLEX },
+    { "workers",     1, NULL, OPT_WORKERS },
+    { "prefork",     1, NULL, OPT_PREFORK },
+    { "recycle",     1, NULL, OPT_RECYCLE },
+    { "cache-size",  1, NULL, OPT_CACHE_SIZE },
+    { "lookup-cache", 1, NULL, OPT_LOOKUP_CACHE },
+    { "lookup-ttl",  1, NULL, OPT_LOOKUP_TTL },
+    { "sync",        1, NULL, OPT_SYNC },
+    { NULL, 0, NULL, 0 }
+};
+static const char short_options[] = "46cspvVlLa:B:u:U:r:t:T:R:m:P:";
+
+int main(int argc, char **argv)
+{
+    struct tftphdr *tp;
+    struct passwd *pw;
+    struct options *opt;
+    struct transfer *xf;
+    union sock_addr from, myaddr;
+    struct myrecv rq[MYRECV_MAX];
+    int nrq = 0, irq = 0;       /* Requests in rq[], and handled so far */
+#ifdef HAVE_IPV6
+    int force_ipv6 = 0;
+#endif
+    int n;
+    int fd = -1;
+    int fd4 = -1;
+    int fd6 = -1;
+    int fdmax = 0;
+    int maxfd;
+    int standalone = 0;         /* Standalone (listen) mode */
+    int nodaemon = 0;           /* Do not detach process */
+    int multiplex = 0;          /* Serve all transfers in this process */
+    uintmax_t cache_size = 0;   /* File cache budget, if multiplexing */
+    int lookup_entries = 0;     /* Filename lookups to remember */
+    unsigned long lookup_ttl = 2000;    /* ... for this many ms */
+#ifdef WITH_REGEX
+    unsigned long remap_cache = 0;      /* Remap results to memoise */
+    int watch_map = 0;          /* Reload the map file when it changes */
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    struct engine *eng = NULL;
+#endif
+#ifdef WITH_PREFORK
+    int prefork = 0;            /* Number of prefork workers */
+#endif
+#ifdef WITH_WORKERS
+    int workers = 0;            /* Number of worker threads */
+    int *wfd4 = NULL, *wfd6 = NULL;
+    sigset_t sigs, waitsigs;
+    int i;
+#endif
+    char *address = NULL;       /* Address to listen to */
+    pid_t pid;
+    mode_t my_umask = 0;
+    int spec_umask = 0;
+    int c;
+    int waittime = 900;         /* Default time to wait for a connect */
+    const char *user = "nobody";        /* Default user */
+    char *p, *ep;
+#ifdef WITH_REGEX
+    char *rewrite_file = NULL;
+#endif
+    const char *pidfile = NULL;
+    u_short tp_opcode;
+
+    /* basename() is way too much of a pain from a portability standpoint */
+
+    p = strrchr(argv[0], '/');
+    __progname = (p && p[1]) ? p + 1 : argv[0];
+
+    openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+
+    srand(time(NULL) ^ getpid());
+
+    while ((c = getopt_long(argc, argv, short_options, long_options, NULL))
+           != -1)
+        switch (c) {
+        case '4':
+            ai_fam = AF_INET;
+            break;
 #ifdef HAVE_IPV6
         case '6':
             ai_fam = AF_INET6;
@@ -439,6 +1385,18 @@ int main(int argc, char **argv)
                 }
             }
             break;
+        case OPT_WINDOWSIZE:
+            {
+                char *vp;
+                max_window = (unsigned int)strtoul(optarg, &vp, 10);
+                if (max_window < 1 || max_window > 65535 || *vp) {
+                    syslog(LOG_ERR,
+                           "Bad maximum window size (range 1-65535): %s",
+                           optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
         case 'T':
             {
                 char *vp;
@@ -447,10 +1405,24 @@ int main(int argc, char **argv)
                     syslog(LOG_ERR, "Bad timeout value: %s", optarg);
                     exit(EX_USAGE);
                 }
-                rexmtval = timeout = tov;
+                rexmtval = tov;
                 maxtimeout = rexmtval * TIMEOUT_LIMIT;
             }
             break;
+        case OPT_ADAPTIVE_TIMEOUT:
+            adaptive_timeout = 1;
+            break;
+        case OPT_MIN_TIMEOUT:
+            {
+                char *vp;
+                unsigned long tov = strtoul(optarg, &vp, 10);
+                if (tov < 100UL || tov > 255000000UL || *vp) {
+                    syslog(LOG_ERR, "Bad minimum timeout value: %s", optarg);
+                    exit(EX_USAGE);
+                }
+                min_timeout = tov;
+            }
+            break;
         case 'R':
             {
                 if (sscanf(optarg, "%u:%u", &portrange_from, &portrange_to)
@@ -493,7 +1465,59 @@ int main(int argc, char **argv)
             }
             rewrite_file = optarg;
             break;
+        case OPT_REMAP_CACHE:
+            {
+                char *vp;
+                remap_cache = strtoul(optarg, &vp, 10);
+                if (*vp || remap_cache > 1000000) {
+                    syslog(LOG_ERR, "Bad remap cache size: %s", optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
+        case OPT_REMAP_DFA:
+            remap_flags |= REMAP_DFA;
+            break;
+#if defined(WITH_WORKERS) && defined(HAVE_SYS_INOTIFY_H)
+        case OPT_WATCH_MAP:
+            watch_map = 1;
+            break;
+#endif
 #endif
+        case OPT_LOOKUP_CACHE:
+            {
+                char *vp;
+                lookup_entries = (int)strtoul(optarg, &vp, 10);
+                if (*vp || lookup_entries < 0 || lookup_entries > 1000000) {
+                    syslog(LOG_ERR, "Bad lookup cache size: %s", optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
+        case OPT_LOOKUP_TTL:
+            {
+                char *vp;
+                lookup_ttl = strtoul(optarg, &vp, 10);
+                if (*vp || !lookup_ttl || lookup_ttl > 3600000) {
+                    syslog(LOG_ERR, "Bad lookup cache TTL: %s", optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
+        case OPT_SYNC:
+            if (!strcmp(optarg, "none")) {
+                sync_end = 0;
+                sync_every = 0;
+            } else if (!strcmp(optarg, "end")) {
+                sync_end = 1;
+                sync_every = 0;
+            } else if (!parse_size(optarg, &sync_every) && sync_every) {
+                sync_end = 1;
+            } else {
+                syslog(LOG_ERR, "Bad sync policy: %s", optarg);
+                exit(EX_USAGE);
+            }
+            break;
         case 'v':
             verbosity++;
             break;
@@ -508,6 +1532,54 @@ int main(int argc, char **argv)
         case 'P':
             pidfile = optarg;
             break;
+#ifdef HAVE_SYS_EPOLL_H
+        case OPT_MULTIPLEX:
+            multiplex = 1;
+            break;
+        case OPT_CACHE_SIZE:
+            if (parse_size(optarg, &cache_size) ||
+                cache_size > (size_t)-1) {
+                syslog(LOG_ERR, "Bad cache size: %s", optarg);
+                exit(EX_USAGE);
+            }
+            break;
+#endif
+#ifdef WITH_WORKERS
+        case OPT_WORKERS:
+            {
+                char *vp;
+                workers = (int)strtoul(optarg, &vp, 10);
+                if (workers < 1 || workers > 1024 || *vp) {
+                    syslog(LOG_ERR, "Bad number of workers: %s", optarg);
+                    exit(EX_USAGE);
+                }
+                multiplex = 1;
+            }
+            break;
+#endif
+#ifdef WITH_PREFORK
+        case OPT_PREFORK:
+            {
+                char *vp;
+                prefork = (int)strtoul(optarg, &vp, 10);
+                if (prefork < 1 || prefork > 1024 || *vp) {
+                    syslog(LOG_ERR, "Bad number of prefork workers: %s",
+                           optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
+        case OPT_RECYCLE:
+            {
+                char *vp;
+                pool_recycle = strtoul(optarg, &vp, 10);
+                if (*vp) {
+                    syslog(LOG_ERR, "Bad recycle count: %s", optarg);
+                    exit(EX_USAGE);
+                }
+            }
+            break;
+#endif
         default:
             syslog(LOG_ERR, "Unknown option: '%c'", optopt);
             break;
@@ -532,6 +1604,8 @@ int main(int argc, char **argv)
             syslog(LOG_ERR, "%s: %m", dirs[0]);
             exit(EX_NOINPUT);
         }
+    } else {
+        dirtrie = dirtrie_build(dirs);
     }
 
     pw = getpwnam(user);
@@ -540,10 +1614,44 @@ int main(int argc, char **argv)
         exit(EX_NOUSER);
     }
 
+    if (multiplex && !standalone) {
+        syslog(LOG_ERR,
+               "--multiplex and --workers require --listen or --foreground");
+        exit(EX_USAGE);
+    }
+
+    if (cache_size && !multiplex) {
+        syslog(LOG_ERR, "--cache-size requires --multiplex or --workers");
+        exit(EX_USAGE);
+    }
+
+#ifdef WITH_PREFORK
+    if (prefork && (multiplex || !standalone)) {
+        syslog(LOG_ERR, "--prefork requires --listen or --foreground, "
+               "and no --multiplex or --workers");
+        exit(EX_USAGE);
+    }
+#endif
+
 #ifdef WITH_REGEX
+    if ((remap_cache || remap_flags) && !rewrite_file) {
+        syslog(LOG_ERR, "--remap-cache and --remap-dfa require --map-file");
+        exit(EX_USAGE);
+    }
+    if (watch_map && (!rewrite_file || !standalone)) {
+        syslog(LOG_ERR, "--watch-map requires --map-file, and --listen "
+               "or --foreground");
+        exit(EX_USAGE);
+    }
     if (rewrite_file)
-        rewrite_rules = read_remap_rules(rewrite_file);
+        rewrite_rules = read_remap_rules(rewrite_file, multiplex, 1);
+#if defined(WITH_WORKERS) && defined(HAVE_SYS_INOTIFY_H)
+    if (watch_map)
+        watch_remap_file(rewrite_file);
+#endif
+    remap_cache_init(remap_cache);
 #endif
+    lookup_init(lookup_entries, lookup_ttl * 1000ULL);
 
     if (pidfile && !standalone) {
         syslog(LOG_WARNING, "not in standalone mode, ignoring pid file");
@@ -700,6 +1808,14 @@ int main(int argc, char **argv)
             }
         }
 
+#ifdef WITH_WORKERS
+        if (workers > 1) {
+            if (fd4 >= 0)
+                set_reuseport(fd4);
+            if (fd6 >= 0)
+                set_reuseport(fd6);
+        }
+#endif
         if (fd4 >= 0) {
             if (bind(fd4, (struct sockaddr *)&bindaddr4,
               sizeof(bindaddr4)) < 0) {
@@ -730,6 +1846,25 @@ int main(int argc, char **argv)
                 }
             }
         }
+#endif
+#ifdef WITH_WORKERS
+        if (workers) {
+            /* One set of listening sockets per worker */
+            wfd4 = xmalloc(workers * sizeof(int));
+            wfd6 = xmalloc(workers * sizeof(int));
+            wfd4[0] = fd4;
+            wfd6[0] = fd6;
+            for (i = 1; i < workers; i++) {
+                wfd4[i] = (fd4 >= 0) ? clone_listener(fd4) : -1;
+                wfd6[i] = (fd6 >= 0) ? clone_listener(fd6) : -1;
+            }
+            if (workers > 1) {
+                if (fd4 >= 0)
+                    steer_listener(fd4, workers);
+                if (fd6 >= 0)
+                    steer_listener(fd6, workers);
+            }
+        }
 #endif
         /* Daemonize this process */
         /* Note: when running in secure mode (-s), we must not chdir, since
@@ -787,6 +1922,60 @@ int main(int argc, char **argv)
     if (spec_umask || !unixperms)
         umask(my_umask);
 
+#ifdef WITH_PREFORK
+    if (prefork)
+        pool_start(prefork, fd4, fd6, user, pw);
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (multiplex) {
+        /* All transfers are served by this process, so chroot and
+           drop privileges once and for all.  See the child process
+           code below for the syslog dance. */
+        if (secure) {
+            closelog();
+            openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+        }
+        drop_privileges(user, pw);
+        pidfile = NULL;         /* No longer have the rights to remove it */
+        cache_init(cache_size);
+
+#ifdef WITH_WORKERS
+        if (workers) {
+            /* Leave signal handling to this thread, which does
+               nothing else */
+            sigemptyset(&sigs);
+            sigaddset(&sigs, SIGHUP);
+            sigaddset(&sigs, SIGTERM);
+            sigaddset(&sigs, SIGINT);
+            pthread_sigmask(SIG_BLOCK, &sigs, &waitsigs);
+
+            for (i = 0; i < workers; i++)
+                engine_spawn(wfd4[i], wfd6[i], i);
+        } else
+#endif
+        {
+            eng = engine_new();
+            if (fd4 >= 0)
+                engine_listen(eng, fd4);
+            if (fd6 >= 0)
+                engine_listen(eng, fd6);
+        }
+    }
+#endif
+
+#if defined(WITH_REGEX) && defined(WITH_WORKERS)
+    if (rewrite_file && standalone)
+#ifdef WITH_PREFORK
+        reload_start(rewrite_file, multiplex, prefork);
+#else
+        reload_start(rewrite_file, multiplex, 0);
+#endif
+#endif
+
+    for (n = 0; n < MYRECV_MAX; n++)
+        rq[n].buf = rqbuf[n];
+
     while (1) {
         fd_set readset;
         struct timeval tv_waittime;
@@ -804,18 +1993,42 @@ int main(int argc, char **argv)
         if (caught_sighup) {
             caught_sighup = 0;
             if (standalone) {
+                int pending = 0;
+
 #ifdef WITH_REGEX
-                if (rewrite_file) {
-                    freerules(rewrite_rules);
-                    rewrite_rules = read_remap_rules(rewrite_file);
-                }
+                if (rewrite_file)
+                    pending = reload_request(rewrite_file, multiplex);
+#endif
+#ifdef WITH_PREFORK
+                /* Otherwise done once the new rules are in place */
+                if (prefork && !pending)
+                    pool_reload();
 #endif
+                (void)pending;
+                cache_report();
+                lookup_report();
             } else {
                 /* Return to inetd for respawn */
                 exit(0);
             }
         }
 
+#ifdef WITH_WORKERS
+        if (workers) {
+            sigsuspend(&waitsigs);      /* The workers do the work */
+            continue;
+        }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+        if (eng) {
+            engine_poll(eng);
+            continue;
+        }
+#endif
+
+        if (irq < nrq)
+            goto next_request;  /* Still have some from last time */
+
         FD_ZERO(&readset);
         if (standalone) {
             if (fd4 >= 0) {
@@ -847,8 +2060,21 @@ int main(int argc, char **argv)
         tv_waittime.tv_usec = 0;
 
 
+        maxfd = fdmax;
+#ifdef WITH_PREFORK
+        if (prefork)
+            pool_fdset(&readset, &maxfd);
+#if defined(WITH_REGEX) && defined(WITH_WORKERS)
+        if (reloaded_pipe[0] >= 0) {
+            FD_SET(reloaded_pipe[0], &readset);
+            if (reloaded_pipe[0] > maxfd)
+                maxfd = reloaded_pipe[0];
+        }
+#endif
+#endif
+
         /* Never time out if we're in standalone mode */
-        rv = select(fdmax + 1, &readset, NULL, NULL,
+        rv = select(maxfd + 1, &readset, NULL, NULL,
                     standalone ? NULL : &tv_waittime);
         if (rv == -1 && errno == EINTR)
             continue;           /* Signal caught, reloop */
@@ -860,6 +2086,17 @@ int main(int argc, char **argv)
             exit(0);            /* Timeout, return to inetd */
         }
 
+#ifdef WITH_PREFORK
+        if (prefork)
+            pool_check(&readset);
+#if defined(WITH_REGEX) && defined(WITH_WORKERS)
+        if (reloaded_pipe[0] >= 0 && FD_ISSET(reloaded_pipe[0], &readset)) {
+            drain_fd(reloaded_pipe[0]);
+            pool_reload();
+        }
+#endif
+#endif
+
         if (standalone) {
             if ((fd4 >= 0) && FD_ISSET(fd4, &readset))
                 fd = fd4;
@@ -874,11 +2111,10 @@ int main(int argc, char **argv)
         set_socket_nonblock(fd, 0);
 #endif
 
-        fromlen = sizeof(from);
-        n = myrecvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *)&from, &fromlen, &myaddr);
+        nrq = recv_requests(fd, rq, MYRECV_MAX, PKTSIZE);
+        irq = 0;
 
-        if (n < 0) {
+        if (nrq < 0) {
             if (E_WOULD_BLOCK(errno) || errno == EINTR) {
                 continue;       /* Again, from the top */
             } else {
@@ -886,6 +2122,13 @@ int main(int argc, char **argv)
                 exit(EX_IOERR);
             }
         }
+
+      next_request:
+        n = rq[irq].len;
+        from = rq[irq].from;
+        myaddr = rq[irq].myaddr;
+        memcpy(buf, rq[irq].buf, n);
+        irq++;
 #ifdef HAVE_IPV6
         if ((from.sa.sa_family != AF_INET) && (from.sa.sa_family != AF_INET6)) {
             syslog(LOG_ERR, "received address was not AF_INET/AF_INET6,"
@@ -898,22 +2141,21 @@ int main(int argc, char **argv)
             exit(EX_PROTOCOL);
         }
 
-        if (standalone) {
-            if ((from.sa.sa_family == AF_INET) &&
-              (myaddr.si.sin_addr.s_addr == INADDR_ANY)) {
-                /* myrecvfrom() didn't capture the source address; but we might
-                   have bound to a specific address, if so we should use it */
-                memcpy(SOCKADDR_P(&myaddr), &bindaddr4.sin_addr,
-                       sizeof(bindaddr4.sin_addr));
-#ifdef HAVE_IPV6
-            } else if ((from.sa.sa_family == AF_INET6) &&
-		       IN6_IS_ADDR_UNSPECIFIED((struct in6_addr *)
-					       SOCKADDR_P(&myaddr))) {
-		memcpy(SOCKADDR_P(&myaddr), &bindaddr6.sin6_addr,
-		       sizeof(bindaddr6.sin6_addr));
+#ifdef WITH_PREFORK
+        if (prefork) {
+            tp_opcode = ntohs(((struct tftphdr *)buf)->th_opcode);
+            if (tp_opcode != RRQ && tp_opcode != WRQ)
+                continue;
+#ifdef HAVE_TCPWRAPPERS
+            /* The workers can't do this after the chroot */
+            if (check_access(fd, &from, &myaddr))
+                continue;
 #endif
-            }
+            if (!pool_dispatch(buf, n, &from, &myaddr))
+                continue;
+            /* Otherwise they are all busy; fork as usual */
         }
+#endif
 
         /*
          * Now that we have read the request packet from the UDP
@@ -927,6 +2169,10 @@ int main(int argc, char **argv)
             break;              /* Child exit, parent loop */
     }
 
+#ifdef WITH_PREFORK
+    pool_close();
+#endif
+
     /* Child process: handle the actual request here */
 
     /* Ignore SIGHUP */
@@ -941,28 +2187,11 @@ int main(int argc, char **argv)
         openlog(__progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
     }
 
-#ifdef HAVE_TCPWRAPPERS
-    /* Verify if this was a legal request for us.  This has to be
-       done before the chroot, while /etc is still accessible. */
-    request_init(&wrap_request,
-                 RQ_DAEMON, __progname,
-                 RQ_FILE, fd,
-                 RQ_CLIENT_SIN, &from, RQ_SERVER_SIN, &myaddr, 0);
-    sock_methods(&wrap_request);
+    xf = xf_new(&from, &myaddr);
 
-    tmp_p = (char *)inet_ntop(myaddr.sa.sa_family, SOCKADDR_P(&myaddr),
-                              tmpbuf, INET6_ADDRSTRLEN);
-    if (!tmp_p) {
-        tmp_p = tmpbuf;
-        strcpy(tmpbuf, "???");
-    }
-    if (hosts_access(&wrap_request) == 0) {
-        if (deny_severity != -1)
-            syslog(deny_severity, "connection refused from %s", tmp_p);
+#ifdef HAVE_TCPWRAPPERS
+    if (check_access(fd, &xf->from, &xf->myaddr))
         exit(EX_NOPERM);        /* Access denied */
-    } else if (allow_severity != -1) {
-        syslog(allow_severity, "connect from %s", tmp_p);
-    }
 #endif
 
     /* Close file descriptors we don't need */
@@ -971,765 +2200,1858 @@ int main(int argc, char **argv)
     /* Get a socket.  This has to be done before the chroot(), since
        some systems require access to /dev to create a socket. */
 
-    peer = socket(myaddr.sa.sa_family, SOCK_DGRAM, 0);
-    if (peer < 0) {
+    xf->peer = socket(myaddr.sa.sa_family, SOCK_DGRAM, 0);
+    if (xf->peer < 0) {
         syslog(LOG_ERR, "socket: %m");
         exit(EX_IOERR);
     }
 
-    /* Set up the supplementary group access list if possible */
-    /* /etc/group still need to be accessible at this point */
-#ifdef HAVE_INITGROUPS
-    setrv = initgroups(user, pw->pw_gid);
-    if (setrv) {
-        syslog(LOG_ERR, "cannot set groups for user %s", user);
-        exit(EX_OSERR);
+    drop_privileges(user, pw);
+
+    /* Process the request... */
+    if (xf_connect(xf))
+        exit(EX_IOERR);
+
+    tp = (struct tftphdr *)buf;
+    tp_opcode = ntohs(tp->th_opcode);
+    if (tp_opcode == RRQ || tp_opcode == WRQ) {
+        tftp(xf, tp, n);
+        xf_run(xf);
+    }
+    exit(0);
+}
+
+/*
+ * Allocate the state for a new transfer.
+ */
+static struct transfer *xf_new(const union sock_addr *from,
+                               const union sock_addr *myaddr)
+{
+    struct transfer *xf = tfmalloc(sizeof *xf);
+
+    memset(xf, 0, sizeof *xf);
+    xf->peer = -1;
+    xf->fd = -1;
+    xf->from = *from;
+    xf->myaddr = *myaddr;
+    xf->state = XS_DONE;        /* Until the request has been accepted */
+    xf->segsize = SEGSIZE;
+    xf->rexmtval = xf->timeout = rexmtval;
+    xf->maxtimeout = maxtimeout;
+    xf->window = 1;
+    if (adaptive_timeout)
+        xf->flags |= XF_ADAPTIVE;
+    arena_init(&xf->arena, xf->arenabuf, sizeof xf->arenabuf);
+
+    return xf;
+}
+
+/*
+ * Release all resources held by a transfer.
+ */
+void xf_free(struct transfer *xf)
+{
+    if (xf->fd >= 0)
+        close(xf->fd);
+    if (xf->peer >= 0)
+        close(xf->peer);
+    rw_free(&xf->rw);
+    if (xf->cache)
+        cache_put(xf->cache);
+#ifdef WITH_MMAP
+    else if (xf->map)
+        munmap(xf->map, xf->maplen);
+#endif
+    free(xf->hdrs);
+    free(xf->wiov);
+    free(xf->spare);
+    arena_free(&xf->arena);
+    free(xf);
+}
+
+/*
+ * Bind the transfer socket to a local port and connect it to the client.
+ */
+static int xf_connect(struct transfer *xf)
+{
+    if (pick_port_bind(xf->peer, &xf->myaddr,
+                       portrange_from, portrange_to) < 0) {
+        syslog(LOG_ERR, "bind: %m");
+        return -1;
+    }
+
+    if (connect(xf->peer, &xf->from.sa, SOCKLEN(&xf->from)) < 0) {
+        syslog(LOG_ERR, "connect: %m");
+        return -1;
     }
+
+    /* Disable path MTU discovery */
+    pmtu_discovery_off(xf->peer);
+
+    return 0;
+}
+
+/*
+ * Set up a transfer for a request received on the listening socket
+ * fd, for the multiplexing engine.  Returns NULL if the request never
+ * got as far as a transfer socket; otherwise the engine owns the
+ * transfer, which may already be finished but still have packets
+ * queued for sending.
+ */
+struct transfer *xf_request(struct engine *e, int fd, struct tftphdr *tp,
+                            int size, const union sock_addr *from,
+                            const union sock_addr *myaddr)
+{
+    struct transfer *xf;
+    u_short tp_opcode = ntohs(tp->th_opcode);
+
+    if (tp_opcode != RRQ && tp_opcode != WRQ)
+        return NULL;
+
+    xf = xf_new(from, myaddr);
+
+#ifdef HAVE_TCPWRAPPERS
+    if (check_access(fd, &xf->from, &xf->myaddr))
+        goto done;
 #else
-#ifdef HAVE_SETGROUPS
-    if (setgroups(0, NULL)) {
-        syslog(LOG_ERR, "cannot clear group list");
+    (void)fd;
+#endif
+
+    xf->peer = socket(xf->myaddr.sa.sa_family, SOCK_DGRAM, 0);
+    if (xf->peer < 0) {
+        syslog(LOG_ERR, "socket: %m");
+        goto done;
+    }
+
+    if (xf_connect(xf))
+        goto done;
+
+    xf->engine = e;
+    tftp(xf, tp, size);
+    return xf;
+
+  done:
+    xf_free(xf);
+    return NULL;
+}
+
+/*
+ * Run a single transfer to completion, waiting for each packet in turn.
+ */
+static void xf_run(struct transfer *xf)
+{
+    int n;
+
+#ifndef MSG_DONTWAIT
+    set_socket_nonblock(xf->peer, 1);
+#endif
+
+    while (xf->state != XS_DONE) {
+        n = recv_time(xf->peer, xf->rxbuf, xf->rxlen, 0, xf->deadline);
+        if (n >= 0) {
+            xf_input(xf, n);
+        } else if (errno == ETIMEDOUT) {
+            xf_timeout(xf);
+        } else {
+            syslog(LOG_WARNING, "tftpd: read: %m");
+            break;
+        }
     }
+}
+
+static char *rewrite_access(struct transfer *, char *, int, const char **);
+static int validate_access(struct transfer *, char *, int,
+                           const struct formats *, const char **);
+static void tftp_sendfile(struct transfer *);
+static void tftp_recvfile(struct transfer *);
+
+struct formats {
+    const char *f_mode;
+    char *(*f_rewrite) (struct transfer *, char *, int, const char **);
+    int (*f_validate) (struct transfer *, char *, int,
+                       const struct formats *, const char **);
+    void (*f_send) (struct transfer *);
+    void (*f_recv) (struct transfer *);
+    int f_convert;
+};
+static const struct formats formats[] = {
+    {
+    "netascii", rewrite_access, validate_access, tftp_sendfile,
+            tftp_recvfile, 1}, {
+    "octet", rewrite_access, validate_access, tftp_sendfile,
+            tftp_recvfile, 0}, {
+    NULL, NULL, NULL, NULL, NULL, 0}
+};
+
+/*
+ * Handle initial connection protocol.  On return, xf->state tells
+ * whether there is a transfer in progress.
+ */
+static void tftp(struct transfer *xf, struct tftphdr *tp, int size)
+{
+    char *cp, *end;
+    int argn, ecode;
+    const struct formats *pf = NULL;
+    char *origfilename;
+    char *filename = NULL, *mode = NULL;
+    const char *errmsgptr;
+    u_short tp_opcode = ntohs(tp->th_opcode);
+    char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
+
+    char ackbuf[PKTSIZE];       /* OACK under construction */
+    char *val = NULL, *opt = NULL;
+    char *ap = ackbuf + 2;
+
+    ((struct tftphdr *)ackbuf)->th_opcode = htons(OACK);
+
+    xf->opcode = tp_opcode;
+    origfilename = cp = (char *)&(tp->th_stuff);
+    argn = 0;
+
+    end = (char *)tp + size;
+
+    while (cp < end && *cp) {
+        do {
+            cp++;
+        } while (cp < end && *cp);
+
+        if (*cp) {
+            nak(xf, EBADOP, "Request not null-terminated");
+            return;
+        }
+
+        argn++;
+        if (argn == 1) {
+            mode = ++cp;
+        } else if (argn == 2) {
+            for (cp = mode; *cp; cp++)
+                *cp = tolower(*cp);
+            for (pf = formats; pf->f_mode; pf++) {
+                if (!strcmp(pf->f_mode, mode))
+                    break;
+            }
+            if (!pf->f_mode) {
+                nak(xf, EBADOP, "Unknown mode");
+                return;
+            }
+            if (!(filename =
+                  (*pf->f_rewrite) (xf, origfilename, tp_opcode,
+                                    &errmsgptr))) {
+                nak(xf, EACCESS, errmsgptr);    /* File denied by mapping rule */
+                return;
+            }
+            if (verbosity >= 1) {
+                tmp_p = (char *)inet_ntop(xf->from.sa.sa_family,
+                                          SOCKADDR_P(&xf->from),
+                                          tmpbuf, INET6_ADDRSTRLEN);
+                if (!tmp_p) {
+                    tmp_p = tmpbuf;
+                    strcpy(tmpbuf, "???");
+                }
+                if (filename == origfilename
+                    || !strcmp(filename, origfilename))
+                    syslog(LOG_NOTICE, "%s from %s filename %s\n",
+                           tp_opcode == WRQ ? "WRQ" : "RRQ",
+                           tmp_p, filename);
+                else
+                    syslog(LOG_NOTICE,
+                           "%s from %s filename %s remapped to %s\n",
+                           tp_opcode == WRQ ? "WRQ" : "RRQ",
+                           tmp_p, origfilename,
+                           filename);
+            }
+            ecode =
+                (*pf->f_validate) (xf, filename, tp_opcode, pf, &errmsgptr);
+            if (ecode) {
+                if (ecode > 0)  /* Negative means drop silently */
+                    nak(xf, ecode, errmsgptr);
+                return;
+            }
+            opt = ++cp;
+        } else if (argn & 1) {
+            val = ++cp;
+        } else {
+            if (do_opt(xf, opt, val, &ap, ackbuf + sizeof(ackbuf)))
+                return;
+            opt = ++cp;
+        }
+    }
+
+    if (!pf) {
+        nak(xf, EBADOP, "Missing mode");
+        return;
+    }
+
+    if (ap != (ackbuf + 2)) {
+        xf->oacklen = ap - ackbuf;
+        xf->oack = arena_alloc(&xf->arena, xf->oacklen);
+        memcpy(xf->oack, ackbuf, xf->oacklen);
+    }
+
+    xf->pf = pf;
+    if (tp_opcode == WRQ)
+        (*pf->f_recv) (xf);
+    else
+        (*pf->f_send) (xf);
+}
+
+/*
+ * Set a non-standard block size (c.f. RFC2348)
+ */
+static int set_blksize(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t sz = *vp;
+
+    if (xf->blksize_set)
+        return 0;
+
+    if (sz < 8)
+        return 0;
+    else if (sz > max_blksize)
+        sz = max_blksize;
+
+    *vp = xf->segsize = sz;
+    xf->blksize_set = 1;
+    return 1;
+}
+
+/*
+ * Set a power-of-two block size (nonstandard)
+ */
+static int set_blksize2(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t sz = *vp;
+
+    if (xf->blksize_set)
+        return 0;
+
+    if (sz < 8)
+        return (0);
+    else if (sz > max_blksize)
+        sz = max_blksize;
+    else
+
+    /* Convert to a power of two */
+    if (sz & (sz - 1)) {
+        unsigned int sz1 = 1;
+        /* Not a power of two - need to convert */
+        while (sz >>= 1)
+            sz1 <<= 1;
+        sz = sz1;
+    }
+
+    *vp = xf->segsize = sz;
+    xf->blksize_set = 1;
+    return 1;
+}
+
+/*
+ * Set the block number rollover value
+ */
+static int set_rollover(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t ro = *vp;
+    
+    if (ro > 65535)
+	return 0;
+
+    xf->rollover_val = (uint16_t)ro;
+    return 1;
+}
+
+/*
+ * Set the number of blocks to send before waiting for an ACK
+ * (c.f. RFC7440).  We only window our own sends; when receiving we
+ * acknowledge every block, and say so.
+ */
+static int set_windowsize(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t ws = *vp;
+
+    if (ws < 1 || ws > 65535)
+        return 0;
+
+    if (xf->opcode != RRQ)
+        ws = 1;
+    else if (ws > max_window)
+        ws = max_window;
+
+    *vp = xf->window = ws;
+    return 1;
+}
+
+/*
+ * Return a file size (c.f. RFC2349)
+ * For netascii mode, we don't know the size ahead of time;
+ * so reject the option.
+ */
+static int set_tsize(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t sz = *vp;
+
+    if (!xf->tsize_ok)
+        return 0;
+
+    if (sz == 0)
+        sz = xf->tsize;
+    else if (xf->opcode == WRQ)
+        xf->tsize = (off_t)sz;  /* What the client is about to send */
+
+    *vp = sz;
+    return 1;
+}
+
+/*
+ * Set the timeout (c.f. RFC2349).  This is supposed
+ * to be the (default) retransmission timeout, but being an
+ * integer in seconds it seems a bit limited.
+ */
+static int set_timeout(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t to = *vp;
+
+    if (to < 1 || to > 255)
+        return 0;
+
+    xf->rexmtval = xf->timeout = to * 1000000UL;
+    xf->maxtimeout = xf->rexmtval * TIMEOUT_LIMIT;
+    xf->flags &= ~XF_ADAPTIVE;  /* The client knows best */
+
+    return 1;
+}
+
+/* Similar, but in microseconds.  We allow down to 10 ms. */
+static int set_utimeout(struct transfer *xf, uintmax_t *vp)
+{
+    uintmax_t to = *vp;
+
+    if (to < 10000UL || to > 255000000UL)
+        return 0;
+
+    xf->rexmtval = xf->timeout = to;
+    xf->maxtimeout = xf->rexmtval * TIMEOUT_LIMIT;
+    xf->flags &= ~XF_ADAPTIVE;
+
+    return 1;
+}
+
+/*
+ * Conservative calculation for the size of a buffer which can hold an
+ * arbitrary integer
+ */
+#define OPTBUFSIZE	(sizeof(uintmax_t) * CHAR_BIT / 3 + 3)
+
+/*
+ * Parse RFC2347 style options; we limit the arguments to positive
+ * integers which matches all our current options.  The OACK is built
+ * at *ap, up to apend.  Returns nonzero if the request has been
+ * refused.
+ */
+static int do_opt(struct transfer *xf, const char *opt, const char *val,
+                  char **ap, const char *apend)
+{
+    struct options *po;
+    char retbuf[OPTBUFSIZE];
+    char *p = *ap;
+    size_t optlen, retlen;
+    char *vend;
+    uintmax_t v;
+
+    /* Global option-parsing variables initialization */
+    xf->blksize_set = 0;
+
+    if (!*opt || !*val)
+        return 0;
+
+    errno = 0;
+    v = strtoumax(val, &vend, 10);
+    if (*vend || errno == ERANGE)
+	return 0;
+
+    for (po = options; po->o_opt; po++)
+        if (!strcasecmp(po->o_opt, opt)) {
+            if (po->o_fnc(xf, &v)) {
+		optlen = strlen(opt);
+		retlen = sprintf(retbuf, "%"PRIuMAX, v);
+
+                if (p + optlen + retlen + 2 >= apend) {
+                    nak(xf, EOPTNEG, "Insufficient space for options");
+                    return -1;
+                }
+		
+		memcpy(p, opt, optlen+1);
+		p += optlen+1;
+		memcpy(p, retbuf, retlen+1);
+		p += retlen+1;
+            } else {
+                nak(xf, EOPTNEG, "Unsupported option(s) requested");
+                return -1;
+            }
+            break;
+        }
+
+    *ap = p;
+    return 0;
+}
+
+#ifdef WITH_REGEX
+
+/*
+ * This is called by the remap engine when it encounters macros such
+ * as \i.  It should write the output in "output" if non-NULL, and
+ * return the length of the output (generated or not).  The cookie
+ * is the client address.
+ *
+ * Return -1 on failure.
+ */
+static int rewrite_macros(char macro, char *output, const void *cookie)
+{
+    const union sock_addr *from = cookie;
+    char *p, tb[INET6_ADDRSTRLEN];
+    int l=0;
+
+    switch (macro) {
+    case 'i':
+        p = (char *)inet_ntop(from->sa.sa_family, SOCKADDR_P(from),
+                              tb, INET6_ADDRSTRLEN);
+        if (output && p)
+            strcpy(output, p);
+        if (!p)
+            return 0;
+        else
+            return strlen(p);
+
+    case 'x':
+        if (from->sa.sa_family == AF_INET) {
+            if (output)
+                sprintf(output, "%08lX",
+                    (unsigned long)ntohl(from->si.sin_addr.s_addr));
+            l = 8;
+#ifdef HAVE_IPV6
+        } else {
+            unsigned char *c = (unsigned char *)SOCKADDR_P(from);
+            p = tb;
+            for (l = 0; l < 16; l++) {
+                sprintf(p, "%02X", *c);
+                c++;
+                p += 2;
+            }
+            if (output)
+                strcpy(output, tb);
+            l = strlen(tb);
+#endif
+        }
+        return l;
+
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Modify the filename, if applicable.  If it returns NULL, deny the access.
+ */
+static char *rewrite_access(struct transfer *xf, char *filename, int mode,
+                            const char **msg)
+{
+#ifdef WITH_WORKERS
+    pthread_rwlock_rdlock(&rules_lock);
+#endif
+    if (rewrite_rules) {
+        char *newname =
+            rewrite_string(filename, rewrite_rules,
+			   mode != RRQ ? 'P' : 'G',
+                           rewrite_macros, &xf->from, msg, &xf->arena);
+        filename = newname;
+    }
+#ifdef WITH_WORKERS
+    pthread_rwlock_unlock(&rules_lock);
+#endif
+    return filename;
+}
+
+#else
+static char *rewrite_access(struct transfer *xf, char *filename, int mode,
+                            const char **msg)
+{
+    (void)xf;                   /* Avoid warning */
+    (void)mode;
+    (void)msg;
+    return filename;
+}
+#endif
+
+/*
+ * Validate file access.  Since we
+ * have no uid or gid, for now require
+ * file to exist and be publicly
+ * readable/writable, unless -p specified.
+ * If we were invoked with arguments
+ * from inetd then the file must also be
+ * in one of the given directory prefixes.
+ * Note also, full path name must be
+ * given as we have no login directory.
+ *
+ * Returns a TFTP error code, or -1 if the request should be
+ * silently dropped.
+ */
+static int validate_access(struct transfer *xf, char *filename, int mode,
+			   const struct formats *pf, const char **errmsg)
+{
+    struct stat stbuf;
+    int fd, wmode, rmode;
+    int err;
+    int reused = 0;             /* fd came from the lookup cache */
+
+    xf->tsize_ok = 0;
+    *errmsg = NULL;
+
+    if (!secure) {
+        if (*filename != '/') {
+            *errmsg = "Only absolute filenames allowed";
+            return (EACCESS);
+        }
+
+        /*
+         * prevent tricksters from getting around the directory
+         * restrictions
+         */
+        switch (dirtrie_check(dirtrie, filename)) {
+        case DT_REVERSE:
+            *errmsg = "Reverse path not allowed";
+            return (EACCESS);
+        case DT_FORBIDDEN:
+            *errmsg = "Forbidden directory";
+            return (EACCESS);
+        }
+    }
+
+    /*
+     * We use different a different permissions scheme if `cancreate' is
+     * set.
+     */
+    wmode = O_WRONLY | (cancreate ? O_CREAT : 0) | (pf->f_convert ? O_TEXT : O_BINARY);
+    rmode = O_RDONLY | (pf->f_convert ? O_TEXT : O_BINARY);
+
+    /*
+     * A name looked up recently needn't be looked up again; one which
+     * is about to be written is forgotten.
+     */
+    if (mode == RRQ) {
+        switch (lookup_open(filename, &fd, &stbuf)) {
+        case 0:
+            reused = 1;
+            goto opened;
+        case ENOTFOUND:
+            return ENOTFOUND;
+        }
+    } else {
+        lookup_forget(filename);
+    }
+
+    /*
+     * A cached file can be served without opening it, as long as the
+     * permission check doesn't need open() to do it for us.
+     */
+    if (mode == RRQ && !unixperms && xf->engine && cache_enabled() &&
+        !stat(filename, &stbuf) && S_ISREG(stbuf.st_mode) &&
+        (stbuf.st_mode & (S_IREAD >> 6)) &&
+        (xf->cache = cache_get(&stbuf, pf->f_convert))) {
+        xf->tsize = cache_len(xf->cache);
+        xf->tsize_ok = 1;
+        return 0;
+    }
+
+#ifndef HAVE_FTRUNCATE
+    wmode |= O_TRUNC;		/* This really sucks on a dupe */
+#endif
+
+    fd = open(filename, mode == RRQ ? rmode : wmode, 0666);
+    if (fd < 0) {
+        switch (errno) {
+        case ENOENT:
+        case ENOTDIR:
+            if (mode == RRQ)
+                lookup_missing(filename);
+            return ENOTFOUND;
+        case ENOSPC:
+            return ENOSPACE;
+        case EEXIST:
+            return EEXISTS;
+        default:
+            return errno + 100;
+        }
+    }
+
+    if (fstat(fd, &stbuf) < 0) {
+        err = errno + 100;      /* This shouldn't happen */
+        goto fail;
+    }
+    if (mode == RRQ)
+        lookup_add(filename, fd, &stbuf);
+
+  opened:
+    /* A duplicate RRQ or (worse!) WRQ packet could really cause havoc... */
+    if (lock_file(fd, mode != RRQ)) {
+        err = -1;
+        goto fail;
+    }
+
+    if (mode == RRQ) {
+        if (!unixperms && (stbuf.st_mode & (S_IREAD >> 6)) == 0) {
+            *errmsg = "File must have global read permissions";
+            err = EACCESS;
+            goto fail;
+        }
+        xf->tsize = stbuf.st_size;
+        /* We don't know the tsize if conversion is needed, unless
+           the converted file is cached */
+        xf->tsize_ok = !pf->f_convert || !stbuf.st_size;
+
+        if (xf->engine &&
+            ((reused && (xf->cache = cache_get(&stbuf, pf->f_convert))) ||
+             (xf->cache = cache_fill(fd, &stbuf, pf->f_convert)))) {
+            xf->tsize = cache_len(xf->cache);
+            xf->tsize_ok = 1;
+            close(fd);
+            return 0;
+        }
+    } else {
+        if (!unixperms) {
+            if ((stbuf.st_mode & (S_IWRITE >> 6)) == 0) {
+                *errmsg = "File must have global write permissions";
+                err = EACCESS;
+                goto fail;
+            }
+        }
+
+#ifdef HAVE_FTRUNCATE
+	/* We didn't get to truncate the file at open() time */
+	if (ftruncate(fd, (off_t) 0)) {
+	  *errmsg = "Cannot reset file size";
+	  err = EACCESS;
+	  goto fail;
+	}
+#endif
+        xf->tsize = 0;
+        xf->tsize_ok = 1;
+    }
+
+    xf->fd = fd;
+    return (0);
+
+  fail:
+    close(fd);
+    return err;
+}
+
+/*
+ * Send a packet to the client, through the engine if there is one.
+ */
+static int xf_send(struct transfer *xf, const void *p, int len)
+{
+#ifdef WITH_URING
+    if (xf->engine)
+        return engine_send(xf, p, len);
+#endif
+    return send(xf->peer, p, len, 0);
+}
+
+/*
+ * Start the retransmission timer for the packet just sent.
+ */
+static void xf_arm(struct transfer *xf)
+{
+    xf->armed = monotime();
+    xf->deadline = xf->armed + xf->timeout;
+}
+
+/*
+ * The packet the timer was started for has been answered.  Take a
+ * round-trip time sample and update the smoothed RTT and its mean
+ * deviation as TCP does (Jacobson/Karels, c.f. RFC6298), unless that
+ * packet was retransmitted, as we can't tell which copy was answered
+ * (Karn).  In adaptive mode the next packet's timeout follows from the
+ * estimate.
+ */
+static void xf_rtt(struct transfer *xf)
+{
+    long r, delta;
+    unsigned long rto;
+
+    if (xf->flags & XF_RETRANS) {
+        xf->flags &= ~XF_RETRANS;
+        return;
+    }
+
+    r = (long)(monotime() - xf->armed);
+    if (r < 1)
+        r = 1;
+    if (!xf->rtt_samples++) {
+        xf->srtt = r << 3;
+        xf->rttvar = r << 1;
+        xf->rtt_min = xf->rtt_max = r;
+    } else {
+        delta = r - (xf->srtt >> 3);
+        xf->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        xf->rttvar += delta - (xf->rttvar >> 2);
+        if ((unsigned long)r < xf->rtt_min)
+            xf->rtt_min = r;
+        if ((unsigned long)r > xf->rtt_max)
+            xf->rtt_max = r;
+    }
+
+    if (xf->flags & XF_ADAPTIVE) {
+        /* Leave room for at least one retry before giving up */
+        rto = (xf->srtt >> 3) + xf->rttvar;
+        if (rto < min_timeout)
+            rto = min_timeout;
+        if (rto > xf->maxtimeout >> 1)
+            rto = xf->maxtimeout >> 1;
+        xf->rexmtval = rto;
+    }
+}
+
+/*
+ * Log the round-trip statistics of a finished transfer.
+ */
+static void log_rtt(struct transfer *xf)
+{
+    char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
+
+    if (!xf->rtt_samples && !xf->retransmits)
+        return;
+
+    tmp_p = (char *)inet_ntop(xf->from.sa.sa_family,
+                              SOCKADDR_P(&xf->from),
+                              tmpbuf, INET6_ADDRSTRLEN);
+    if (!tmp_p) {
+        tmp_p = tmpbuf;
+        strcpy(tmpbuf, "???");
+    }
+    syslog(LOG_INFO,
+           "%s to %s: rtt %ld us (dev %ld, min %lu, max %lu) over %u samples, "
+           "%u retransmits, timeout %lu us%s",
+           xf->opcode == WRQ ? "WRQ" : "RRQ", tmp_p,
+           xf->srtt >> 3, xf->rttvar >> 2, xf->rtt_min, xf->rtt_max,
+           xf->rtt_samples, xf->retransmits, xf->rexmtval,
+           (xf->flags & XF_ADAPTIVE) ? " (adaptive)" : "");
+}
+
+/*
+ * Close the file being received, giving back any space reserved for
+ * it beyond what the client actually sent.
+ */
+static void close_upload(struct transfer *xf)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE) && \
+    defined(HAVE_FTRUNCATE)
+    /* Truncating to the size it already has frees what lies beyond */
+    if (!xf->pf->f_convert && xf->tsize > xf->rw.pos)
+        (void)ftruncate(xf->fd, xf->rw.pos);
+#endif
+    close(xf->fd);
+    xf->fd = -1;
+}
+
+static void xf_done(struct transfer *xf)
+{
+    if (verbosity >= 2 && xf->state != XS_DONE)
+        log_rtt(xf);
+
+    /* If the engine still has a read or write queued on the file, we
+       get here again once that has completed */
+    if (xf->fd >= 0 &&
+        !(xf->flags & (XF_READING | XF_WRITING | XF_SYNCING))) {
+        if (xf->opcode == WRQ && xf->pf) {
+            close_upload(xf);
+        } else {
+            close(xf->fd);
+            xf->fd = -1;
+        }
+    }
+    xf->state = XS_DONE;
+}
+
+static void send_oack(struct transfer *xf)
+{
+    if (xf_send(xf, xf->oack, xf->oacklen) != xf->oacklen) {
+        syslog(LOG_WARNING, "tftpd: oack: %m\n");
+        xf_done(xf);
+        return;
+    }
+    xf_arm(xf);
+}
+
+#ifdef WITH_MMAP
+/*
+ * Map an octet file, so that blocks can be sent straight from the page
+ * cache instead of being copied through the rw_state buffers.  If this
+ * fails we just use the buffers.
+ */
+static void xf_map(struct transfer *xf)
+{
+    void *p;
+
+    if (xf->tsize <= 0 || (uintmax_t)xf->tsize > (size_t)-1)
+        return;
+
+    p = mmap(NULL, xf->tsize, PROT_READ, MAP_SHARED, xf->fd, 0);
+    if (p == MAP_FAILED)
+        return;
+#ifdef MADV_SEQUENTIAL
+    (void)madvise(p, xf->tsize, MADV_SEQUENTIAL);
+#endif
+    xf->map = p;
+    xf->maplen = xf->tsize;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    /* Only the transfer process reads the completion notices, and
+       pinning pages only pays off for large blocks */
+    if (!xf->engine && xf->segsize >= ZEROCOPY_MIN) {
+        int on = 1;
+
+        if (!setsockopt(xf->peer, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on))
+            xf->flags |= XF_ZEROCOPY;
+    }
+#endif
+}
+#endif
+
+/*
+ * True if sends are queued on the engine's ring, so that a packet
+ * buffer must not be reused until the ring has sent it.
+ */
+static int xf_queued(struct transfer *xf)
+{
+#ifdef WITH_URING
+    return xf->engine && engine_async(xf->engine);
+#else
+    (void)xf;
+    return 0;
+#endif
+}
+
+/*
+ * Send the current block from the mapping or the file cache.
+ * Userspace never touches an mmap'd file, so if the file shrinks under
+ * us this fails with EFAULT rather than raising SIGBUS.
+ */
+static int xf_send_mapped(struct transfer *xf)
+{
+    const char *p = xf->map + (xf->offset - xf->size);
+    int copy = 1;
+#ifdef WITH_MMAP
+    struct msghdr msg;
+    struct iovec iov[2];
+    int flags = 0, n;
 #endif
+
+#ifdef WITH_MMAP
+    copy = 0;
 #endif
+    /* The ring sends from a single buffer, so the block has to be
+       copied; that is only safe from the file cache, which is why
+       files are never mapped when sends are queued on the ring */
+    if (xf_queued(xf))
+        copy = 1;
+
+    if (copy) {
+        memcpy(xf->dp->th_data, p, xf->size);
+        return xf_send(xf, xf->dp, xf->size + 4);
+    }
 
-    /* Chroot and drop privileges */
-    if (secure) {
-        if (chroot(".")) {
-            syslog(LOG_ERR, "chroot: %m");
-            exit(EX_OSERR);
-        }
-#ifdef __CYGWIN__
-        chdir("/");             /* Cygwin chroot() bug workaround */
+#ifdef WITH_MMAP
+    iov[0].iov_base = (void *)xf->dp;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)p;
+    iov[1].iov_len = xf->size;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+#ifdef MSG_ZEROCOPY
+    if (xf->flags & XF_ZEROCOPY)
+        flags = MSG_ZEROCOPY;
 #endif
+    n = sendmsg(xf->peer, &msg, flags);
+    if (n < 0 && errno == ENOBUFS && flags) {
+        /* Out of room to track pinned pages; just copy */
+        xf->flags &= ~XF_ZEROCOPY;
+        n = sendmsg(xf->peer, &msg, 0);
     }
-#ifdef HAVE_SETREGID
-    setrv = setregid(pw->pw_gid, pw->pw_gid);
+    return n;
 #else
-    setrv = setegid(pw->pw_gid) || setgid(pw->pw_gid);
+    return -1;                  /* Not reached */
 #endif
+}
 
-#ifdef HAVE_SETREUID
-    setrv = setrv || setreuid(pw->pw_uid, pw->pw_uid);
-#else
-    /* Important: setuid() must come first */
-    setrv = setrv || setuid(pw->pw_uid) ||
-        (geteuid() != pw->pw_uid && seteuid(pw->pw_uid));
-#endif
+static void resend_block(struct transfer *xf)
+{
+    int n;
 
-    if (setrv) {
-        syslog(LOG_ERR, "cannot drop privileges: %m");
-        exit(EX_OSERR);
+    /* A block still being read goes out as soon as the read is done */
+    if (!(xf->flags & XF_READING)) {
+        if (xf->map)
+            n = xf_send_mapped(xf);
+        else
+            n = xf_send(xf, xf->dp, xf->size + 4);
+        if (n != xf->size + 4) {
+            syslog(LOG_WARNING, "tftpd: write: %m");
+            xf_done(xf);
+            return;
+        }
+        if (!(xf->flags & (XF_ASYNC | XF_PREAD)) && !xf->map)
+            rw_read_ahead(&xf->rw, xf->fd, xf->pf->f_convert);
     }
+    xf_arm(xf);
+}
 
-    /* Process the request... */
-    if (pick_port_bind(peer, &myaddr, portrange_from, portrange_to) < 0) {
-        syslog(LOG_ERR, "bind: %m");
-        exit(EX_IOERR);
+#ifdef WITH_URING
+/*
+ * Send the next block of the file, letting the engine read it.  We
+ * only send as much as the file held when we opened it.
+ */
+static void send_block_async(struct transfer *xf)
+{
+    off_t left = xf->tsize - xf->offset;
+
+    xf->size = (left < xf->segsize) ? (int)left : xf->segsize;
+    xf->dp->th_opcode = htons((u_short) DATA);
+    xf->dp->th_block = htons((u_short) xf->block);
+    xf->timeout = xf->rexmtval;
+
+    if (!xf->size) {
+        resend_block(xf);
+    } else if (engine_send_block(xf)) {
+        syslog(LOG_WARNING, "tftpd: write: %m");
+        xf_done(xf);
+    } else {
+        xf->offset += xf->size;
+        xf_arm(xf);
     }
+}
 
-    if (connect(peer, &from.sa, SOCKLEN(&from)) < 0) {
-        syslog(LOG_ERR, "connect: %m");
-        exit(EX_IOERR);
+/*
+ * The engine has finished reading a block into xf->dp; n is the number
+ * of bytes read, or -errno.  If all went well, the block has already
+ * been sent.
+ */
+void xf_readdone(struct transfer *xf, int n)
+{
+    xf->flags &= ~XF_READING;
+    if (xf->state == XS_DONE) {
+        xf_done(xf);            /* Close the file now */
+        return;
     }
 
-    /* Disable path MTU discovery */
-    pmtu_discovery_off(peer);
-
-    tp = (struct tftphdr *)buf;
-    tp_opcode = ntohs(tp->th_opcode);
-    if (tp_opcode == RRQ || tp_opcode == WRQ)
-        tftp(tp, n);
-    exit(0);
+    if (n < 0) {
+        nak(xf, -n + 100, NULL);
+        xf_done(xf);
+    } else if (n != xf->size) {
+        /* The file shrank under us, which cancelled the send; send
+           what we got, which will be the last block */
+        xf->size = n;
+        resend_block(xf);
+    }
 }
+#endif
 
-static char *rewrite_access(char *, int, const char **);
-static int validate_access(char *, int, const struct formats *, const char **);
-static void tftp_sendfile(const struct formats *, struct tftphdr *, int);
-static void tftp_recvfile(const struct formats *, struct tftphdr *, int);
+/*
+ * Send the next block of the file.
+ */
+static void send_block(struct transfer *xf)
+{
+#ifdef WITH_URING
+    if (xf->flags & XF_ASYNC) {
+        send_block_async(xf);
+        return;
+    }
+#endif
+    if (xf->map) {
+        off_t left = xf->tsize - xf->offset;
 
-struct formats {
-    const char *f_mode;
-    char *(*f_rewrite) (char *, int, const char **);
-    int (*f_validate) (char *, int, const struct formats *, const char **);
-    void (*f_send) (const struct formats *, struct tftphdr *, int);
-    void (*f_recv) (const struct formats *, struct tftphdr *, int);
-    int f_convert;
-};
-static const struct formats formats[] = {
-    {
-    "netascii", rewrite_access, validate_access, tftp_sendfile,
-            tftp_recvfile, 1}, {
-    "octet", rewrite_access, validate_access, tftp_sendfile,
-            tftp_recvfile, 0}, {
-    NULL, NULL, NULL, NULL, NULL, 0}
-};
+        xf->size = (left < xf->segsize) ? (int)left : xf->segsize;
+        xf->offset += xf->size;
+    } else {
+        if (xf->flags & XF_PREAD)
+            xf->size = rw_pread(&xf->rw, xf->fd,
+                                xf->offset / xf->segsize + 1, 0, &xf->dp);
+        else
+            xf->size = rw_readit(&xf->rw, xf->fd, &xf->dp,
+                                 xf->pf->f_convert);
+        if (xf->size < 0) {
+            nak(xf, errno + 100, NULL);
+            xf_done(xf);
+            return;
+        }
+        xf->offset += xf->size;
+    }
+    xf->dp->th_opcode = htons((u_short) DATA);
+    xf->dp->th_block = htons((u_short) xf->block);
+    xf->timeout = xf->rexmtval;
+    resend_block(xf);
+}
 
 /*
- * Handle initial connection protocol.
+ * The block number on the wire of block k of the file.
  */
-int tftp(struct tftphdr *tp, int size)
+static u_short wire_block(struct transfer *xf, unsigned long long k)
 {
-    char *cp, *end;
-    int argn, ecode;
-    const struct formats *pf = NULL;
-    char *origfilename;
-    char *filename, *mode = NULL;
-    const char *errmsgptr;
-    u_short tp_opcode = ntohs(tp->th_opcode);
+    if (k <= 65535)
+        return (u_short) k;
+    return xf->rollover_val + (k - 65536) % (65536 - xf->rollover_val);
+}
 
-    char *val = NULL, *opt = NULL;
-    char *ap = ackbuf + 2;
+/*
+ * True if the blocks of a window are kept in the read-ahead ring,
+ * rather than sent straight from the mapping or read from their
+ * offset in the file.
+ */
+static int window_ring(struct transfer *xf)
+{
+    return (!xf->map && !(xf->flags & XF_PREAD)) || xf_queued(xf);
+}
 
-    ((struct tftphdr *)ackbuf)->th_opcode = htons(OACK);
+/*
+ * Get block k of the file ready to send as part of a window (c.f.
+ * RFC7440), as the slot'th block of a batch, filling in iov[]; returns
+ * the number of iovecs used, or -1 on error.  A block in the ring
+ * stays there until it has been acknowledged, in case we have to roll
+ * back to it; one read from its offset is simply read again.
+ */
+static int window_block(struct transfer *xf, unsigned long long k,
+                        int slot, struct iovec *iov)
+{
+    struct tftphdr *bp;
+    int n;
 
-    origfilename = cp = (char *)&(tp->th_stuff);
-    argn = 0;
+    if (!xf->map || window_ring(xf)) {
+        if (xf->flags & XF_PREAD)
+            n = rw_pread(&xf->rw, xf->fd, k, slot, &bp);
+        else
+            n = rw_peek(&xf->rw, xf->fd, k - xf->acked, &bp,
+                        xf->pf->f_convert);
+        if (n < 0) {
+            nak(xf, errno + 100, NULL);
+            xf_done(xf);
+            return -1;
+        }
+        xf->size = n;
+        n = 1;
+    } else {
+        off_t left = xf->tsize - (off_t) (k - 1) * xf->segsize;
 
-    end = (char *)tp + size;
+        xf->size = (left < xf->segsize) ? (int)left : xf->segsize;
+        bp = (struct tftphdr *)(xf->hdrs + 4 * (k % xf->window));
+        iov[1].iov_base = xf->map + (k - 1) * xf->segsize;
+        iov[1].iov_len = xf->size;
+        n = 2;
+    }
 
-    while (cp < end && *cp) {
-        do {
-            cp++;
-        } while (cp < end && *cp);
+    bp->th_opcode = htons((u_short) DATA);
+    bp->th_block = htons(wire_block(xf, k));
+    iov[0].iov_base = (void *)bp;
+    iov[0].iov_len = n == 1 ? xf->size + 4 : 4;
 
-        if (*cp) {
-            nak(EBADOP, "Request not null-terminated");
-            exit(0);
-        }
+    if (xf->size < xf->segsize)
+        xf->last = k;
+    return n;
+}
 
-        argn++;
-        if (argn == 1) {
-            mode = ++cp;
-        } else if (argn == 2) {
-            for (cp = mode; *cp; cp++)
-                *cp = tolower(*cp);
-            for (pf = formats; pf->f_mode; pf++) {
-                if (!strcmp(pf->f_mode, mode))
-                    break;
-            }
-            if (!pf->f_mode) {
-                nak(EBADOP, "Unknown mode");
-                exit(0);
-            }
-            if (!(filename =
-                  (*pf->f_rewrite) (origfilename, tp_opcode,
-                                    &errmsgptr))) {
-                nak(EACCESS, errmsgptr);        /* File denied by mapping rule */
-                exit(0);
-            }
-            if (verbosity >= 1) {
-                tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
-                                          tmpbuf, INET6_ADDRSTRLEN);
-                if (!tmp_p) {
-                    tmp_p = tmpbuf;
-                    strcpy(tmpbuf, "???");
-                }
-                if (filename == origfilename
-                    || !strcmp(filename, origfilename))
-                    syslog(LOG_NOTICE, "%s from %s filename %s\n",
-                           tp_opcode == WRQ ? "WRQ" : "RRQ",
-                           tmp_p, filename);
-                else
-                    syslog(LOG_NOTICE,
-                           "%s from %s filename %s remapped to %s\n",
-                           tp_opcode == WRQ ? "WRQ" : "RRQ",
-                           tmp_p, origfilename,
-                           filename);
-            }
-            ecode =
-                (*pf->f_validate) (filename, tp_opcode, pf, &errmsgptr);
-            if (ecode) {
-                nak(ecode, errmsgptr);
-                exit(0);
-            }
-            opt = ++cp;
-        } else if (argn & 1) {
-            val = ++cp;
-        } else {
-            do_opt(opt, val, &ap);
-            opt = ++cp;
-        }
+/*
+ * Send nb blocks of a window, which start at iov[first[0]],
+ * iov[first[1]], ... iov[first[nb] - 1].  If gso is set, all but the
+ * last are full blocks and can go out as a single UDP GSO buffer.
+ * Returns the number of blocks sent, or -1 on error.
+ */
+static int send_batch(struct transfer *xf, struct iovec *iov,
+                      const int *first, int nb, int gso)
+{
+#ifdef HAVE_SENDMSG
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[WINDOW_BATCH];
+#endif
+#ifdef UDP_SEGMENT
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+    } control_un;
+    struct cmsghdr *cmptr;
+#endif
+    struct msghdr msg;
+    int i, n, flags = 0;
+#endif
+
+    if (first[nb] == 1) {
+        /* A single block in a single buffer */
+        n = iov[0].iov_len;
+        return xf_send(xf, iov[0].iov_base, n) == n ? 1 : -1;
     }
 
-    if (!pf) {
-        nak(EBADOP, "Missing mode");
-        exit(0);
+#ifdef HAVE_SENDMSG
+#ifdef MSG_ZEROCOPY
+    if (xf->flags & XF_ZEROCOPY)
+        flags = MSG_ZEROCOPY;
+#endif
+
+#ifdef UDP_SEGMENT
+    if (gso) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = first[nb];
+        msg.msg_control = control_un.control;
+        msg.msg_controllen = sizeof control_un.control;
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_level = SOL_UDP;
+        cmptr->cmsg_type = UDP_SEGMENT;
+        cmptr->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmptr) = xf->segsize + 4;
+
+        if (sendmsg(xf->peer, &msg, flags) >= 0)
+            return nb;
+        if (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT &&
+            errno != EOPNOTSUPP)
+            return -1;
+        /* Not for this route or socket; send the blocks one by one */
+        xf->flags |= XF_NOGSO;
     }
+#else
+    (void)gso;
+#endif
 
-    if (ap != (ackbuf + 2)) {
-        if (tp_opcode == WRQ)
-            (*pf->f_recv) (pf, (struct tftphdr *)ackbuf, ap - ackbuf);
-        else
-            (*pf->f_send) (pf, (struct tftphdr *)ackbuf, ap - ackbuf);
-    } else {
-        if (tp_opcode == WRQ)
-            (*pf->f_recv) (pf, NULL, 0);
-        else
-            (*pf->f_send) (pf, NULL, 0);
+#ifdef HAVE_SENDMMSG
+    memset(msgs, 0, nb * sizeof msgs[0]);
+    for (i = 0; i < nb; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[first[i]];
+        msgs[i].msg_hdr.msg_iovlen = first[i + 1] - first[i];
     }
-    exit(0);                    /* Request completed */
+    n = sendmmsg(xf->peer, msgs, nb, flags);
+    if (n < 0 && errno == ENOBUFS && flags) {
+        /* Out of room to track pinned pages; just copy */
+        xf->flags &= ~XF_ZEROCOPY;
+        n = sendmmsg(xf->peer, msgs, nb, 0);
+    }
+    return n;
+#else
+    for (i = 0; i < nb; i++) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov[first[i]];
+        msg.msg_iovlen = first[i + 1] - first[i];
+        n = sendmsg(xf->peer, &msg, flags);
+        if (n < 0 && errno == ENOBUFS && flags) {
+            xf->flags &= ~XF_ZEROCOPY;
+            n = sendmsg(xf->peer, &msg, flags = 0);
+        }
+        if (n < 0)
+            return i ? i : -1;
+    }
+    return nb;
+#endif
+#else
+    (void)gso;
+    return -1;                  /* Not reached */
+#endif
 }
 
-static int blksize_set;
-
 /*
- * Set a non-standard block size (c.f. RFC2348)
+ * Send whatever of the window has not been sent yet, handing the
+ * kernel as many blocks at a time as we can.  If the kernel runs out
+ * of room, the rest of the window goes out after the next ACK or
+ * timeout.
  */
-static int set_blksize(uintmax_t *vp)
+static void send_window(struct transfer *xf)
 {
-    uintmax_t sz = *vp;
-
-    if (blksize_set)
-        return 0;
-
-    if (sz < 8)
-        return 0;
-    else if (sz > max_blksize)
-        sz = max_blksize;
+    struct iovec iov[2 * WINDOW_BATCH];
+    int first[WINDOW_BATCH + 1];
+    unsigned long long k;
+    int nb, max, gso, n;
+
+    while (xf->sent < xf->acked + xf->window &&
+           (!xf->last || xf->sent < xf->last)) {
+        max = 1;
+        gso = 0;
+#ifdef HAVE_SENDMSG
+        if (!xf_queued(xf)) {
+            max = WINDOW_BATCH;
+#ifdef UDP_SEGMENT
+            if (!(xf->flags & XF_NOGSO) &&
+                GSO_MAX / (xf->segsize + 4) >= 2) {
+                gso = 1;
+                if (max > GSO_MAX / (xf->segsize + 4))
+                    max = GSO_MAX / (xf->segsize + 4);
+            }
+#endif
+        }
+#endif
 
-    *vp = segsize = sz;
-    blksize_set = 1;
-    return 1;
+        nb = 0;
+        first[0] = 0;
+        do {
+            k = xf->sent + nb + 1;
+            n = window_block(xf, k, nb, &iov[first[nb]]);
+            if (n < 0)
+                return;
+            first[nb + 1] = first[nb] + n;
+            nb++;
+        } while (nb < max && k < xf->acked + xf->window && k != xf->last);
+
+        n = send_batch(xf, iov, first, nb, gso && nb > 1);
+        if (n < 0 && (E_WOULD_BLOCK(errno) || errno == ENOBUFS))
+            n = 0;
+        if (n < 0) {
+            syslog(LOG_WARNING, "tftpd: write: %m");
+            xf_done(xf);
+            return;
+        }
+        xf->sent += n;
+        if (n < nb)
+            break;
+    }
+    if (window_ring(xf) && !xf->map)
+        rw_read_ahead(&xf->rw, xf->fd, xf->pf->f_convert);
+    xf_arm(xf);
 }
 
 /*
- * Set a power-of-two block size (nonstandard)
+ * An ACK arrived while sending a window.  It acknowledges everything up
+ * to the block it names; anything sent after that block was lost, so
+ * carry on from there.  The client repeats its last ACK when the first
+ * block of a window goes missing; we go back for that once, and wait
+ * for the timeout after that, so that a burst of duplicate ACKs cannot
+ * turn into a burst of windows.  ACKs for blocks we have not sent, or
+ * which were acknowledged earlier, are ignored.
  */
-static int set_blksize2(uintmax_t *vp)
+static void ack_window(struct transfer *xf, u_short block)
 {
-    uintmax_t sz = *vp;
-
-    if (blksize_set)
-        return 0;
+    unsigned long long k;
 
-    if (sz < 8)
-        return (0);
-    else if (sz > max_blksize)
-        sz = max_blksize;
-    else
+    for (k = xf->sent; k > xf->acked; k--)
+        if (wire_block(xf, k) == block)
+            break;
 
-    /* Convert to a power of two */
-    if (sz & (sz - 1)) {
-        unsigned int sz1 = 1;
-        /* Not a power of two - need to convert */
-        while (sz >>= 1)
-            sz1 <<= 1;
-        sz = sz1;
+    if (k == xf->acked) {
+        if (wire_block(xf, k) != block || (xf->flags & XF_ROLLBACK))
+            return;
+        xf->flags |= XF_ROLLBACK | XF_RETRANS;
+        xf->retransmits++;
+    } else {
+        xf->flags &= ~XF_ROLLBACK;
+        /* Only an ACK for the whole window times the round trip */
+        if (k == xf->sent)
+            xf_rtt(xf);
+        else
+            xf->flags |= XF_RETRANS;
+    }
+    if (k == xf->last) {
+        xf_done(xf);
+        return;
     }
 
-    *vp = segsize = sz;
-    blksize_set = 1;
-    return 1;
+    if (window_ring(xf))
+        rw_release(&xf->rw, k - xf->acked);
+    xf->acked = xf->sent = k;
+    xf->timeout = xf->rexmtval;
+    send_window(xf);
 }
 
 /*
- * Set the block number rollover value
+ * Send the requested file.
  */
-static int set_rollover(uintmax_t *vp)
+static void tftp_sendfile(struct transfer *xf)
 {
-    uintmax_t ro = *vp;
-    
-    if (ro > 65535)
-	return 0;
+    int depth = 2;
+
+    xf->block = 1;
+    xf->rxbuf = xf->rxack;
+    xf->rxlen = sizeof(xf->rxack);
+    xf->timeout = xf->rexmtval;
+    if (xf->cache) {
+        xf->map = (char *)cache_data(xf->cache);
+    } else {
+#ifdef WITH_URING
+        if (xf->engine && engine_async(xf->engine) && !xf->pf->f_convert
+            && xf->window == 1)
+            xf->flags |= XF_ASYNC;
+#endif
+#ifdef WITH_MMAP
+        /* Blocks queued on the ring have to be copied, and copying
+           from a mapping raises SIGBUS if the file shrinks */
+        if (!xf_queued(xf) && !xf->pf->f_convert)
+            xf_map(xf);
+#endif
+        /* Otherwise a binary file is read a block at a time from
+           where the block is, unless the ring has to keep the blocks
+           until the engine has sent them */
+        if (!xf->map && !(xf->flags & XF_ASYNC) && !xf->pf->f_convert &&
+            (xf->window == 1 || !xf_queued(xf)))
+            xf->flags |= XF_PREAD;
+    }
 
-    rollover_val = (uint16_t)ro;
-    return 1;
+    /* Blocks sent from a mapping or read by the engine only need a
+       buffer for the header, unless the window has to be kept; those
+       read from their offset need one for each block of a batch */
+    if (xf->flags & XF_PREAD)
+        depth = xf->window < WINDOW_BATCH ? xf->window : WINDOW_BATCH;
+    else if (!xf->map && !(xf->flags & XF_ASYNC))
+        depth = xf->window + READ_AHEAD;
+    else if (xf->window > 1 && window_ring(xf))
+        depth = xf->window + 1;
+    xf->dp = rw_r_init(&xf->rw, xf->segsize, depth);
+    if (xf->window > 1 && xf->map && !window_ring(xf))
+        xf->hdrs = tfmalloc(4 * xf->window);
+    if (xf->map && xf->window > 1)
+        rw_r_mem(&xf->rw, xf->map, xf->tsize);
+
+    if (xf->oack) {
+        xf->state = XS_OACK;
+        send_oack(xf);
+    } else {
+        xf->state = XS_SEND;
+        send_block(xf);
+    }
+}
+
+/* The TFTP error to send for a failed write */
+static int write_error(int err)
+{
+#ifdef EDQUOT
+    if (err == EDQUOT)
+        return ENOSPACE;
+#endif
+    return (err == ENOSPC) ? ENOSPACE : err + 100;
+}
+
+/* True if an upload should be synced to disk once it is written up to
+   pos; last is set if that is the end of the file */
+static int want_sync(struct transfer *xf, off_t pos, int last)
+{
+    return (last && sync_end) ||
+        (sync_every && (uintmax_t)(pos - xf->synced) >= sync_every);
 }
 
 /*
- * Return a file size (c.f. RFC2349)
- * For netascii mode, we don't know the size ahead of time;
- * so reject the option.
+ * Write out the blocks received so far, syncing them to disk as the
+ * --sync policy asks.  On failure, tell the client and give up.
  */
-static int set_tsize(uintmax_t *vp)
+static int xf_flush(struct transfer *xf, int last)
 {
-    uintmax_t sz = *vp;
-
-    if (!tsize_ok)
-        return 0;
+    if (rw_flush(&xf->rw, xf->fd, xf->pf->f_convert) < 0)
+        goto fail;
+    if (want_sync(xf, xf->rw.pos, last)) {
+#ifdef HAVE_FDATASYNC
+        if (fdatasync(xf->fd))
+#else
+        if (fsync(xf->fd))
+#endif
+            goto fail;
+        xf->synced = xf->rw.pos;
+    }
+    return 0;
 
-    if (sz == 0)
-        sz = tsize;
+  fail:
+    nak(xf, write_error(errno), NULL);
+    xf_done(xf);
+    return -1;
+}
 
-    *vp = sz;
-    return 1;
+static void resend_ack(struct transfer *xf)
+{
+    if (xf_send(xf, xf->ackp, xf->acksize) != xf->acksize) {
+        syslog(LOG_WARNING, "tftpd: write(ack): %m");
+        xf_done(xf);
+        return;
+    }
+    /* Write out the blocks received once the ring is full, while the
+       client sends the next one; the engine does that by itself */
+    if (!(xf->flags & XF_ASYNC) &&
+        rw_pending(&xf->rw) >= xf->rw.depth - 1 && xf_flush(xf, 0))
+        return;
+    xf_arm(xf);
 }
 
 /*
- * Set the timeout (c.f. RFC2349).  This is supposed
- * to be the (default) retransmission timeout, but being an
- * integer in seconds it seems a bit limited.
+ * Acknowledge the last block received, and ask for the next one.
  */
-static int set_timeout(uintmax_t *vp)
+static void send_ack(struct transfer *xf)
 {
-    uintmax_t to = *vp;
-
-    if (to < 1 || to > 255)
-        return 0;
+    struct tftphdr *ap = (struct tftphdr *)xf->ctlbuf;
 
-    rexmtval = timeout = to * 1000000UL;
-    maxtimeout = rexmtval * TIMEOUT_LIMIT;
+    xf->timeout = xf->rexmtval;
 
-    return 1;
+    if (!xf->block && xf->oack) {
+        xf->ackp = xf->oack;
+        xf->acksize = xf->oacklen;
+    } else {
+        ap->th_opcode = htons((u_short) ACK);
+        ap->th_block = htons((u_short) xf->block);
+        xf->ackp = xf->ctlbuf;
+        xf->acksize = 4;
+        /* If we're sending a regular ACK, that means we have successfully
+         * sent the OACK. Forget it so that we won't try to send another
+         * OACK when the block number wraps back to 0. */
+        xf->oack = NULL;
+    }
+    if (!++xf->block)
+        xf->block = xf->rollover_val;
+    resend_ack(xf);
 }
 
-/* Similar, but in microseconds.  We allow down to 10 ms. */
-static int set_utimeout(uintmax_t *vp)
+/*
+ * The file is all written and closed: send the "final" ack.
+ */
+static void send_final_ack(struct transfer *xf)
 {
-    uintmax_t to = *vp;
-
-    if (to < 10000UL || to > 255000000UL)
-        return 0;
+    struct tftphdr *ap = (struct tftphdr *)xf->ctlbuf;
 
-    rexmtval = timeout = to;
-    maxtimeout = rexmtval * TIMEOUT_LIMIT;
+    ap->th_opcode = htons((u_short) ACK);
+    ap->th_block = htons((u_short) (xf->block));
+    (void)xf_send(xf, ap, 4);
 
-    return 1;
+    /* Wait around in case the final ACK got lost */
+    xf->state = XS_DALLY;
+    xf_arm(xf);
 }
 
+#ifdef WITH_URING
 /*
- * Conservative calculation for the size of a buffer which can hold an
- * arbitrary integer
- */
-#define OPTBUFSIZE	(sizeof(uintmax_t) * CHAR_BIT / 3 + 3)
-
-/*
- * Parse RFC2347 style options; we limit the arguments to positive
- * integers which matches all our current options.
+ * Have the engine write out the blocks received so far, unless it is
+ * already writing; last is set once the final block is in.  Each write
+ * takes every block waiting, so the last one syncs the whole file.
  */
-static void do_opt(const char *opt, const char *val, char **ap)
+static void write_start(struct transfer *xf, int last)
 {
-    struct options *po;
-    char retbuf[OPTBUFSIZE];
-    char *p = *ap;
-    size_t optlen, retlen;
-    char *vend;
-    uintmax_t v;
+    int n, len;
 
-    /* Global option-parsing variables initialization */
-    blksize_set = 0;
+    if (xf->flags & (XF_WRITING | XF_SYNCING))
+        return;
 
-    if (!*opt || !*val)
+    n = rw_write_start(&xf->rw, xf->wiov, RW_IOV_MAX, &len);
+    if (!n)
         return;
+    xf->wlen = len;
+    if (engine_write(xf, xf->wiov, n, xf->rw.pos,
+                     want_sync(xf, xf->rw.pos + len, last))) {
+        syslog(LOG_WARNING, "tftpd: write: %m");
+        nak(xf, errno + 100, NULL);
+        xf_done(xf);
+    }
+}
 
-    errno = 0;
-    v = strtoumax(val, &vend, 10);
-    if (*vend || errno == ERANGE)
-	return;
+/*
+ * Carry on once the engine has finished writing (and syncing).
+ */
+static void write_next(struct transfer *xf)
+{
+    if (xf->flags & (XF_WRITING | XF_SYNCING))
+        return;                 /* The sync is still to come */
 
-    for (po = options; po->o_opt; po++)
-        if (!strcasecmp(po->o_opt, opt)) {
-            if (po->o_fnc(&v)) {
-		optlen = strlen(opt);
-		retlen = sprintf(retbuf, "%"PRIuMAX, v);
+    if (xf->state == XS_DONE) {
+        xf_done(xf);            /* Close the file now */
+        return;
+    }
 
-                if (p + optlen + retlen + 2 >= ackbuf + sizeof(ackbuf)) {
-                    nak(EOPTNEG, "Insufficient space for options");
-                    exit(0);
-                }
-		
-		memcpy(p, opt, optlen+1);
-		p += optlen+1;
-		memcpy(p, retbuf, retlen+1);
-		p += retlen+1;
+    if (xf->state == XS_WRITE) {
+        if (xf->size < xf->segsize) {
+            /* The last block is in; once it is written, we're done */
+            if (rw_pending(&xf->rw)) {
+                write_start(xf, 1);
             } else {
-                nak(EOPTNEG, "Unsupported option(s) requested");
-                exit(0);
+                close_upload(xf);
+                send_final_ack(xf);
             }
-            break;
+            return;
         }
 
-    *ap = p;
-}
+        /* Every buffer was waiting to be written; now there's room to
+           take the next block */
+        xf->dp = rw_w_get(&xf->rw);
+        xf->state = XS_RECV;
+        send_ack(xf);
+    }
 
-#ifdef WITH_REGEX
+    if (xf->state == XS_RECV && rw_pending(&xf->rw) >= xf->rw.depth / 2)
+        write_start(xf, 0);
+}
 
 /*
- * This is called by the remap engine when it encounters macros such
- * as \i.  It should write the output in "output" if non-NULL, and
- * return the length of the output (generated or not).
- *
- * Return -1 on failure.
+ * The engine has written a batch of blocks; n is the number of bytes
+ * written, or -errno.
  */
-static int rewrite_macros(char macro, char *output)
+void xf_writedone(struct transfer *xf, int n)
 {
-    char *p, tb[INET6_ADDRSTRLEN];
-    int l=0;
-
-    switch (macro) {
-    case 'i':
-        p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
-                              tb, INET6_ADDRSTRLEN);
-        if (output && p)
-            strcpy(output, p);
-        if (!p)
-            return 0;
-        else
-            return strlen(p);
-
-    case 'x':
-        if (output) {
-            if (from.sa.sa_family == AF_INET) {
-                sprintf(output, "%08lX",
-                    (unsigned long)ntohl(from.si.sin_addr.s_addr));
-                l = 8;
-#ifdef HAVE_IPV6
-            } else {
-                unsigned char *c = (unsigned char *)SOCKADDR_P(&from);
-                p = tb;
-                for (l = 0; l < 16; l++) {
-                    sprintf(p, "%02X", *c);
-                    c++;
-                    p += 2;
-                }
-                strcpy(output, tb);
-                l = strlen(tb);
-#endif
-            }
-        }
-        return l;
+    xf->flags &= ~XF_WRITING;
+    rw_write_done(&xf->rw, n > 0 ? n : 0);
 
-    default:
-        return -1;
+    if (n != xf->wlen && xf->state != XS_DONE) {
+        /* A short write means the disk is full */
+        nak(xf, write_error(n < 0 ? -n : ENOSPC), NULL);
+        xf_done(xf);
     }
+    write_next(xf);
 }
 
 /*
- * Modify the filename, if applicable.  If it returns NULL, deny the access.
+ * The engine has synced the file after a write; n is 0 or -errno.
  */
-static char *rewrite_access(char *filename, int mode, const char **msg)
+void xf_syncdone(struct transfer *xf, int n)
 {
-    if (rewrite_rules) {
-        char *newname =
-            rewrite_string(filename, rewrite_rules,
-			   mode != RRQ ? 'P' : 'G',
-                           rewrite_macros, msg);
-        filename = newname;
+    xf->flags &= ~XF_SYNCING;
+
+    if (n < 0 && xf->state != XS_DONE) {
+        nak(xf, write_error(-n), NULL);
+        xf_done(xf);
+    } else if (!n) {
+        xf->synced = xf->rw.pos;
     }
-    return filename;
+    write_next(xf);
 }
 
-#else
-static char *rewrite_access(char *filename, int mode, const char **msg)
+/*
+ * Take a data block of n bytes, leaving the engine to write it out.
+ */
+static void recv_block_async(struct transfer *xf, int n)
 {
-    (void)mode;                 /* Avoid warning */
-    (void)msg;
-    return filename;
+    /* If it arrived while we were waiting for a write, it is in the
+       spare buffer */
+    if (xf->rxbuf != xf->dp)
+        memcpy(xf->dp->th_data, ((struct tftphdr *)xf->rxbuf)->th_data,
+               n - 4);
+
+    xf->size = n - 4;
+    rw_w_put(&xf->rw, xf->size);
+    if (xf->size == xf->segsize && (xf->dp = rw_w_get(&xf->rw))) {
+        xf->rxbuf = xf->dp;
+        if (rw_pending(&xf->rw) >= xf->rw.depth / 2)
+            write_start(xf, 0);
+        send_ack(xf);
+        return;
+    }
+
+    /* Either that was the last block, or there's no buffer free for
+       the next one: hold the ACK until the write is done.  The client
+       can only resend this block meanwhile. */
+    xf->state = XS_WRITE;
+    xf->rxbuf = xf->spare;
+    write_start(xf, xf->size < xf->segsize);
 }
 #endif
 
-static FILE *file;
 /*
- * Validate file access.  Since we
- * have no uid or gid, for now require
- * file to exist and be publicly
- * readable/writable, unless -p specified.
- * If we were invoked with arguments
- * from inetd then the file must also be
- * in one of the given directory prefixes.
- * Note also, full path name must be
- * given as we have no login directory.
+ * Receive a file.
  */
-static int validate_access(char *filename, int mode,
-			   const struct formats *pf, const char **errmsg)
+static void tftp_recvfile(struct transfer *xf)
 {
-    struct stat stbuf;
-    int i, len;
-    int fd, wmode, rmode;
-    char *cp;
-    const char **dirp;
-    char stdio_mode[3];
-
-    tsize_ok = 0;
-    *errmsg = NULL;
-
-    if (!secure) {
-        if (*filename != '/') {
-            *errmsg = "Only absolute filenames allowed";
-            return (EACCESS);
-        }
-
-        /*
-         * prevent tricksters from getting around the directory
-         * restrictions
-         */
-        len = strlen(filename);
-        for (i = 1; i < len - 3; i++) {
-            cp = filename + i;
-            if (*cp == '.' && memcmp(cp - 1, "/../", 4) == 0) {
-                *errmsg = "Reverse path not allowed";
-                return (EACCESS);
-            }
-        }
-
-        for (dirp = dirs; *dirp; dirp++)
-            if (strncmp(filename, *dirp, strlen(*dirp)) == 0)
-                break;
-        if (*dirp == 0 && dirp != dirs) {
-            *errmsg = "Forbidden directory";
-            return (EACCESS);
-        }
+    int depth = WRITE_BATCH / xf->segsize;
+
+    if (depth > RW_IOV_MAX)
+        depth = RW_IOV_MAX;
+    if (depth < WRITE_BEHIND)
+        depth = WRITE_BEHIND;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE) && \
+    defined(HAVE_FTRUNCATE)
+    /* Reserve the space for a binary file of the size the client
+       gave (c.f. RFC2349), and if there isn't room, say so now */
+    if (!xf->pf->f_convert && xf->tsize > 0 &&
+        fallocate(xf->fd, FALLOC_FL_KEEP_SIZE, 0, xf->tsize) &&
+        write_error(errno) == ENOSPACE) {
+        xf->tsize = 0;
+        nak(xf, ENOSPACE, NULL);
+        xf_done(xf);
+        return;
     }
-
-    /*
-     * We use different a different permissions scheme if `cancreate' is
-     * set.
-     */
-    wmode = O_WRONLY | (cancreate ? O_CREAT : 0) | (pf->f_convert ? O_TEXT : O_BINARY);
-    rmode = O_RDONLY | (pf->f_convert ? O_TEXT : O_BINARY);
-
-#ifndef HAVE_FTRUNCATE
-    wmode |= O_TRUNC;		/* This really sucks on a dupe */
 #endif
-
-    fd = open(filename, mode == RRQ ? rmode : wmode, 0666);
-    if (fd < 0) {
-        switch (errno) {
-        case ENOENT:
-        case ENOTDIR:
-            return ENOTFOUND;
-        case ENOSPC:
-            return ENOSPACE;
-        case EEXIST:
-            return EEXISTS;
-        default:
-            return errno + 100;
-        }
+#ifdef WITH_URING
+    if (xf->engine && engine_async(xf->engine) && !xf->pf->f_convert) {
+        xf->flags |= XF_ASYNC;
+        xf->wiov = tfmalloc(depth * sizeof *xf->wiov);
+        xf->spare = tfmalloc(xf->segsize + 4);
     }
+#endif
 
-    if (fstat(fd, &stbuf) < 0)
-        exit(EX_OSERR);         /* This shouldn't happen */
-
-    /* A duplicate RRQ or (worse!) WRQ packet could really cause havoc... */
-    if (lock_file(fd, mode != RRQ))
-	exit(0);
+    xf->dp = rw_w_init(&xf->rw, xf->segsize, depth);
+    xf->block = 0;
+    xf->state = XS_RECV;
+    xf->rxbuf = xf->dp;
+    xf->rxlen = xf->segsize + 4;
+    send_ack(xf);
+}
 
-    if (mode == RRQ) {
-        if (!unixperms && (stbuf.st_mode & (S_IREAD >> 6)) == 0) {
-            *errmsg = "File must have global read permissions";
-            return (EACCESS);
-        }
-        tsize = stbuf.st_size;
-        /* We don't know the tsize if conversion is needed */
-        tsize_ok = !pf->f_convert;
-    } else {
-        if (!unixperms) {
-            if ((stbuf.st_mode & (S_IWRITE >> 6)) == 0) {
-                *errmsg = "File must have global write permissions";
-                return (EACCESS);
-            }
-        }
+/*
+ * Store a data block which arrived in xf->dp.
+ */
+static void recv_block(struct transfer *xf, int n)
+{
+    int size;
 
-#ifdef HAVE_FTRUNCATE
-	/* We didn't get to truncate the file at open() time */
-	if (ftruncate(fd, (off_t) 0)) {
-	  *errmsg = "Cannot reset file size";
-	  return (EACCESS);
-	}
-#endif
-        tsize = 0;
-        tsize_ok = 1;
+#ifdef WITH_URING
+    if (xf->flags & XF_ASYNC) {
+        recv_block_async(xf, n);
+        return;
     }
+#endif
 
-    stdio_mode[0] = (mode == RRQ) ? 'r' : 'w';
-    stdio_mode[1] = (pf->f_convert) ? 't' : 'b';
-    stdio_mode[2] = '\0';
+    /*  size = write(file, dp->th_data, n - 4); */
+    size = rw_writeit(&xf->rw, xf->fd, &xf->dp, n - 4,
+                      xf->pf->f_convert);
+    if (size < 0) {             /* ahem */
+        nak(xf, write_error(errno), NULL);
+        xf_done(xf);
+        return;
+    }
+    xf->rxbuf = xf->dp;
 
-    file = fdopen(fd, stdio_mode);
-    if (file == NULL)
-        exit(EX_OSERR);         /* Internal error */
+    if (size == xf->segsize) {
+        send_ack(xf);
+        return;
+    }
 
-    return (0);
+    if (xf_flush(xf, 1))
+        return;
+    close_upload(xf);           /* close data file */
+    send_final_ack(xf);
 }
 
 /*
- * Send the requested file.
+ * Process a packet of n bytes which arrived in xf->rxbuf.
  */
-static void tftp_sendfile(const struct formats *pf, struct tftphdr *oap, int oacklen)
-{
-    struct tftphdr *dp;
-    struct tftphdr *ap;         /* ack packet */
-    static u_short block = 1;   /* Static to avoid longjmp funnies */
-    u_short ap_opcode, ap_block;
-    unsigned long r_timeout;
-    int size, n;
-
-    if (oap) {
-        timeout = rexmtval;
-        (void)sigsetjmp(timeoutbuf, 1);
-      oack:
-        r_timeout = timeout;
-        if (send(peer, oap, oacklen, 0) != oacklen) {
-            syslog(LOG_WARNING, "tftpd: oack: %m\n");
-            goto abort;
-        }
-        for (;;) {
-            n = recv_time(peer, ackbuf, sizeof(ackbuf), 0, &r_timeout);
-            if (n < 0) {
-                syslog(LOG_WARNING, "tftpd: read: %m\n");
-                goto abort;
-            }
-            ap = (struct tftphdr *)ackbuf;
-            ap_opcode = ntohs((u_short) ap->th_opcode);
-            ap_block = ntohs((u_short) ap->th_block);
-
-            if (ap_opcode == ERROR) {
-                syslog(LOG_WARNING,
-                       "tftp: client does not accept options\n");
-                goto abort;
-            }
-            if (ap_opcode == ACK) {
-                if (ap_block == 0)
-                    break;
-                /* Resynchronize with the other side */
-                (void)synchnet(peer);
-                goto oack;
-            }
-        }
+void xf_input(struct transfer *xf, int n)
+{
+    struct tftphdr *tp = xf->rxbuf;
+    u_short opcode, block;
+
+    if (n < 4) {
+        /* Too short to mean anything; but an ERROR is an ERROR */
+        if (n >= 2 && ntohs((u_short) tp->th_opcode) == ERROR)
+            xf_done(xf);
+        return;
     }
+    opcode = ntohs((u_short) tp->th_opcode);
+    block = ntohs((u_short) tp->th_block);
 
-    dp = r_init();
-    do {
-        size = readit(file, &dp, pf->f_convert);
-        if (size < 0) {
-            nak(errno + 100, NULL);
-            goto abort;
-        }
-        dp->th_opcode = htons((u_short) DATA);
-        dp->th_block = htons((u_short) block);
-        timeout = rexmtval;
-        (void)sigsetjmp(timeoutbuf, 1);
+    if (opcode == ERROR) {
+        if (xf->state == XS_OACK)
+            syslog(LOG_WARNING, "tftp: client does not accept options\n");
+        xf_done(xf);
+        return;
+    }
 
-        r_timeout = timeout;
-        if (send(peer, dp, size + 4, 0) != size + 4) {
-            syslog(LOG_WARNING, "tftpd: write: %m");
-            goto abort;
-        }
-        read_ahead(file, pf->f_convert);
-        for (;;) {
-            n = recv_time(peer, ackbuf, sizeof(ackbuf), 0, &r_timeout);
-            if (n < 0) {
-                syslog(LOG_WARNING, "tftpd: read(ack): %m");
-                goto abort;
+    switch (xf->state) {
+    case XS_OACK:
+        if (opcode == ACK) {
+            if (block == 0) {
+                xf_rtt(xf);
+                xf->state = XS_SEND;
+                if (xf->window > 1)
+                    send_window(xf);
+                else
+                    send_block(xf);
+            } else {
+                /* Resynchronize with the other side */
+                (void)synchnet(xf->peer);
+                send_oack(xf);
             }
-            ap = (struct tftphdr *)ackbuf;
-            ap_opcode = ntohs((u_short) ap->th_opcode);
-            ap_block = ntohs((u_short) ap->th_block);
-
-            if (ap_opcode == ERROR)
-                goto abort;
-
-            if (ap_opcode == ACK) {
-                if (ap_block == block) {
+        }
+        break;
+
+    case XS_SEND:
+        if (opcode == ACK) {
+            if (xf->window > 1) {
+                ack_window(xf, block);
+            } else if (block == xf->block) {
+                xf_rtt(xf);
+                if (xf->size != xf->segsize) {
+                    xf_done(xf);
                     break;
                 }
+                if (!++xf->block)
+                    xf->block = xf->rollover_val;
+                send_block(xf);
+            } else {
                 /* Re-synchronize with the other side */
-                (void)synchnet(peer);
+                (void)synchnet(xf->peer);
                 /*
                  * RFC1129/RFC1350: We MUST NOT re-send the DATA
                  * packet in response to an invalid ACK.  Doing so
                  * would cause the Sorcerer's Apprentice bug.
                  */
             }
+        }
+        break;
+
+    case XS_RECV:
+        if (opcode == DATA) {
+            if (block == xf->block) {
+                xf_rtt(xf);
+                recv_block(xf, n);
+            } else {
+                /* Re-synchronize with the other side */
+                (void)synchnet(xf->peer);
+                if (block == (u_short)(xf->block - 1)) {
+                    xf->flags |= XF_RETRANS;
+                    xf->retransmits++;
+                    resend_ack(xf);     /* rexmit */
+                }
+            }
+        }
+        break;
 
+    case XS_WRITE:
+        /* The client waits for our ACK, which waits for the disk */
+        break;
+
+    case XS_DALLY:
+        if (opcode == DATA && block == xf->block) {
+            /* My last ack was lost */
+            (void)xf_send(xf, xf->ctlbuf, 4);
+            xf_done(xf);
         }
-	if (!++block)
-	  block = rollover_val;
-    } while (size == segsize);
-  abort:
-    (void)fclose(file);
+        break;
+
+    case XS_DONE:
+        break;
+    }
 }
 
 /*
- * Receive a file.
+ * The retransmission timer has expired.
  */
-static void tftp_recvfile(const struct formats *pf, struct tftphdr *oap, int oacklen)
+void xf_timeout(struct transfer *xf)
 {
-    struct tftphdr *dp;
-    int n, size;
-    /* These are "static" to avoid longjmp funnies */
-    static struct tftphdr *ap;  /* ack buffer */
-    static u_short block = 0;
-    static int acksize;
-    u_short dp_opcode, dp_block;
-    unsigned long r_timeout;
-
-    dp = w_init();
-    do {
-        timeout = rexmtval;
-
-        if (!block && oap) {
-            ap = (struct tftphdr *)ackbuf;
-            acksize = oacklen;
+    xf->timeout <<= 1;
+    if (xf->timeout >= xf->maxtimeout || xf->state == XS_DALLY) {
+        xf_done(xf);
+        return;
+    }
+    xf->flags |= XF_RETRANS;
+    xf->retransmits++;
+
+    switch (xf->state) {
+    case XS_OACK:
+        send_oack(xf);
+        break;
+    case XS_SEND:
+        if (xf->window > 1) {
+            /* Go back to the first unacknowledged block */
+            xf->sent = xf->acked;
+            send_window(xf);
         } else {
-            ap = (struct tftphdr *)ackbuf;
-            ap->th_opcode = htons((u_short) ACK);
-            ap->th_block = htons((u_short) block);
-            acksize = 4;
-            /* If we're sending a regular ACK, that means we have successfully
-             * sent the OACK. Clear oap so that we won't try to send another
-             * OACK when the block number wraps back to 0. */
-            oap = NULL;
-        }
-        if (!++block)
-	  block = rollover_val;
-        (void)sigsetjmp(timeoutbuf, 1);
-      send_ack:
-        r_timeout = timeout;
-        if (send(peer, ackbuf, acksize, 0) != acksize) {
-            syslog(LOG_WARNING, "tftpd: write(ack): %m");
-            goto abort;
-        }
-        write_behind(file, pf->f_convert);
-        for (;;) {
-            n = recv_time(peer, dp, PKTSIZE, 0, &r_timeout);
-            if (n < 0) {        /* really? */
-                syslog(LOG_WARNING, "tftpd: read: %m");
-                goto abort;
-            }
-            dp_opcode = ntohs((u_short) dp->th_opcode);
-            dp_block = ntohs((u_short) dp->th_block);
-            if (dp_opcode == ERROR)
-                goto abort;
-            if (dp_opcode == DATA) {
-                if (dp_block == block) {
-                    break;      /* normal */
-                }
-                /* Re-synchronize with the other side */
-                (void)synchnet(peer);
-                if (dp_block == (block - 1))
-                    goto send_ack;      /* rexmit */
-            }
-        }
-        /*  size = write(file, dp->th_data, n - 4); */
-        size = writeit(file, &dp, n - 4, pf->f_convert);
-        if (size != (n - 4)) {  /* ahem */
-            if (size < 0)
-                nak(errno + 100, NULL);
-            else
-                nak(ENOSPACE, NULL);
-            goto abort;
+            resend_block(xf);
         }
-    } while (size == segsize);
-    write_behind(file, pf->f_convert);
-    (void)fclose(file);         /* close data file */
-
-    ap->th_opcode = htons((u_short) ACK);       /* send the "final" ack */
-    ap->th_block = htons((u_short) (block));
-    (void)send(peer, ackbuf, 4, 0);
-
-    timeout_quit = 1;           /* just quit on timeout */
-    n = recv_time(peer, buf, sizeof(buf), 0, &timeout); /* normally times out and quits */
-    timeout_quit = 0;
-
-    if (n >= 4 &&               /* if read some data */
-        dp_opcode == DATA &&    /* and got a data block */
-        block == dp_block) {    /* then my last ack was lost */
-        (void)send(peer, ackbuf, 4, 0); /* resend final ack */
+        break;
+    case XS_RECV:
+        resend_ack(xf);
+        break;
+    case XS_WRITE:
+        xf_arm(xf);
+        break;
+    default:
+        break;
     }
-  abort:
-    return;
 }
 
 static const char *const errmsgs[] = {
@@ -1752,12 +4074,13 @@ static const char *const errmsgs[] = {
  * standard TFTP codes, or a UNIX errno
  * offset by 100.
  */
-static void nak(int error, const char *msg)
+static void nak(struct transfer *xf, int error, const char *msg)
 {
     struct tftphdr *tp;
     int length;
+    char tmpbuf[INET6_ADDRSTRLEN], *tmp_p;
 
-    tp = (struct tftphdr *)buf;
+    tp = (struct tftphdr *)xf->ctlbuf;
     tp->th_opcode = htons((u_short) ERROR);
 
     if (error >= 100) {
@@ -1775,12 +4098,16 @@ static void nak(int error, const char *msg)
 
     tp->th_code = htons((u_short) error);
 
-    length = strlen(msg) + 1;
+    length = strlen(msg);
+    if (length > (int)sizeof(xf->ctlbuf) - 5)
+        length = sizeof(xf->ctlbuf) - 5;
     memcpy(tp->th_msg, msg, length);
+    tp->th_msg[length++] = '\0';
     length += 4;                /* Add space for header */
 
     if (verbosity >= 2) {
-        tmp_p = (char *)inet_ntop(from.sa.sa_family, SOCKADDR_P(&from),
+        tmp_p = (char *)inet_ntop(xf->from.sa.sa_family,
+                                  SOCKADDR_P(&xf->from),
                                   tmpbuf, INET6_ADDRSTRLEN);
         if (!tmp_p) {
             tmp_p = tmpbuf;
@@ -1790,6 +4117,6 @@ static void nak(int error, const char *msg)
                error, tp->th_msg, tmp_p);
     }
 
-    if (send(peer, buf, length, 0) != length)
+    if (xf_send(xf, xf->ctlbuf, length) != length)
         syslog(LOG_WARNING, "nak: %m");
 }
@@ -17,9 +17,124 @@
 #ifndef TFTPD_TFTPD_H
 #define TFTPD_TFTPD_H
 
+#include "common/tftpsubs.h"
+#include "timer.h"
+#include "arena.h"
+
+#define CTLSIZE  (SEGSIZE+4)    /* Room for an ACK or ERROR packet */
+#define XF_ARENA 1024           /* Arena space inside a transfer */
+
+struct formats;
+struct engine;
+struct cfile;
+struct myrecv;
+
+/* Transfer states */
+enum xfer_state {
+    XS_OACK,                    /* RRQ: OACK sent, waiting for ACK 0 */
+    XS_SEND,                    /* RRQ: DATA sent, waiting for its ACK */
+    XS_RECV,                    /* WRQ: ACK sent, waiting for DATA */
+    XS_WRITE,                   /* WRQ: waiting for blocks to be written */
+    XS_DALLY,                   /* WRQ: final ACK sent, waiting for dupes */
+    XS_DONE                     /* Finished, successfully or not */
+};
+
+/* Transfer flags */
+#define XF_ASYNC	0x01    /* File I/O is queued on the engine */
+#define XF_READING	0x02    /* A block read is in flight */
+#define XF_RECV		0x04    /* Engine receive in flight */
+#define XF_TIMER	0x08    /* Engine timeout in flight */
+#define XF_TIMEDOUT	0x10    /* The engine timeout expired */
+#define XF_CANCEL	0x20    /* Engine operations are being cancelled */
+#define XF_ZEROCOPY	0x40    /* Send mapped blocks with MSG_ZEROCOPY */
+#define XF_ROLLBACK	0x80    /* Window resent for a repeated ACK */
+#define XF_NOGSO	0x100   /* UDP GSO doesn't work for this transfer */
+#define XF_ADAPTIVE	0x200   /* Derive the timeout from the RTT */
+#define XF_RETRANS	0x400   /* Last packet was retransmitted (Karn) */
+#define XF_PREAD	0x800   /* Blocks are read from their offset as sent */
+#define XF_WRITING	0x1000  /* A write of received blocks is in flight */
+#define XF_SYNCING	0x2000  /* An fdatasync() is in flight */
+
+/*
+ * Everything we need to know about a single transfer.  The forked child
+ * has exactly one of these; the multiplexing engine has one per active
+ * transfer.
+ */
+struct transfer {
+    struct timer timer;         /* Engine timer for the deadline */
+    int peer;                   /* Socket connected to the client */
+    union sock_addr from;       /* Client address */
+    union sock_addr myaddr;     /* Local address the request came in on */
+    const struct formats *pf;
+    enum xfer_state state;
+    u_short opcode;             /* RRQ or WRQ */
+    u_short block;              /* Current block number */
+    uint16_t rollover_val;      /* Block number to use after wrapping */
+    int segsize;                /* Negotiated block size */
+    int blksize_set;
+    off_t tsize;
+    int tsize_ok;
+    unsigned long timeout;      /* Current timeout value (us) */
+    unsigned long rexmtval;     /* Basic timeout value (us) */
+    unsigned long maxtimeout;
+    unsigned long long deadline;        /* Next timeout (see monotime()) */
+    int fd;                     /* File being sent or received, or -1 */
+    struct rw_state rw;         /* Read-ahead/write-behind buffers */
+    struct tftphdr *dp;         /* Current data packet */
+    int size;                   /* Bytes of data in dp */
+    char *oack;                 /* OACK packet, if options negotiated */
+    int oacklen;
+    const char *ackp;           /* ACK or OACK to (re)send */
+    int acksize;
+    off_t offset;               /* File offset of the next block */
+    char *map;                  /* Mapping of an octet file, if any */
+    size_t maplen;
+    struct cfile *cache;        /* File cache entry the map belongs to */
+    void *rxbuf;                /* Where to receive the next packet */
+    int rxlen;
+    char ctlbuf[CTLSIZE];       /* ACK and ERROR packets */
+    char rxack[4];              /* Incoming ACK while sending */
+    struct engine *engine;      /* Engine running this transfer, if any */
+    int flags;                  /* XF_* */
+    int pending;                /* Engine operations in flight */
+    int recvd;                  /* Result of the last engine receive */
+    int window;                 /* Blocks sent per ACK (c.f. RFC7440) */
+    unsigned long long acked;   /* Blocks of the file acknowledged, */
+    unsigned long long sent;    /* ... sent so far in this window, */
+    unsigned long long last;    /* ... and in the whole file, once known */
+    char *hdrs;                 /* DATA headers of a window sent from a map */
+    struct iovec *wiov;         /* Blocks being written by the engine, */
+    int wlen;                   /* ... and their length */
+    off_t synced;               /* File data known to be on disk */
+    void *spare;                /* Receive buffer while the ring is full */
+    unsigned long long armed;   /* When the timer was last started */
+    long srtt;                  /* Smoothed RTT (us, scaled by 8) */
+    long rttvar;                /* RTT mean deviation (us, scaled by 4) */
+    unsigned long rtt_min, rtt_max;
+    unsigned int rtt_samples;
+    unsigned int retransmits;   /* Timeouts and retransmissions */
+    struct arena arena;         /* Filename and OACK, freed with this */
+    char arenabuf[XF_ARENA];    /* Where the arena starts out */
+};
+
+/* tftpd.c */
+int recv_requests(int, struct myrecv *, int, int);
+void set_socket_nonblock(int, int);
+struct transfer *xf_request(struct engine *, int, struct tftphdr *, int,
+                            const union sock_addr *, const union sock_addr *);
+void xf_input(struct transfer *, int);
+void xf_readdone(struct transfer *, int);
+void xf_writedone(struct transfer *, int);
+void xf_syncdone(struct transfer *, int);
+void xf_timeout(struct transfer *);
+void xf_free(struct transfer *);
+
+/* misc.c */
 void set_signal(int, void (*)(int), int);
 void *tfmalloc(size_t);
+void *tfrealloc(void *, size_t);
 char *tfstrdup(const char *);
+unsigned long long monotime(void);
 
 extern int verbosity;
 
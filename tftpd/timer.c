@@ -0,0 +1,192 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * timer.c
+ *
+ * Hierarchical timer wheel.  Level 0 has a slot for each of the next
+ * TW_SIZE ticks; each level above has slots TW_SIZE times as wide,
+ * which are cascaded down a level when the wheel reaches them.  Arming,
+ * cancelling and expiring a timer are all O(1); only cascading touches
+ * a timer more than once, and at most once per level.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include <limits.h>
+#include "timer.h"
+
+static void tw_link(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void tw_unlink(struct timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+/*
+ * Put a timer in the slot for its expiry tick, at the lowest level
+ * which reaches that far.  Timers beyond the top level wait in its
+ * last slot, and are put back where they belong when it cascades.
+ */
+static void tw_insert(struct wheel *w, struct timer *t)
+{
+    unsigned long long x = t->expires;
+    unsigned long long d;
+    int l;
+
+    if (x < w->now)
+        x = w->now;
+    d = x - w->now;
+    if (d >= 1ULL << (TW_BITS * TW_LEVELS)) {
+        d = (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+        x = w->now + d;
+    }
+
+    for (l = 0; d >= 1ULL << (TW_BITS * (l + 1)); l++) ;
+    tw_link(&w->slot[l][(x >> (TW_BITS * l)) & TW_MASK], t);
+}
+
+void wheel_init(struct wheel *w, unsigned long long now)
+{
+    memset(w, 0, sizeof *w);
+    w->now = now / TW_TICK;
+}
+
+void timer_arm(struct wheel *w, struct timer *t, unsigned long long when)
+{
+    unsigned long long x = (when + TW_TICK - 1) / TW_TICK;
+
+    if (t->pprev) {
+        if (t->expires == x)
+            return;
+        tw_unlink(t);
+    } else {
+        w->count++;
+    }
+    t->expires = x;
+    tw_insert(w, t);
+}
+
+void timer_cancel(struct wheel *w, struct timer *t)
+{
+    if (t->pprev) {
+        tw_unlink(t);
+        w->count--;
+    }
+}
+
+/*
+ * Move the timers in a slot of an upper level down to where they now
+ * belong.
+ */
+static void tw_cascade(struct wheel *w, int l, int i)
+{
+    struct timer *t, *next;
+
+    t = w->slot[l][i];
+    w->slot[l][i] = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        tw_insert(w, t);
+    }
+}
+
+struct timer *wheel_expired(struct wheel *w, unsigned long long now)
+{
+    unsigned long long tick = now / TW_TICK;
+    struct timer *t;
+    int i, l;
+
+    for (;;) {
+        t = w->due;
+        if (t) {
+            tw_unlink(t);
+            w->count--;
+            return t;
+        }
+
+        if (w->now > tick)
+            return NULL;
+        if (!w->count) {
+            w->now = tick + 1;
+            return NULL;
+        }
+
+        i = w->now & TW_MASK;
+        for (l = 1; !i && l < TW_LEVELS; l++) {
+            i = (w->now >> (TW_BITS * l)) & TW_MASK;
+            tw_cascade(w, l, i);
+        }
+
+        /* Hand out this tick's timers one at a time; they stay
+           linked on the due list so they can still be cancelled */
+        i = w->now & TW_MASK;
+        w->due = w->slot[0][i];
+        if (w->due)
+            w->due->pprev = &w->due;
+        w->slot[0][i] = NULL;
+        w->now++;
+    }
+}
+
+int wheel_next(const struct wheel *w, unsigned long long now)
+{
+    unsigned long long next = 0, base, x, dt;
+    int k, l;
+
+    if (!w->count)
+        return -1;
+    if (w->due)
+        return 0;
+
+    for (k = 0; k < TW_SIZE; k++) {
+        if (w->slot[0][(w->now + k) & TW_MASK]) {
+            next = w->now + k;
+            break;
+        }
+    }
+
+    /* An upper level slot has to be cascaded once the wheel reaches
+       it, which is the earliest any of its timers can be due.  The
+       slot the wheel is in comes round again after a full turn,
+       unless the wheel is at its very start and hasn't cascaded it
+       yet. */
+    for (l = 1; l < TW_LEVELS; l++) {
+        base = w->now >> (TW_BITS * l);
+        if (!(w->now & ((1ULL << (TW_BITS * l)) - 1)) &&
+            w->slot[l][base & TW_MASK]) {
+            next = w->now;
+            break;
+        }
+        for (k = 1; k <= TW_SIZE; k++) {
+            if (w->slot[l][(base + k) & TW_MASK]) {
+                x = (base + k) << (TW_BITS * l);
+                if (!next || x < next)
+                    next = x;
+                break;
+            }
+        }
+    }
+
+    if (!next)
+        return 0;               /* Not reached */
+
+    x = next * TW_TICK;
+    dt = (x > now) ? x - now : 0;
+    dt = (dt + 999) / 1000;     /* Round up to milliseconds */
+    return (dt > INT_MAX) ? INT_MAX : (int)dt;
+}
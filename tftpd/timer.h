@@ -0,0 +1,56 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * timer.h
+ *
+ * Hierarchical timer wheel, for the retransmission and dally timers of
+ * the transfers an engine serves.
+ */
+
+#ifndef TFTPD_TIMER_H
+#define TFTPD_TIMER_H
+
+#define TW_TICK		1000    /* Microseconds per tick */
+#define TW_BITS		6       /* Slots per level, log 2 */
+#define TW_LEVELS	4       /* 2^24 ticks, about 4.6 hours */
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;       /* NULL when the timer isn't armed */
+    unsigned long long expires; /* Tick it expires on */
+};
+
+struct wheel {
+    unsigned long long now;     /* Next tick to run */
+    unsigned long count;        /* Timers armed */
+    struct timer *due;          /* Expired, not yet handed out */
+    struct timer *slot[TW_LEVELS][TW_SIZE];
+};
+
+/* Set up an empty wheel, starting at the given time (see monotime()) */
+void wheel_init(struct wheel *, unsigned long long);
+
+/* Arm a timer, or move it if it is already armed, to expire at the
+   given time (see monotime()) */
+void timer_arm(struct wheel *, struct timer *, unsigned long long);
+
+/* Disarm a timer, if it is armed */
+void timer_cancel(struct wheel *, struct timer *);
+
+/* Disarm and return one timer which has expired by the given time, or
+   NULL if there are none */
+struct timer *wheel_expired(struct wheel *, unsigned long long);
+
+/* Milliseconds from the given time until the wheel next needs to run,
+   or -1 if no timers are armed */
+int wheel_next(const struct wheel *, unsigned long long);
+
+#endif                          /* TFTPD_TIMER_H */
@@ -0,0 +1,128 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * timerbench.c
+ *
+ * Microbenchmark for the timer wheel: the cost of arming, re-arming,
+ * cancelling and expiring timers with many of them armed, against the
+ * scan over every transfer the engine used to do each round.
+ *
+ *	make -C tftpd timerbench && ./tftpd/timerbench [timers [rounds]]
+ */
+
+#include "config.h"             /* Must be included first! */
+#include "timer.h"
+
+#define SPREAD	2000000ULL      /* Deadlines up to 2 s out (us) */
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (unsigned long)x;
+}
+
+static void report(const char *what, unsigned long long t, unsigned long n)
+{
+    printf("%-28s %8.1f ns/op\n", what, (double)t / n);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned long rounds = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000;
+    unsigned long long *deadline, clock, first, t;
+    struct timer *timers, *tp;
+    struct wheel w;
+    unsigned long i, r, fired;
+    volatile unsigned long long sink;
+
+    if (!n || !rounds) {
+        fprintf(stderr, "Usage: %s [timers [rounds]]\n", argv[0]);
+        return 1;
+    }
+    timers = calloc(n, sizeof *timers);
+    deadline = calloc(n, sizeof *deadline);
+    if (!timers || !deadline) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("%lu timers armed, deadlines within %llu ms\n", n,
+           SPREAD / 1000);
+
+    clock = 1000000;
+    wheel_init(&w, clock);
+
+    t = now_ns();
+    for (i = 0; i < n; i++) {
+        deadline[i] = clock + rnd() % SPREAD;
+        timer_arm(&w, &timers[i], deadline[i]);
+    }
+    report("arm", now_ns() - t, n);
+
+    /* What a transfer does on every ACK: push its deadline out */
+    t = now_ns();
+    for (i = 0; i < n; i++) {
+        deadline[i] = clock + rnd() % SPREAD;
+        timer_arm(&w, &timers[i], deadline[i]);
+    }
+    report("re-arm", now_ns() - t, n);
+
+    t = now_ns();
+    for (i = 0; i < n; i++) {
+        timer_cancel(&w, &timers[i]);
+        timer_arm(&w, &timers[i], deadline[i]);
+    }
+    report("cancel + arm", now_ns() - t, n);
+
+    /* Run the clock forward a millisecond per round, re-arming
+       whatever expires, and ask for the next deadline each round */
+    fired = 0;
+    t = now_ns();
+    for (r = 0; r < rounds; r++) {
+        clock += 1000;
+        while ((tp = wheel_expired(&w, clock))) {
+            timer_arm(&w, tp, clock + rnd() % SPREAD);
+            fired++;
+        }
+        sink = wheel_next(&w, clock);
+    }
+    t = now_ns() - t;
+    report("wheel round (expire + next)", t, rounds);
+    if (fired)
+        report("per expired timer", t, fired);
+
+    /* The old way: look at every transfer each round */
+    t = now_ns();
+    for (r = 0; r < rounds; r++) {
+        first = 0;
+        for (i = 0; i < n; i++)
+            if (!first || deadline[i] < first)
+                first = deadline[i];
+        sink = first;
+    }
+    report("linear scan round", now_ns() - t, rounds);
+    (void)sink;
+
+    free(timers);
+    free(deadline);
+    return 0;
+}
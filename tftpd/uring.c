@@ -0,0 +1,153 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * uring.c
+ *
+ * Minimal io_uring ring management, using the system calls directly
+ * so we don't depend on liburing.
+ */
+
+#include "config.h"             /* Must be included first! */
+#include "uring.h"
+
+#ifdef WITH_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit,
+                           unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+int uring_init(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len, sqe_len;
+    char *sq_ptr, *cq_ptr;
+    int fd;
+
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE;      /* Leave room for bursts */
+    p.cq_entries = entries * 4;
+    fd = sys_uring_setup(entries, &p);
+    if (fd < 0)
+        return -1;
+
+    /* We rely on the kernel polling sockets for us, on mapping both
+       rings at once, and on never losing a completion */
+    if (!(p.features & IORING_FEAT_FAST_POLL) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP))
+        goto fail;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > sq_len)
+        sq_len = cq_len;
+    sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    cq_ptr = sq_ptr;
+
+    r->sqes = mmap(NULL, sqe_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(sq_ptr, sq_len);
+        goto fail;
+    }
+
+    r->fd = fd;
+    r->entries = p.sq_entries;
+    r->sq.head = (unsigned int *)(sq_ptr + p.sq_off.head);
+    r->sq.tail = (unsigned int *)(sq_ptr + p.sq_off.tail);
+    r->sq.mask = (unsigned int *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq.array = (unsigned int *)(sq_ptr + p.sq_off.array);
+    r->cq.head = (unsigned int *)(cq_ptr + p.cq_off.head);
+    r->cq.tail = (unsigned int *)(cq_ptr + p.cq_off.tail);
+    r->cq.mask = (unsigned int *)(cq_ptr + p.cq_off.ring_mask);
+    r->cq.cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    r->sq_tail = *r->sq.tail;
+
+    return 0;
+
+  fail:
+    close(fd);
+    return -1;
+}
+
+int uring_reserve(struct uring *r, unsigned int n)
+{
+    while (r->entries - (r->sq_tail - __atomic_load_n(r->sq.head,
+                                                      __ATOMIC_ACQUIRE)) < n) {
+        /* Full; push what we have to the kernel.  EBUSY means the
+           completion queue needs reaping first, which we can't do
+           from here. */
+        if (uring_enter(r, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (uring_reserve(r, 1))
+        return NULL;
+
+    idx = r->sq_tail & *r->sq.mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    r->sq.array[idx] = idx;
+    r->sq_tail++;
+
+    return sqe;
+}
+
+int uring_enter(struct uring *r, unsigned int wait_nr)
+{
+    unsigned int to_submit;
+
+    __atomic_store_n(r->sq.tail, r->sq_tail, __ATOMIC_RELEASE);
+    to_submit = r->sq_tail - __atomic_load_n(r->sq.head, __ATOMIC_ACQUIRE);
+    if (!to_submit && !wait_nr)
+        return 0;
+
+    return sys_uring_enter(r->fd, to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+    unsigned int head = *r->cq.head;
+
+    if (head == __atomic_load_n(r->cq.tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &r->cq.cqes[head & *r->cq.mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq.head, *r->cq.head + 1, __ATOMIC_RELEASE);
+}
+
+#endif                          /* WITH_URING */
@@ -0,0 +1,53 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software available under the same license
+ *   as the "OpenBSD" operating system, distributed at
+ *   http://www.openbsd.org/.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * uring.h
+ *
+ * Minimal io_uring ring management, using the system calls directly.
+ */
+
+#ifndef TFTPD_URING_H
+#define TFTPD_URING_H
+
+#ifdef WITH_URING
+
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int entries;       /* Size of the submission queue */
+    unsigned int sq_tail;       /* Our copy, ahead of *sq.tail */
+    struct {
+        unsigned int *head, *tail, *mask, *array;
+    } sq;
+    struct {
+        unsigned int *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+    struct io_uring_sqe *sqes;
+};
+
+/* Set up a ring; returns -1 if the kernel can't do what we need */
+int uring_init(struct uring *, unsigned int);
+
+/* Make room for n submissions, submitting what is queued if need be */
+int uring_reserve(struct uring *, unsigned int);
+
+/* Get a cleared submission queue entry, submitting first if full */
+struct io_uring_sqe *uring_sqe(struct uring *);
+
+/* Submit everything queued, and wait for at least n completions */
+int uring_enter(struct uring *, unsigned int);
+
+/* Look at the next completion, or NULL if none; then mark it seen */
+struct io_uring_cqe *uring_cqe(struct uring *);
+void uring_cqe_seen(struct uring *);
+
+#endif                          /* WITH_URING */
+#endif                          /* TFTPD_URING_H */